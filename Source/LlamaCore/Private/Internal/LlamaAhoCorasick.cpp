@@ -0,0 +1,78 @@
+#include "Internal/LlamaAhoCorasick.h"
+
+void FLlamaAhoCorasick::Build(const std::vector<std::string>& Patterns)
+{
+    Transitions.assign(256, -1);
+    Depths.assign(1, 0);
+    Outputs.assign(1, 0);
+    NumPatterns = 0;
+
+    //Trie
+    for (const std::string& Pattern : Patterns)
+    {
+        if (Pattern.empty())
+        {
+            continue;
+        }
+        NumPatterns++;
+
+        int32 State = 0;
+        for (const char Char : Pattern)
+        {
+            const int32 Index = State * 256 + (uint8)Char;
+            if (Transitions[Index] < 0)
+            {
+                Transitions[Index] = Depths.size();
+                Transitions.resize(Transitions.size() + 256, -1);
+                Depths.push_back(Depths[State] + 1);
+                Outputs.push_back(0);
+            }
+            State = Transitions[Index];
+        }
+        Outputs[State] = FMath::Max(Outputs[State], (int32)Pattern.size());
+    }
+
+    //Breadth first so every fail target is complete before the states that fall back to it
+    std::vector<int32> Fail(Depths.size(), 0);
+    std::vector<int32> Queue;
+    Queue.reserve(Depths.size());
+
+    for (int32 Byte = 0; Byte < 256; Byte++)
+    {
+        int32& Next = Transitions[Byte];
+        if (Next < 0)
+        {
+            Next = 0;
+        }
+        else
+        {
+            Queue.push_back(Next);
+        }
+    }
+
+    for (int32 Head = 0; Head < (int32)Queue.size(); Head++)
+    {
+        const int32 State = Queue[Head];
+        Outputs[State] = FMath::Max(Outputs[State], Outputs[Fail[State]]);
+
+        for (int32 Byte = 0; Byte < 256; Byte++)
+        {
+            const int32 FailNext = Transitions[Fail[State] * 256 + Byte];
+            int32& Next = Transitions[State * 256 + Byte];
+            if (Next < 0)
+            {
+                Next = FailNext;
+            }
+            else
+            {
+                Fail[Next] = FailNext;
+                Queue.push_back(Next);
+            }
+        }
+    }
+}
+
+bool FLlamaAhoCorasick::IsEmpty() const
+{
+    return NumPatterns == 0;
+}
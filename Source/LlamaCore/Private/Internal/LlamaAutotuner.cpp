@@ -0,0 +1,321 @@
+#include "Internal/LlamaAutotuner.h"
+#include <vector>
+#include "LlamaUtility.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/SecureHash.h"
+
+namespace
+{
+    //Hashing the whole file would take longer than the probes, size + head + tail tells gguf files apart well enough
+    constexpr int64 AutotuneHashChunkBytes = 1024 * 1024;
+
+    //Bump when the probes change, results from older probes are then measured again
+    constexpr int32 AutotuneCacheVersion = 3;
+
+    //Each micro batch candidate prefills this many of its own chunks, so they time several decodes without all paying for the largest
+    constexpr int32 AutotunePrefillChunks = 2;
+    constexpr int32 AutotuneMaxMicroBatch = 512;
+    constexpr int32 AutotuneContextLength = AutotuneMaxMicroBatch * AutotunePrefillChunks;
+    constexpr int32 AutotuneDecodeTokens = 16;
+    const int32 AutotuneMicroBatchCandidates[] = { 128, 256, AutotuneMaxMicroBatch };
+
+    FString HashModelFile(const FString& FilePath)
+    {
+        TUniquePtr<IFileHandle> File(FPlatformFileManager::Get().GetPlatformFile().OpenRead(*FilePath));
+        if (!File)
+        {
+            return FString();
+        }
+
+        const int64 FileSize = File->Size();
+        FMD5 Md5;
+        Md5.Update((const uint8*)&FileSize, sizeof(FileSize));
+
+        TArray<uint8> Chunk;
+        Chunk.SetNumUninitialized(FMath::Min(FileSize, AutotuneHashChunkBytes));
+        if (File->Read(Chunk.GetData(), Chunk.Num()))
+        {
+            Md5.Update(Chunk.GetData(), Chunk.Num());
+        }
+        if (FileSize > Chunk.Num() && File->Seek(FileSize - Chunk.Num()) && File->Read(Chunk.GetData(), Chunk.Num()))
+        {
+            Md5.Update(Chunk.GetData(), Chunk.Num());
+        }
+
+        uint8 Digest[16];
+        Md5.Final(Digest);
+        return BytesToHex(Digest, 16);
+    }
+
+    //Anything that changes which settings are fastest: the cpu, the gpu, how much of the model lives on it and
+    //the context it runs in, a shared batched context decodes several sequences per step
+    FString MachineSignature(const FLLMModelParams& InModelParams)
+    {
+        const FString Signature = FString::Printf(TEXT("%s|%d|%d|%s|%d|ctx:%d|shared:%d"),
+            *FPlatformMisc::GetCPUBrand(),
+            FPlatformMisc::NumberOfCores(),
+            FPlatformMisc::NumberOfCoresIncludingHyperthreads(),
+            *FPlatformMisc::GetPrimaryGPUBrand(),
+            InModelParams.GPULayers,
+            InModelParams.MaxContextLength,
+            InModelParams.Advanced.bUseSharedBatchedContext ? 1 : 0);
+
+        return FString::Printf(TEXT("%08x"), FCrc::StrCrc32(*Signature));
+    }
+
+    //Deterministic spread over the vocab, content doesn't matter for timing
+    std::vector<llama_token> ProbeTokens(int32 Count, int32 VocabSize)
+    {
+        std::vector<llama_token> Tokens(Count);
+        for (int32 i = 0; i < Count; i++)
+        {
+            Tokens[i] = (llama_token)(((int64)i * 7919 + 13) % VocabSize);
+        }
+        return Tokens;
+    }
+
+    //Returns tokens/s, 0 on failure
+    float TimePrefill(llama_context* Context, std::vector<llama_token>& Tokens, int32 MicroBatch)
+    {
+        llama_kv_cache_clear(Context);
+
+        const double StartTime = FPlatformTime::Seconds();
+        for (int32 i = 0; i < (int32)Tokens.size(); i += MicroBatch)
+        {
+            const int32 NTokens = FMath::Min(MicroBatch, (int32)Tokens.size() - i);
+            if (llama_decode(Context, llama_batch_get_one(Tokens.data() + i, NTokens)) != 0)
+            {
+                return 0.f;
+            }
+        }
+        llama_synchronize(Context);
+        const double Elapsed = FPlatformTime::Seconds() - StartTime;
+
+        return Elapsed > 0.0 ? (float)(Tokens.size() / Elapsed) : 0.f;
+    }
+
+    float TimeDecode(llama_context* Context, std::vector<llama_token>& Tokens)
+    {
+        llama_kv_cache_clear(Context);
+
+        const double StartTime = FPlatformTime::Seconds();
+        for (int32 i = 0; i < (int32)Tokens.size(); i++)
+        {
+            if (llama_decode(Context, llama_batch_get_one(&Tokens[i], 1)) != 0)
+            {
+                return 0.f;
+            }
+            //Generation waits on each token's logits before sampling, time it the same way
+            llama_synchronize(Context);
+        }
+        const double Elapsed = FPlatformTime::Seconds() - StartTime;
+
+        return Elapsed > 0.0 ? (float)(Tokens.size() / Elapsed) : 0.f;
+    }
+}
+
+bool FLlamaAutotuner::Tune(llama_model* Model, const std::string& ModelPath, const FLLMModelParams& InModelParams, FLlamaAutotuneResult& OutResult, bool bCacheOnly)
+{
+    const FString FilePath = CacheFilePath(ModelPath, InModelParams);
+
+    if (!FilePath.IsEmpty() && LoadCached(FilePath, OutResult))
+    {
+        UE_LOG(LlamaLog, Log, TEXT("%hs: using cached settings, decode threads %d, prefill threads %d, micro batch %d"),
+            __func__, OutResult.DecodeThreads, OutResult.PrefillThreads, OutResult.MicroBatchLength);
+        return true;
+    }
+
+    if (bCacheOnly)
+    {
+        UE_LOG(LlamaLog, Log, TEXT("%hs: model is shared, not probing it while others may be decoding, keeping configured thread and batch settings"), __func__);
+        return false;
+    }
+
+    if (!RunProbes(Model, InModelParams, OutResult))
+    {
+        UE_LOG(LlamaLog, Warning, TEXT("%hs: probes failed, keeping configured thread and batch settings"), __func__);
+        return false;
+    }
+
+    UE_LOG(LlamaLog, Log, TEXT("%hs: decode threads %d (%.1f tok/s), prefill threads %d, micro batch %d (%.1f tok/s)"),
+        __func__, OutResult.DecodeThreads, OutResult.DecodeTokensPerSecond,
+        OutResult.PrefillThreads, OutResult.MicroBatchLength, OutResult.PrefillTokensPerSecond);
+
+    if (!FilePath.IsEmpty())
+    {
+        SaveCached(FilePath, OutResult);
+    }
+    return true;
+}
+
+FString FLlamaAutotuner::CacheFilePath(const std::string& ModelPath, const FLLMModelParams& InModelParams)
+{
+    const FString ModelHash = HashModelFile(FLlamaString::ToUE(ModelPath));
+    if (ModelHash.IsEmpty())
+    {
+        return FString();
+    }
+    return FPaths::Combine(FLlamaPaths::AutotuneRootPath(), FString::Printf(TEXT("%s-%s-v%d.txt"), *ModelHash, *MachineSignature(InModelParams), AutotuneCacheVersion));
+}
+
+bool FLlamaAutotuner::LoadCached(const FString& FilePath, FLlamaAutotuneResult& OutResult)
+{
+    TArray<FString> Lines;
+    if (!FFileHelper::LoadFileToStringArray(Lines, *FilePath))
+    {
+        return false;
+    }
+
+    FLlamaAutotuneResult Result;
+    for (const FString& Line : Lines)
+    {
+        FString Key;
+        FString Value;
+        if (!Line.Split(TEXT("="), &Key, &Value))
+        {
+            continue;
+        }
+
+        if (Key == TEXT("DecodeThreads"))
+        {
+            Result.DecodeThreads = FCString::Atoi(*Value);
+        }
+        else if (Key == TEXT("PrefillThreads"))
+        {
+            Result.PrefillThreads = FCString::Atoi(*Value);
+        }
+        else if (Key == TEXT("MicroBatchLength"))
+        {
+            Result.MicroBatchLength = FCString::Atoi(*Value);
+        }
+        else if (Key == TEXT("DecodeTokensPerSecond"))
+        {
+            Result.DecodeTokensPerSecond = FCString::Atof(*Value);
+        }
+        else if (Key == TEXT("PrefillTokensPerSecond"))
+        {
+            Result.PrefillTokensPerSecond = FCString::Atof(*Value);
+        }
+    }
+
+    //Partial or hand edited files fall back to probing again
+    if (Result.DecodeThreads <= 0 || Result.PrefillThreads <= 0 || Result.MicroBatchLength <= 0)
+    {
+        return false;
+    }
+
+    OutResult = Result;
+    return true;
+}
+
+void FLlamaAutotuner::SaveCached(const FString& FilePath, const FLlamaAutotuneResult& Result)
+{
+    TArray<FString> Lines;
+    Lines.Add(FString::Printf(TEXT("DecodeThreads=%d"), Result.DecodeThreads));
+    Lines.Add(FString::Printf(TEXT("PrefillThreads=%d"), Result.PrefillThreads));
+    Lines.Add(FString::Printf(TEXT("MicroBatchLength=%d"), Result.MicroBatchLength));
+    Lines.Add(FString::Printf(TEXT("DecodeTokensPerSecond=%f"), Result.DecodeTokensPerSecond));
+    Lines.Add(FString::Printf(TEXT("PrefillTokensPerSecond=%f"), Result.PrefillTokensPerSecond));
+
+    if (!FFileHelper::SaveStringArrayToFile(Lines, *FilePath))
+    {
+        UE_LOG(LlamaLog, Warning, TEXT("%hs: failed to write %s"), __func__, *FilePath);
+    }
+}
+
+bool FLlamaAutotuner::RunProbes(llama_model* Model, const FLLMModelParams& InModelParams, FLlamaAutotuneResult& OutResult)
+{
+    const int32 VocabSize = llama_vocab_n_tokens(llama_model_get_vocab(Model));
+    if (VocabSize <= 0)
+    {
+        return false;
+    }
+
+    //Quarters of the physical cores, hyperthreads rarely help matmul bound work
+    const int32 NumCores = FMath::Max(1, FPlatformMisc::NumberOfCores());
+    TArray<int32> ThreadCandidates;
+    for (int32 Quarter = 1; Quarter <= 4; Quarter++)
+    {
+        ThreadCandidates.AddUnique(FMath::Max(1, NumCores * Quarter / 4));
+    }
+
+    std::vector<llama_token> DecodeTokens = ProbeTokens(AutotuneDecodeTokens, VocabSize);
+
+    FLlamaAutotuneResult Best;
+    bool bFirstMicroBatch = true;
+
+    for (const int32 MicroBatch : AutotuneMicroBatchCandidates)
+    {
+        llama_context_params ContextParams = llama_context_default_params();
+        ContextParams.n_ctx = AutotuneContextLength;
+        ContextParams.n_batch = MicroBatch;
+        ContextParams.n_ubatch = MicroBatch;
+        ContextParams.no_perf = true;
+
+        llama_context* Context = llama_init_from_model(Model, ContextParams);
+        if (!Context)
+        {
+            UE_LOG(LlamaLog, Warning, TEXT("%hs: failed to create a probe context for micro batch %d"), __func__, MicroBatch);
+            continue;
+        }
+
+        std::vector<llama_token> PrefillTokens = ProbeTokens(MicroBatch * AutotunePrefillChunks, VocabSize);
+
+        //First decode allocates compute buffers and pages in weights, one chunk is enough to keep that out of the timings
+        std::vector<llama_token> WarmupTokens(PrefillTokens.begin(), PrefillTokens.begin() + MicroBatch);
+        TimePrefill(Context, WarmupTokens, MicroBatch);
+
+        //Throughput rises with threads until memory bandwidth or contention caps it, stop at the first drop
+        float LastPrefillSpeed = 0.f;
+        float LastDecodeSpeed = 0.f;
+        bool bPrefillImproving = true;
+        bool bDecodeImproving = bFirstMicroBatch;
+
+        for (const int32 Threads : ThreadCandidates)
+        {
+            if (!bPrefillImproving && !bDecodeImproving)
+            {
+                break;
+            }
+            llama_set_n_threads(Context, Threads, Threads);
+
+            if (bPrefillImproving)
+            {
+                const float PrefillSpeed = TimePrefill(Context, PrefillTokens, MicroBatch);
+                if (PrefillSpeed > Best.PrefillTokensPerSecond)
+                {
+                    Best.PrefillTokensPerSecond = PrefillSpeed;
+                    Best.PrefillThreads = Threads;
+                    Best.MicroBatchLength = MicroBatch;
+                }
+                bPrefillImproving = PrefillSpeed > LastPrefillSpeed;
+                LastPrefillSpeed = PrefillSpeed;
+            }
+
+            //Single token decodes don't depend on the micro batch size, only probe them once
+            if (bDecodeImproving)
+            {
+                const float DecodeSpeed = TimeDecode(Context, DecodeTokens);
+                if (DecodeSpeed > Best.DecodeTokensPerSecond)
+                {
+                    Best.DecodeTokensPerSecond = DecodeSpeed;
+                    Best.DecodeThreads = Threads;
+                }
+                bDecodeImproving = DecodeSpeed > LastDecodeSpeed;
+                LastDecodeSpeed = DecodeSpeed;
+            }
+        }
+
+        llama_free(Context);
+        bFirstMicroBatch = false;
+    }
+
+    if (Best.DecodeThreads <= 0 || Best.PrefillThreads <= 0)
+    {
+        return false;
+    }
+
+    OutResult = Best;
+    return true;
+}
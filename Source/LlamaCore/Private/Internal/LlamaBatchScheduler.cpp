@@ -0,0 +1,471 @@
+#include "Internal/LlamaBatchScheduler.h"
+#include <algorithm>
+#include "LlamaUtility.h"
+#include "HAL/RunnableThread.h"
+
+namespace
+{
+    struct FSharedSchedulerEntry
+    {
+        llama_model* Model = nullptr;
+        uint32 NCtx = 0;
+        uint32 NBatch = 0;
+        uint32 NUBatch = 0;
+        int32 NThreads = 0;
+        int32 NThreadsBatch = 0;
+        int32 MaxSequences = 0;
+        int32 PrefixCacheSlots = 0;
+        TWeakPtr<FLlamaBatchScheduler> Scheduler;
+    };
+
+    FCriticalSection SharedSchedulersMutex;
+    TArray<FSharedSchedulerEntry> SharedSchedulers;
+}
+
+TSharedPtr<FLlamaBatchScheduler> FLlamaBatchScheduler::AcquireShared(llama_model* Model, const llama_context_params& SequenceContextParams, int32 MaxSequences,
+    int32 PrefixCacheSlots, int32 PrefixCacheMinTokens)
+{
+    FScopeLock Lock(&SharedSchedulersMutex);
+
+    //Prune dead entries and look for a compatible scheduler with a free sequence. Everything the shared context is
+    //created with is part of the match, a component asking for other threads or batching gets its own context.
+    SharedSchedulers.RemoveAll([](const FSharedSchedulerEntry& Entry) { return !Entry.Scheduler.IsValid(); });
+
+    for (FSharedSchedulerEntry& Entry : SharedSchedulers)
+    {
+        if (Entry.Model == Model &&
+            Entry.NCtx == SequenceContextParams.n_ctx &&
+            Entry.NBatch == SequenceContextParams.n_batch &&
+            Entry.NUBatch == SequenceContextParams.n_ubatch &&
+            Entry.NThreads == SequenceContextParams.n_threads &&
+            Entry.NThreadsBatch == SequenceContextParams.n_threads_batch &&
+            Entry.MaxSequences == MaxSequences &&
+            Entry.PrefixCacheSlots == PrefixCacheSlots)
+        {
+            TSharedPtr<FLlamaBatchScheduler> Scheduler = Entry.Scheduler.Pin();
+            if (Scheduler.IsValid())
+            {
+                return Scheduler;
+            }
+        }
+    }
+
+    //Each sequence gets the configured context length, donors included
+    const int32 TotalSequences = MaxSequences + PrefixCacheSlots;
+    llama_context_params SharedParams = SequenceContextParams;
+    SharedParams.n_ctx = SequenceContextParams.n_ctx * TotalSequences;
+    SharedParams.n_seq_max = TotalSequences;
+
+    llama_context* SharedContext = llama_init_from_model(Model, SharedParams);
+    if (!SharedContext)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: failed to create shared llama_context for %d sequences"), __func__, MaxSequences);
+        return nullptr;
+    }
+
+    TSharedPtr<FLlamaBatchScheduler> Scheduler = MakeShared<FLlamaBatchScheduler>(SharedContext, MaxSequences, PrefixCacheSlots, PrefixCacheMinTokens);
+
+    FSharedSchedulerEntry Entry;
+    Entry.Model = Model;
+    Entry.NCtx = SequenceContextParams.n_ctx;
+    Entry.NBatch = SequenceContextParams.n_batch;
+    Entry.NUBatch = SequenceContextParams.n_ubatch;
+    Entry.NThreads = SequenceContextParams.n_threads;
+    Entry.NThreadsBatch = SequenceContextParams.n_threads_batch;
+    Entry.MaxSequences = MaxSequences;
+    Entry.PrefixCacheSlots = PrefixCacheSlots;
+    Entry.Scheduler = Scheduler;
+    SharedSchedulers.Add(Entry);
+
+    return Scheduler;
+}
+
+FLlamaBatchScheduler::FLlamaBatchScheduler(llama_context* InContext, int32 InMaxSequences, int32 InPrefixCacheSlots, int32 InPrefixCacheMinTokens)
+{
+    Context = InContext;
+    NumSequences = InMaxSequences;
+    NumPrefixSlots = InPrefixCacheSlots;
+    NBatch = llama_n_batch(Context);
+    Batch = llama_batch_init(NBatch, 0, 1);
+    SequenceInUse.resize(NumSequences, false);
+    SamplingStates.resize(NumSequences, ESamplingState::None);
+
+    //Donor sequences live after the conversation sequences
+    if (NumPrefixSlots > 0)
+    {
+        PrefixCache = MakeUnique<FLlamaPrefixCache>(Context, &ContextMutex, NumSequences, NumPrefixSlots, InPrefixCacheMinTokens);
+    }
+
+    WorkEvent = FPlatformProcess::GetSynchEventFromPool(false);
+    SamplingDoneEvent = FPlatformProcess::GetSynchEventFromPool(false);
+
+    Thread = FRunnableThread::Create(this, TEXT("LlamaBatchScheduler"));
+}
+
+FLlamaBatchScheduler::~FLlamaBatchScheduler()
+{
+    Stop();
+
+    if (Thread)
+    {
+        Thread->WaitForCompletion();
+        delete Thread;
+        Thread = nullptr;
+    }
+
+    FPlatformProcess::ReturnSynchEventToPool(WorkEvent);
+    FPlatformProcess::ReturnSynchEventToPool(SamplingDoneEvent);
+
+    PrefixCache.Reset();
+
+    llama_batch_free(Batch);
+    llama_free(Context);
+    Context = nullptr;
+}
+
+int32 FLlamaBatchScheduler::AcquireSequence()
+{
+    FScopeLock Lock(&QueueMutex);
+    for (int32 i = 0; i < NumSequences; i++)
+    {
+        if (!SequenceInUse[i])
+        {
+            SequenceInUse[i] = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void FLlamaBatchScheduler::ReleaseSequence(int32 SeqId)
+{
+    if (SeqId < 0 || SeqId >= NumSequences)
+    {
+        return;
+    }
+    {
+        FScopeLock ContextLock(&ContextMutex);
+        llama_kv_cache_seq_rm(Context, SeqId, -1, -1);
+    }
+    FScopeLock Lock(&QueueMutex);
+    SequenceInUse[SeqId] = false;
+    SamplingStates[SeqId] = ESamplingState::None;
+}
+
+int32 FLlamaBatchScheduler::Decode(int32 SeqId, const llama_token* Tokens, int32 NTokens, llama_pos StartPos, bool bWantLogits)
+{
+    if (NTokens <= 0)
+    {
+        return 0;
+    }
+
+    FDecodeRequest Request;
+    Request.SeqId = SeqId;
+    Request.Tokens = Tokens;
+    Request.NTokens = NTokens;
+    Request.StartPos = StartPos;
+    Request.bWantLogits = bWantLogits;
+    Request.DoneEvent = FPlatformProcess::GetSynchEventFromPool(false);
+
+    {
+        FScopeLock Lock(&QueueMutex);
+        PendingRequests.push_back(&Request);
+    }
+    WorkEvent->Trigger();
+
+    Request.DoneEvent->Wait();
+    FPlatformProcess::ReturnSynchEventToPool(Request.DoneEvent);
+
+    if (Request.bFailed)
+    {
+        return -1;
+    }
+    return Request.LogitsIndex;
+}
+
+bool FLlamaBatchScheduler::BeginSampling(int32 SeqId)
+{
+    FScopeLock Lock(&QueueMutex);
+    if (SamplingStates[SeqId] == ESamplingState::Pending)
+    {
+        SamplingStates[SeqId] = ESamplingState::Sampling;
+    }
+    return SamplingStates[SeqId] == ESamplingState::Sampling;
+}
+
+void FLlamaBatchScheduler::FinishSampling(int32 SeqId)
+{
+    FScopeLock Lock(&QueueMutex);
+
+    //Expired speakers were already discounted, they keep that state so BeginSampling still reports it
+    if (SamplingStates[SeqId] != ESamplingState::Pending && SamplingStates[SeqId] != ESamplingState::Sampling)
+    {
+        return;
+    }
+    SamplingStates[SeqId] = ESamplingState::None;
+
+    if (PendingSamplers.Decrement() <= 0)
+    {
+        SamplingDoneEvent->Trigger();
+    }
+}
+
+int32 FLlamaBatchScheduler::ExpireUnclaimedLogits()
+{
+    FScopeLock Lock(&QueueMutex);
+
+    int32 NExpired = 0;
+    for (ESamplingState& State : SamplingStates)
+    {
+        if (State == ESamplingState::Pending)
+        {
+            State = ESamplingState::Expired;
+            PendingSamplers.Decrement();
+            NExpired++;
+        }
+    }
+    return NExpired;
+}
+
+llama_context* FLlamaBatchScheduler::GetContext()
+{
+    return Context;
+}
+
+int32 FLlamaBatchScheduler::MaxContextPerSequence()
+{
+    return llama_n_ctx(Context) / (NumSequences + NumPrefixSlots);
+}
+
+int32 FLlamaBatchScheduler::MaxSequences()
+{
+    return NumSequences;
+}
+
+FLlamaPrefixCache* FLlamaBatchScheduler::GetPrefixCache()
+{
+    return PrefixCache.Get();
+}
+
+uint32 FLlamaBatchScheduler::Run()
+{
+    while (bRunning)
+    {
+        //Sleep until a request is submitted or we're stopped, partially decoded prefills keep us going without one
+        bool bHasWork = false;
+        {
+            FScopeLock Lock(&QueueMutex);
+            bHasWork = !PendingRequests.empty();
+        }
+        if (!bHasWork)
+        {
+            WorkEvent->Wait();
+            continue;
+        }
+
+        //Give everyone who spoke last step a moment to submit their next token so they share this decode
+        const double GatherDeadline = FPlatformTime::Seconds() + GatherWindowSeconds;
+        while (bRunning && FPlatformTime::Seconds() < GatherDeadline)
+        {
+            {
+                FScopeLock Lock(&QueueMutex);
+                if ((int32)PendingRequests.size() >= LastStepSpeakers)
+                {
+                    break;
+                }
+            }
+            WorkEvent->Wait(1);
+        }
+
+        RunStep();
+
+        //Logits are only valid until the next decode, wait for every speaker of this step to sample.
+        //Speakers that haven't started by the timeout lose their logits rather than stall every sequence, they decode
+        //again before sampling. Anyone already sampling is waited for, that's bounded work.
+        const double SamplingDeadline = FPlatformTime::Seconds() + SamplingTimeoutSeconds;
+        bool bExpired = false;
+        while (bRunning && PendingSamplers.GetValue() > 0)
+        {
+            if (!bExpired && FPlatformTime::Seconds() > SamplingDeadline)
+            {
+                bExpired = true;
+                const int32 NExpired = ExpireUnclaimedLogits();
+                if (NExpired > 0)
+                {
+                    UE_LOG(LlamaLog, Warning, TEXT("%hs: %d sequences did not start sampling in time, their logits expire"), __func__, NExpired);
+                }
+                continue;
+            }
+            SamplingDoneEvent->Wait(1);
+        }
+    }
+
+    //Release anyone still waiting
+    FScopeLock Lock(&QueueMutex);
+    for (FDecodeRequest* Request : PendingRequests)
+    {
+        Request->bFailed = true;
+        Request->DoneEvent->Trigger();
+    }
+    PendingRequests.clear();
+
+    return 0;
+}
+
+void FLlamaBatchScheduler::RunStep()
+{
+    //Snapshot this step's requests in round robin order so no sequence always goes first
+    std::vector<FDecodeRequest*> StepRequests;
+    {
+        FScopeLock Lock(&QueueMutex);
+        const int32 NumPending = PendingRequests.size();
+        for (int32 i = 0; i < NumPending; i++)
+        {
+            StepRequests.push_back(PendingRequests[(i + RoundRobinOffset) % NumPending]);
+        }
+        RoundRobinOffset++;
+    }
+
+    const int32 NumRequests = StepRequests.size();
+    std::vector<int32> Taken(NumRequests, 0);
+    int32 Budget = NBatch;
+
+    //Fairness: everyone gets at least one token this step (that's a whole step for generating speakers)...
+    for (int32 i = 0; i < NumRequests && Budget > 0; i++)
+    {
+        Taken[i] = 1;
+        Budget--;
+    }
+
+    //...then remaining budget is split evenly between prefill chunks
+    bool bProgress = true;
+    while (Budget > 0 && bProgress)
+    {
+        bProgress = false;
+        int32 NumHungry = 0;
+        for (int32 i = 0; i < NumRequests; i++)
+        {
+            NumHungry += (StepRequests[i]->NTokens - StepRequests[i]->NDecoded - Taken[i]) > 0 ? 1 : 0;
+        }
+        if (NumHungry == 0)
+        {
+            break;
+        }
+
+        const int32 FairShare = FMath::Max(1, Budget / NumHungry);
+        for (int32 i = 0; i < NumRequests && Budget > 0; i++)
+        {
+            const int32 Remaining = StepRequests[i]->NTokens - StepRequests[i]->NDecoded - Taken[i];
+            const int32 Take = FMath::Min3(FairShare, Remaining, Budget);
+            if (Take > 0)
+            {
+                Taken[i] += Take;
+                Budget -= Take;
+                bProgress = true;
+            }
+        }
+    }
+
+    //Build the merged batch
+    Batch.n_tokens = 0;
+    std::vector<int32> LogitsIndices(NumRequests, 0);
+    for (int32 i = 0; i < NumRequests; i++)
+    {
+        FDecodeRequest* Request = StepRequests[i];
+        for (int32 j = 0; j < Taken[i]; j++)
+        {
+            const int32 TokenIndex = Request->NDecoded + j;
+            const bool bLastToken = TokenIndex == Request->NTokens - 1;
+            const int32 BatchIndex = Batch.n_tokens;
+
+            Batch.token[BatchIndex] = Request->Tokens[TokenIndex];
+            Batch.pos[BatchIndex] = Request->StartPos + TokenIndex;
+            Batch.n_seq_id[BatchIndex] = 1;
+            Batch.seq_id[BatchIndex][0] = Request->SeqId;
+            Batch.logits[BatchIndex] = (bLastToken && Request->bWantLogits) ? 1 : 0;
+
+            if (bLastToken && Request->bWantLogits)
+            {
+                LogitsIndices[i] = BatchIndex;
+            }
+            Batch.n_tokens++;
+        }
+    }
+
+    int32 DecodeResult = 0;
+    {
+        FScopeLock ContextLock(&ContextMutex);
+        DecodeResult = llama_decode(Context, Batch);
+    }
+
+    if (DecodeResult != 0)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: shared decode of %d tokens over %d requests failed (%d)"), __func__, Batch.n_tokens, NumRequests, DecodeResult);
+
+        //Failed requests are given up as a whole, drop what earlier steps of them left in the cache so callers' ledgers still match
+        FScopeLock ContextLock(&ContextMutex);
+        for (FDecodeRequest* Request : StepRequests)
+        {
+            llama_kv_cache_seq_rm(Context, Request->SeqId, Request->StartPos, -1);
+        }
+    }
+
+    //Complete finished requests, partially decoded prefills stay queued for the next step
+    std::vector<FDecodeRequest*> Completed;
+    int32 Speakers = 0;
+    {
+        FScopeLock Lock(&QueueMutex);
+        for (int32 i = 0; i < NumRequests; i++)
+        {
+            FDecodeRequest* Request = StepRequests[i];
+            Request->NDecoded += Taken[i];
+
+            if (DecodeResult != 0 || Request->NDecoded >= Request->NTokens)
+            {
+                Request->bFailed = DecodeResult != 0;
+                Request->LogitsIndex = LogitsIndices[i];
+                if (!Request->bFailed && Request->bWantLogits)
+                {
+                    SamplingStates[Request->SeqId] = ESamplingState::Pending;
+                    Speakers++;
+                }
+                Completed.push_back(Request);
+                PendingRequests.erase(std::remove(PendingRequests.begin(), PendingRequests.end(), Request), PendingRequests.end());
+            }
+        }
+    }
+
+    LastStepSpeakers = Speakers;
+    PendingSamplers.Set(Speakers);
+
+    for (FDecodeRequest* Request : Completed)
+    {
+        Request->DoneEvent->Trigger();
+    }
+}
+
+void FLlamaBatchScheduler::Stop()
+{
+    bRunning = false;
+    if (WorkEvent)
+    {
+        WorkEvent->Trigger();
+    }
+}
+
+FLlamaContextLock::FLlamaContextLock(FLlamaBatchScheduler* Scheduler)
+{
+    if (Scheduler)
+    {
+        Mutex = &Scheduler->ContextMutex;
+        Mutex->Lock();
+    }
+}
+
+FLlamaContextLock::~FLlamaContextLock()
+{
+    if (Mutex)
+    {
+        Mutex->Unlock();
+    }
+}
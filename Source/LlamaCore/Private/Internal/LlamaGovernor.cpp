@@ -0,0 +1,78 @@
+#include "Internal/LlamaGovernor.h"
+
+namespace
+{
+    //Throttle steps at most this often so one long frame (loading, GC) doesn't slam it down
+    constexpr double GovernorStepInterval = 0.25;
+    constexpr float GovernorStepUp = 0.25f;
+    constexpr float GovernorStepDown = 0.125f;
+    constexpr float GovernorFrameSmoothing = 0.1f;
+}
+
+void FLlamaGenerationGovernor::Update(float DeltaTime, const FLLMModelAdvancedParams& Params, int32 BaseDecodeThreads)
+{
+    const float FrameMs = DeltaTime * 1000.f;
+    FrameTimeEma = FrameTimeEma > 0.f ? FrameTimeEma + (FrameMs - FrameTimeEma) * GovernorFrameSmoothing : FrameMs;
+
+    if (!Params.bUseFrameTimeGovernor)
+    {
+        ThrottleLevel = 0.f;
+    }
+    else
+    {
+        //Hysteresis band around the target so it settles instead of oscillating
+        const double Now = FPlatformTime::Seconds();
+        if (Now - LastStepTime >= GovernorStepInterval)
+        {
+            if (FrameTimeEma > Params.GovernorTargetFrameMs * 1.1f && ThrottleLevel < 1.f)
+            {
+                ThrottleLevel = FMath::Min(1.f, ThrottleLevel + GovernorStepUp);
+                LastStepTime = Now;
+                CurrentStats.ThrottleSteps++;
+            }
+            else if (FrameTimeEma < Params.GovernorTargetFrameMs * 0.9f && ThrottleLevel > 0.f)
+            {
+                ThrottleLevel = FMath::Max(0.f, ThrottleLevel - GovernorStepDown);
+                LastStepTime = Now;
+            }
+        }
+    }
+
+    //Threads go first, sleeping between tokens is the last resort
+    const int32 MinThreads = FMath::Clamp(Params.GovernorMinDecodeThreads, 1, FMath::Max(1, BaseDecodeThreads));
+    const int32 Threads = FMath::Max(MinThreads, FMath::RoundToInt(BaseDecodeThreads * (1.f - FMath::Min(1.f, ThrottleLevel * 2.f) * 0.75f)));
+    const float Yield = FMath::Max(0.f, ThrottleLevel * 2.f - 1.f) * Params.GovernorMaxYieldMs / 1000.f;
+    const float Interval = Params.MaxTokensPerSecond > 0.f ? 1.f / Params.MaxTokensPerSecond : 0.f;
+
+    DecodeThreads.store(Threads, std::memory_order_relaxed);
+    YieldSeconds.store(Yield, std::memory_order_relaxed);
+    MinTokenInterval.store(Interval, std::memory_order_relaxed);
+
+    CurrentStats.FrameTimeMs = FrameTimeEma;
+    CurrentStats.ThrottleLevel = ThrottleLevel;
+    CurrentStats.DecodeThreads = Threads;
+    CurrentStats.YieldMsPerToken = Yield * 1000.f;
+    CurrentStats.TokensPerSecondCap = Params.MaxTokensPerSecond;
+}
+
+const FLlamaGovernorStats& FLlamaGenerationGovernor::Stats() const
+{
+    return CurrentStats;
+}
+
+int32 FLlamaGenerationGovernor::PaceToken()
+{
+    const float Yield = YieldSeconds.load(std::memory_order_relaxed);
+    const float Interval = MinTokenInterval.load(std::memory_order_relaxed);
+
+    double Now = FPlatformTime::Seconds();
+    const double Wait = FMath::Max<double>(Yield, LastTokenTime + Interval - Now);
+    if (Wait > 0.0)
+    {
+        FPlatformProcess::Sleep(Wait);
+        Now = FPlatformTime::Seconds();
+    }
+    LastTokenTime = Now;
+
+    return DecodeThreads.load(std::memory_order_relaxed);
+}
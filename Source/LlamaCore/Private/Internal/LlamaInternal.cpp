@@ -1,9 +1,17 @@
 #include "Internal/LlamaInternal.h"
+#include <algorithm>
+#include "Internal/LlamaModelRegistry.h"
+#include "Internal/LlamaBatchScheduler.h"
+#include "Internal/LlamaAutotuner.h"
 #include "common/common.h"
 #include "common/sampling.h"
+#include "ggml-cpu.h"
 #include "LlamaDataTypes.h"
 #include "LlamaUtility.h"
 #include "HardwareInfo.h"
+#include "Serialization/MemoryWriter.h"
+#include "Serialization/MemoryReader.h"
+#include "Misc/ScopeExit.h"
 
 bool FLlamaInternal::LoadModelFromParams(const FLLMModelParams& InModelParams)
 {
@@ -19,124 +27,97 @@ bool FLlamaInternal::LoadModelFromParams(const FLLMModelParams& InModelParams)
         }
         }, nullptr);
 
-    // load dynamic backends
-    ggml_backend_load_all();
-
     // initialize the model
     llama_model_params LlamaModelParams = llama_model_default_params();
     LlamaModelParams.n_gpu_layers = InModelParams.GPULayers;
 
-    //FPlatform
-
-    std::string Path = TCHAR_TO_UTF8(*FLlamaPaths::ParsePathIntoFullPath(InModelParams.PathToModel));
-    LlamaModel = llama_model_load_from_file(Path.c_str(), LlamaModelParams);
-    if (!LlamaModel)
+    //Called by the loader as tensors are read, returning false aborts the load
+    LlamaModelParams.progress_callback = [](float Progress, void* UserData) -> bool
     {
-        UE_LOG(LlamaLog, Error, TEXT("%hs: error: unable to load model\n"), __func__);
-        return false;
-    }
+        FLlamaInternal* Self = static_cast<FLlamaInternal*>(UserData);
+        if (Self->OnModelLoadProgress)
+        {
+            Self->OnModelLoadProgress(Progress);
+        }
+        return !Self->IsTaskCancelled();
+    };
+    LlamaModelParams.progress_callback_user_data = this;
 
-    llama_context_params ContextParams = llama_context_default_params();
-    ContextParams.n_ctx = InModelParams.MaxContextLength;
-    ContextParams.n_batch = InModelParams.MaxBatchLength;
-    ContextParams.n_threads = InModelParams.Threads;
-    ContextParams.n_threads_batch = InModelParams.Threads;
+    //FPlatform
 
-    Context = llama_init_from_model(LlamaModel, ContextParams);
-    if (!Context)
+    if (IsTaskCancelled())
     {
-        UE_LOG(LlamaLog, Error, TEXT("%hs: error: failed to create the llama_context\n"), __func__);
+        UE_LOG(LlamaLog, Log, TEXT("%hs: model load cancelled"), __func__);
         return false;
     }
 
-    //common sampler strategy
-
-    if (InModelParams.Advanced.bUseCommonSampler)
+    //Weights are shared between all users of the same model, we only own the context
+    std::string Path = TCHAR_TO_UTF8(*FLlamaPaths::ParsePathIntoFullPath(InModelParams.PathToModel));
+    bool bModelShared = false;
+    LlamaModel = FLlamaModelRegistry::Get().AcquireModel(Path, LlamaModelParams, CancelToken.Get(), &bModelShared);
+    if (!LlamaModel)
     {
-        common_params_sampling SamplingParams;
-        
-        if (InModelParams.Advanced.MinP != -1.f)
-        {
-            SamplingParams.min_p = InModelParams.Advanced.MinP;
-        }
-        if (InModelParams.Advanced.TopK != -1.f)
-        {
-            SamplingParams.top_k = InModelParams.Advanced.TopK;
-        }
-        if (InModelParams.Advanced.TopP != -1.f)
+        if (IsTaskCancelled())
         {
-            SamplingParams.top_p = InModelParams.Advanced.TopP;
+            UE_LOG(LlamaLog, Log, TEXT("%hs: model load cancelled"), __func__);
         }
-        if (InModelParams.Advanced.TypicalP != -1.f)
+        else
         {
-            SamplingParams.typ_p = InModelParams.Advanced.TypicalP;
+            UE_LOG(LlamaLog, Error, TEXT("%hs: error: unable to load model\n"), __func__);
         }
-        if (InModelParams.Advanced.Mirostat != -1)
+        return false;
+    }
+
+    //From here on a failed or cancelled load hands the weights back, nothing else would release them
+    bool bLoadFinished = false;
+    ON_SCOPE_EXIT
+    {
+        if (!bLoadFinished)
         {
-            SamplingParams.mirostat = InModelParams.Advanced.Mirostat;
-            SamplingParams.mirostat_eta = InModelParams.Advanced.MirostatEta;
-            SamplingParams.mirostat_tau = InModelParams.Advanced.MirostatTau;
+            UnloadModel();
         }
+    };
 
-        //Seed is either default or the one specifically passed in for deterministic results
-        if (InModelParams.Seed != -1)
+    //Autotuned thread and batch settings replace the requested ones from here on
+    FLLMModelParams TunedParams = InModelParams;
+    if (InModelParams.Advanced.bAutotuneOnLoad)
+    {
+        FLlamaAutotuneResult Tuned;
+        if (FLlamaAutotuner::Tune(LlamaModel, Path, InModelParams, Tuned, bModelShared))
         {
-            SamplingParams.seed = InModelParams.Seed;
+            TunedParams.Advanced.DecodeThreads = Tuned.DecodeThreads;
+            TunedParams.Advanced.PrefillThreads = Tuned.PrefillThreads;
+            TunedParams.Advanced.MicroBatchLength = Tuned.MicroBatchLength;
+            TunedParams.MaxBatchLength = FMath::Max(TunedParams.MaxBatchLength, Tuned.MicroBatchLength);
         }
-
-        CommonSampler = common_sampler_init(LlamaModel, SamplingParams);
     }
 
-
-    Sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
-
-    //Temperature is always applied
-    llama_sampler_chain_add(Sampler, llama_sampler_init_temp(InModelParams.Advanced.Temp));
-
-    //If any of the repeat penalties are set, apply penalties to sampler
-    if (InModelParams.Advanced.PenaltyLastN != 0 || 
-        InModelParams.Advanced.PenaltyRepeat != 1.f ||
-        InModelParams.Advanced.PenaltyFrequency != 0.f ||
-        InModelParams.Advanced.PenaltyPresence != 0.f)
-    {
-        llama_sampler_chain_add(Sampler, llama_sampler_init_penalties(
-            InModelParams.Advanced.PenaltyLastN, InModelParams.Advanced.PenaltyRepeat,
-            InModelParams.Advanced.PenaltyFrequency, InModelParams.Advanced.PenaltyPresence));
-    }
-    
-    //Optional sampling strategies - MinP should be applied by default of 0.05f
-    if (InModelParams.Advanced.MinP != -1.f)
-    {
-        llama_sampler_chain_add(Sampler, llama_sampler_init_min_p(InModelParams.Advanced.MinP, 1));
-    }
-    if (InModelParams.Advanced.TopK != -1.f)
-    {
-        llama_sampler_chain_add(Sampler, llama_sampler_init_top_k(InModelParams.Advanced.TopK));
-    }
-    if (InModelParams.Advanced.TopP != -1.f)
-    {
-        llama_sampler_chain_add(Sampler, llama_sampler_init_top_p(InModelParams.Advanced.TopP, 1));
-    }
-    if (InModelParams.Advanced.TypicalP != -1.f)
+    if (IsTaskCancelled())
     {
-        llama_sampler_chain_add(Sampler, llama_sampler_init_typical(InModelParams.Advanced.TypicalP, 1));
-    }
-    if (InModelParams.Advanced.Mirostat != -1)
-    {
-        llama_sampler_chain_add(Sampler, llama_sampler_init_mirostat_v2(
-            InModelParams.Advanced.Mirostat, InModelParams.Advanced.MirostatTau, InModelParams.Advanced.MirostatEta));
+        UE_LOG(LlamaLog, Log, TEXT("%hs: model load cancelled"), __func__);
+        return false;
     }
 
-    //Seed is either default or the one specifically passed in for deterministic results
-    if (InModelParams.Seed == -1)
+    if (!CreateContext(TunedParams))
     {
-        llama_sampler_chain_add(Sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+        return false;
     }
-    else
+
+    CreateSamplers(TunedParams);
+
+    if (!InModelParams.PathToDraftModel.IsEmpty())
     {
-        llama_sampler_chain_add(Sampler, llama_sampler_init_dist(InModelParams.Seed));
+        LoadDraftModel(TunedParams, MakeContextParams(TunedParams));
+
+        if (IsTaskCancelled())
+        {
+            UE_LOG(LlamaLog, Log, TEXT("%hs: model load cancelled"), __func__);
+            return false;
+        }
     }
-    
+
+    CreateSpeculativeBatch(TunedParams);
+
     //NB: this is just a starting heuristic, 
     ContextHistory.reserve(1024);
 
@@ -177,355 +158,2211 @@ bool FLlamaInternal::LoadModelFromParams(const FLLMModelParams& InModelParams)
         }
     }
     
+    ProbeTemplatePrefixStability();
+
+    LoadedParams = TunedParams;
+
+    std::vector<std::string> StopSequences;
+    for (const FString& StopSequence : LoadedParams.StopSequences)
+    {
+        StopSequences.push_back(FLlamaString::ToStd(StopSequence));
+    }
+    StopSequenceMatcher.Build(StopSequences);
+
     FilledContextCharLength = 0;
+    ContextHistoryRewrittenFrom = 0;
+    DanglingAssistantPrefixLength = 0;
+    bLogitsValid = false;
+
+    if (InModelParams.Advanced.bWarmupOnLoad)
+    {
+        WarmupContext();
+    }
 
     bIsModelLoaded = true;
+    bLoadFinished = true;
 
     return true;
 }
 
-void FLlamaInternal::UnloadModel()
+void FLlamaInternal::WarmupContext()
 {
-    if (Sampler)
+    const double StartTime = FPlatformTime::Seconds();
+    const llama_vocab* Vocab = llama_model_get_vocab(LlamaModel);
+
+    std::vector<llama_token> Tokens;
+    if (llama_vocab_bos(Vocab) != LLAMA_TOKEN_NULL)
     {
-        llama_sampler_free(Sampler);
-        Sampler = nullptr;
+        Tokens.push_back(llama_vocab_bos(Vocab));
     }
-    if (Context)
+    if (llama_vocab_eos(Vocab) != LLAMA_TOKEN_NULL)
     {
-        llama_free(Context);
-        Context = nullptr;
+        Tokens.push_back(llama_vocab_eos(Vocab));
     }
-    if (LlamaModel)
+    if (Tokens.empty())
     {
-        llama_model_free(LlamaModel);
-        LlamaModel = nullptr;
+        Tokens.push_back(0);
     }
-    if (CommonSampler)
+
+    if (DecodeTokens(Tokens.data(), Tokens.size(), false) < 0)
     {
-        common_sampler_free(CommonSampler);
+        UE_LOG(LlamaLog, Warning, TEXT("%hs: warmup decode failed"), __func__);
     }
-    
-    ContextHistory.clear();
+    TruncateTokens(0);
 
-    bIsModelLoaded = false;
+    if (DraftContext)
+    {
+        llama_decode(DraftContext, llama_batch_get_one(Tokens.data(), Tokens.size()));
+        llama_kv_cache_clear(DraftContext);
+    }
+
+    //Don't count the warmup in our timings, a shared context keeps counting for everyone
+    if (!BatchScheduler)
+    {
+        llama_synchronize(Context);
+        llama_perf_context_reset(Context);
+    }
+
+    UE_LOG(LlamaLog, Log, TEXT("%hs: warmup took %1.3fs"), __func__, FPlatformTime::Seconds() - StartTime);
 }
 
-std::string FLlamaInternal::WrapPromptForRole(const std::string& Text, EChatTemplateRole Role, const std::string& OverrideTemplate, bool bAddAssistantBoS)
+llama_context_params FLlamaInternal::MakeContextParams(const FLLMModelParams& InModelParams)
 {
-    std::vector<llama_chat_message> MessageListWrapper;
-    MessageListWrapper.push_back({ RoleForEnum(Role), _strdup(Text.c_str()) });
+    llama_context_params ContextParams = llama_context_default_params();
+    ContextParams.n_ctx = InModelParams.MaxContextLength;
+    ContextParams.n_batch = InModelParams.MaxBatchLength;
+    ContextParams.n_threads = InModelParams.Advanced.DecodeThreads > 0 ? InModelParams.Advanced.DecodeThreads : InModelParams.Threads;
+    ContextParams.n_threads_batch = InModelParams.Advanced.PrefillThreads > 0 ? InModelParams.Advanced.PrefillThreads : InModelParams.Threads;
+    if (InModelParams.Advanced.MicroBatchLength > 0)
+    {
+        ContextParams.n_ubatch = InModelParams.Advanced.MicroBatchLength;
+    }
+    return ContextParams;
+}
 
-    //pre-allocate buffer 2x the size of text
-    std::vector<char> Buffer;
+bool FLlamaInternal::CreateContext(const FLLMModelParams& InModelParams)
+{
+    const llama_context_params ContextParams = MakeContextParams(InModelParams);
 
-    int32 NewLen = 0;
+    if (InModelParams.Advanced.bUseSharedBatchedContext)
+    {
+        BatchScheduler = FLlamaBatchScheduler::AcquireShared(LlamaModel, ContextParams, FMath::Max(1, InModelParams.Advanced.SharedContextMaxSequences),
+            FMath::Max(0, InModelParams.Advanced.PrefixCacheSlots), InModelParams.Advanced.PrefixCacheMinTokens);
+        SeqId = BatchScheduler.IsValid() ? BatchScheduler->AcquireSequence() : -1;
+        if (SeqId < 0)
+        {
+            UE_LOG(LlamaLog, Warning, TEXT("%hs: no free sequence in the shared context, using an own context"), __func__);
+            BatchScheduler.Reset();
+            SeqId = 0;
+        }
+        else
+        {
+            Context = BatchScheduler->GetContext();
+        }
+    }
 
-    if (OverrideTemplate.empty())
+    if (!Context)
     {
-        NewLen = ApplyTemplateFromMessagesToBuffer(Template, MessageListWrapper, Buffer, bAddAssistantBoS);
+        //The shared context serves everyone, its decodes are never aborted for one task
+        Context = llama_init_from_model(LlamaModel, ContextParams);
+        if (Context)
+        {
+            llama_set_abort_callback(Context, &FLlamaInternal::AbortDecodeCallback, this);
+
+            if (InModelParams.Advanced.bUseDedicatedThreadpool && CreateThreadpools(InModelParams))
+            {
+                llama_attach_threadpool(Context, Threadpool, ThreadpoolBatch);
+            }
+        }
     }
-    else
+    if (!Context)
     {
-        NewLen = ApplyTemplateFromMessagesToBuffer(OverrideTemplate, MessageListWrapper, Buffer, bAddAssistantBoS);
+        UE_LOG(LlamaLog, Error, TEXT("%hs: error: failed to create the llama_context\n"), __func__);
+        return false;
     }
+    bLogitsValid = false;
+    return true;
+}
 
-    if(NewLen > 0)
+void FLlamaInternal::FreeContext()
+{
+    if (SpeculativeBatch.token)
     {
-        return std::string(Buffer.data(), Buffer.data() + NewLen);
+        llama_batch_free(SpeculativeBatch);
+        SpeculativeBatch = {};
     }
-    else
+
+    if (BatchScheduler)
     {
-        return std::string("");
+        //Shared context is freed with the scheduler once its last sequence is released
+        FinishSampling();
+        BatchScheduler->ReleaseSequence(SeqId);
+        BatchScheduler.Reset();
+        Context = nullptr;
+        SeqId = 0;
+    }
+    else if (Context)
+    {
+        llama_detach_threadpool(Context);
+        llama_free(Context);
+        Context = nullptr;
     }
+    FreeThreadpools();
+    bLogitsValid = false;
 }
 
-void FLlamaInternal::StopGeneration()
+bool FLlamaInternal::CreateThreadpools(const FLLMModelParams& InModelParams)
 {
-    bGenerationActive = false;
-}
+    const llama_context_params ContextParams = MakeContextParams(InModelParams);
 
-bool FLlamaInternal::IsGenerating()
-{
-    return bGenerationActive;
-}
+    //No lower level than normal in ggml, we can only raise it
+    ggml_sched_priority Priority = GGML_SCHED_PRIO_NORMAL;
+    switch (InModelParams.Advanced.ComputeThreadPriority)
+    {
+    case ELlamaThreadPriority::AboveNormal:
+        Priority = GGML_SCHED_PRIO_MEDIUM;
+        break;
+    case ELlamaThreadPriority::Highest:
+        Priority = GGML_SCHED_PRIO_HIGH;
+        break;
+    default:
+        break;
+    }
 
-int32 FLlamaInternal::MaxContext()
-{
-    if (Context)
+    auto MakePoolParams = [&](int32 NThreads, const FString& CpuMask)
     {
-        return llama_n_ctx(Context);
+        ggml_threadpool_params PoolParams = ggml_threadpool_params_default(NThreads);
+        PoolParams.prio = Priority;
+        PoolParams.poll = FMath::Clamp(InModelParams.Advanced.ThreadpoolPollLevel, 0, 100);
+        PoolParams.strict_cpu = InModelParams.Advanced.bStrictCpuPlacement;
+
+        //all zero keeps the default affinity
+        const std::string Mask = FLlamaString::ToStd(CpuMask);
+        if (!Mask.empty())
+        {
+            const bool bParsed = Mask.find('-') != std::string::npos ? parse_cpu_range(Mask, PoolParams.cpumask) : parse_cpu_mask(Mask, PoolParams.cpumask);
+            if (!bParsed)
+            {
+                UE_LOG(LlamaLog, Warning, TEXT("Invalid cpu mask '%s', threads won't be pinned"), *CpuMask);
+                FMemory::Memzero(PoolParams.cpumask);
+            }
+        }
+        return PoolParams;
+    };
+
+    ggml_threadpool_params DecodeParams = MakePoolParams(ContextParams.n_threads, InModelParams.Advanced.DecodeCpuMask);
+    ggml_threadpool_params PrefillParams = MakePoolParams(ContextParams.n_threads_batch, InModelParams.Advanced.PrefillCpuMask);
+
+    //Same setup for both: one pool. Otherwise the generation pool starts paused, ggml resumes whichever pool a decode uses.
+    if (!ggml_threadpool_params_match(&DecodeParams, &PrefillParams))
+    {
+        ThreadpoolBatch = ggml_threadpool_new(&PrefillParams);
+        if (!ThreadpoolBatch)
+        {
+            UE_LOG(LlamaLog, Warning, TEXT("%hs: failed to create the prefill threadpool, using ggml's default threads"), __func__);
+            return false;
+        }
+        DecodeParams.paused = true;
     }
-    else
+
+    Threadpool = ggml_threadpool_new(&DecodeParams);
+    if (!Threadpool)
     {
-        return 0;
+        UE_LOG(LlamaLog, Warning, TEXT("%hs: failed to create the threadpool, using ggml's default threads"), __func__);
+        FreeThreadpools();
+        return false;
     }
+    return true;
 }
 
-int32 FLlamaInternal::UsedContext()
+void FLlamaInternal::FreeThreadpools()
 {
-    if (Context)
+    if (Threadpool)
     {
-        return llama_get_kv_cache_used_cells(Context);
+        ggml_threadpool_free(Threadpool);
+        Threadpool = nullptr;
     }
-    else
+    if (ThreadpoolBatch)
     {
-        return 0;
+        ggml_threadpool_free(ThreadpoolBatch);
+        ThreadpoolBatch = nullptr;
     }
 }
 
-bool FLlamaInternal::IsModelLoaded()
+void FLlamaInternal::CreateSpeculativeBatch(const FLLMModelParams& InModelParams)
 {
-    return bIsModelLoaded;
+    //Verification batch holds the sampled token plus the draft. Needs logits at every position, which the shared scheduler doesn't provide.
+    if (!BatchScheduler && (DraftContext || InModelParams.Advanced.bUsePromptLookupDecoding))
+    {
+        SpeculativeDraftMax = FMath::Clamp(InModelParams.Advanced.SpeculativeDraftMax, 1, (int32)llama_n_batch(Context) - 1);
+        SpeculativeBatch = llama_batch_init(SpeculativeDraftMax + 1, 0, 1);
+    }
 }
 
-void FLlamaInternal::ResetContextHistory(bool bKeepSystemsPrompt)
+bool FLlamaInternal::ReconfigureContext(const FLLMModelParams& InModelParams)
 {
+    if (!bIsModelLoaded)
+    {
+        UE_LOG(LlamaLog, Warning, TEXT("%hs: model isn't loaded"), __func__);
+        return false;
+    }
     if (IsGenerating())
     {
-        StopGeneration();
+        UE_LOG(LlamaLog, Warning, TEXT("%hs: can't reconfigure while generating"), __func__);
+        return false;
     }
 
-    if (bKeepSystemsPrompt)
+    //The ledger is all we need to rebuild the KV cache in the new context
+    const std::vector<llama_token> PreviousTokens = ContextTokens;
+
+    FreeContext();
+    if (DraftContext)
     {
-        //Valid trim case
-        if (Messages.size() > 1)
+        llama_free(DraftContext);
+        DraftContext = nullptr;
+        DraftContextTokens.clear();
+    }
+
+    FLLMModelParams ContextModelParams = LoadedParams;
+    ContextModelParams.MaxContextLength = InModelParams.MaxContextLength;
+    ContextModelParams.MaxBatchLength = InModelParams.MaxBatchLength;
+    ContextModelParams.Threads = InModelParams.Threads;
+    ContextModelParams.Advanced.PrefillThreads = InModelParams.Advanced.PrefillThreads;
+    ContextModelParams.Advanced.DecodeThreads = InModelParams.Advanced.DecodeThreads;
+    ContextModelParams.Advanced.MicroBatchLength = InModelParams.Advanced.MicroBatchLength;
+    ContextModelParams.Advanced.bUseDedicatedThreadpool = InModelParams.Advanced.bUseDedicatedThreadpool;
+    ContextModelParams.Advanced.DecodeCpuMask = InModelParams.Advanced.DecodeCpuMask;
+    ContextModelParams.Advanced.PrefillCpuMask = InModelParams.Advanced.PrefillCpuMask;
+    ContextModelParams.Advanced.bStrictCpuPlacement = InModelParams.Advanced.bStrictCpuPlacement;
+    ContextModelParams.Advanced.ComputeThreadPriority = InModelParams.Advanced.ComputeThreadPriority;
+    ContextModelParams.Advanced.ThreadpoolPollLevel = InModelParams.Advanced.ThreadpoolPollLevel;
+    ContextModelParams.Advanced.bUseSharedBatchedContext = InModelParams.Advanced.bUseSharedBatchedContext;
+    ContextModelParams.Advanced.SharedContextMaxSequences = InModelParams.Advanced.SharedContextMaxSequences;
+    ContextModelParams.Advanced.PrefixCacheSlots = InModelParams.Advanced.PrefixCacheSlots;
+    ContextModelParams.Advanced.PrefixCacheMinTokens = InModelParams.Advanced.PrefixCacheMinTokens;
+
+    bool bSuccess = CreateContext(ContextModelParams);
+    if (!bSuccess)
+    {
+        //Fall back to what we had so the model stays usable
+        UE_LOG(LlamaLog, Warning, TEXT("%hs: new context failed, restoring the previous configuration"), __func__);
+        ContextModelParams = LoadedParams;
+        if (!CreateContext(ContextModelParams))
         {
-            //Rollback all the messages except the first one
-            RollbackContextHistoryByMessages(Messages.size() - 1);
-            return;
+            UnloadModel();
+            return false;
         }
     }
+    LoadedParams = ContextModelParams;
 
-    //Full Reset
-    ContextHistory.clear();
-    Messages.clear();
-
-    llama_kv_cache_clear(Context);
-    FilledContextCharLength = 0;
-}
-
-void FLlamaInternal::RollbackContextHistoryByTokens(int32 NTokensToErase)
-{
-    // clear the last n_regen tokens from the KV cache and update n_past
-    int32 TokensUsed = llama_get_kv_cache_used_cells(Context); //FilledContextCharLength
-
-    llama_kv_cache_seq_rm(Context, 0, TokensUsed - NTokensToErase, -1);
+    //A shared scheduler context can't speculate, release the draft instead of keeping it loaded for nothing
+    if (BatchScheduler)
+    {
+        UnloadDraftModel();
+    }
+    else if (DraftModel)
+    {
+        DraftContext = llama_init_from_model(DraftModel, MakeContextParams(ContextModelParams));
+        if (!DraftContext)
+        {
+            UE_LOG(LlamaLog, Error, TEXT("%hs: failed to create the draft llama_context, speculative decoding off"), __func__);
+            UnloadDraftModel();
+        }
+    }
+    else if (!ContextModelParams.PathToDraftModel.IsEmpty())
+    {
+        LoadDraftModel(ContextModelParams, MakeContextParams(ContextModelParams));
+    }
+    CreateSpeculativeBatch(ContextModelParams);
 
-    //FilledContextCharLength -= NTokensToErase;
+    //Re-prefill the conversation if it still fits, otherwise start over with an empty history
+    ContextTokens.clear();
+    ContextTokensRewrittenFrom = 0;
+    int32 TokensRestored = 0;
+    if (!PreviousTokens.empty() && (int32)PreviousTokens.size() <= MaxContext())
+    {
+        TokensRestored = DecodePromptTokens(PreviousTokens, EChatTemplateRole::Unknown, false);
+    }
+    if (TokensRestored != (int32)PreviousTokens.size())
+    {
+        UE_LOG(LlamaLog, Warning, TEXT("%hs: conversation of %d tokens couldn't be restored, history cleared"), __func__, (int32)PreviousTokens.size());
+        TruncateTokens(0);
+        ContextHistory.clear();
+        ClearMessages();
+        FilledContextCharLength = 0;
+        ContextHistoryRewrittenFrom = 0;
+        DanglingAssistantPrefixLength = 0;
+        DanglingAssistantPrefixTokens = 0;
+    }
 
-    //Run a decode to sync everything else
-    //llama_decode(Context, llama_batch_get_one(nullptr, 0));
+    return bSuccess;
 }
 
-void FLlamaInternal::RollbackContextHistoryByMessages(int32 NMessagesToErase)
+bool FLlamaInternal::LoadDraftModel(const FLLMModelParams& InModelParams, const llama_context_params& ContextParams)
 {
-    if (IsGenerating())
+    if (BatchScheduler)
     {
-        StopGeneration();
+        UE_LOG(LlamaLog, Warning, TEXT("%hs: speculative decoding isn't supported in a shared batched context, draft model ignored"), __func__);
+        return false;
     }
 
-    if (NMessagesToErase <= Messages.size()) 
+    llama_model_params DraftModelParams = llama_model_default_params();
+    DraftModelParams.n_gpu_layers = InModelParams.GPULayers;
+
+    std::string Path = TCHAR_TO_UTF8(*FLlamaPaths::ParsePathIntoFullPath(InModelParams.PathToDraftModel));
+    DraftModel = FLlamaModelRegistry::Get().AcquireModel(Path, DraftModelParams);
+    if (!DraftModel)
     {
-        Messages.resize(Messages.size() - NMessagesToErase);
+        UE_LOG(LlamaLog, Error, TEXT("%hs: unable to load draft model, speculative decoding off"), __func__);
+        return false;
     }
 
-    //Obtain full prompt before it gets deleted
-    std::string FullPrompt(ContextHistory.data(), ContextHistory.data() + FilledContextCharLength);
-    
-    //resize the context history
-    int32 NewLen = ApplyTemplateToContextHistory(false);
-
-    //tokenize to find out how many tokens we need to remove
-
-    //Obtain new prompt, find delta
-    std::string FormattedPrompt(ContextHistory.data(), ContextHistory.data() + NewLen);
-
-    std::string PromptToRemove(FullPrompt.substr(FormattedPrompt.length()));
-
+    //Drafts are verified by token id, both models have to tokenize identically
     const llama_vocab* Vocab = llama_model_get_vocab(LlamaModel);
-    const int NPromptTokens = -llama_tokenize(Vocab, PromptToRemove.c_str(), PromptToRemove.size(), NULL, 0, false, true);
+    const llama_vocab* DraftVocab = llama_model_get_vocab(DraftModel);
+    if (llama_vocab_n_tokens(Vocab) != llama_vocab_n_tokens(DraftVocab) ||
+        llama_vocab_bos(Vocab) != llama_vocab_bos(DraftVocab) ||
+        llama_vocab_eos(Vocab) != llama_vocab_eos(DraftVocab))
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: draft model vocab doesn't match the main model, speculative decoding off"), __func__);
+        UnloadDraftModel();
+        return false;
+    }
 
-    //now rollback KV-cache
-    RollbackContextHistoryByTokens(NPromptTokens);
+    DraftContext = llama_init_from_model(DraftModel, ContextParams);
+    if (!DraftContext)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: failed to create the draft llama_context"), __func__);
+        UnloadDraftModel();
+        return false;
+    }
 
-    //Sync resized length;
-    FilledContextCharLength = NewLen;
+    //Draft only needs its top candidates and their probabilities
+    common_params_sampling DraftSamplingParams;
+    DraftSamplingParams.top_k = 10;
+    DraftSamplingParams.samplers = { COMMON_SAMPLER_TYPE_TOP_K };
+    DraftSampler = common_sampler_init(DraftModel, DraftSamplingParams);
 
-    //Shrink to fit
-    ContextHistory.resize(FilledContextCharLength);
+    return true;
 }
 
-std::string FLlamaInternal::InsertRawPrompt(const std::string& Prompt, bool bGenerateReply)
+void FLlamaInternal::UnloadDraftModel()
 {
-    if (!bIsModelLoaded)
+    if (DraftSampler)
     {
-        UE_LOG(LlamaLog, Warning, TEXT("Model isn't loaded"));
-        return 0;
+        common_sampler_free(DraftSampler);
+        DraftSampler = nullptr;
+    }
+    if (DraftContext)
+    {
+        llama_free(DraftContext);
+        DraftContext = nullptr;
+    }
+    if (DraftModel)
+    {
+        FLlamaModelRegistry::Get().ReleaseModel(DraftModel);
+        DraftModel = nullptr;
     }
+    DraftContextTokens.clear();
+}
 
-    int32 TokensProcessed = ProcessPrompt(Prompt);
+void FLlamaInternal::CreateSamplers(const FLLMModelParams& InModelParams)
+{
+    FreeSamplers();
 
-    FLlamaString::AppendToCharVector(ContextHistory, Prompt);
+    const FLlamaSamplerChain Chain = BuildSamplerChain(SamplingParamsFromModelParams(InModelParams), InModelParams.Advanced.bUseCommonSampler);
+    Sampler = Chain.Sampler;
+    CommonSampler = Chain.CommonSampler;
+}
 
-    if (bGenerateReply)
-    {
-        std::string Response = Generate("", false);
-        FLlamaString::AppendToCharVector(ContextHistory, Response);
-    }
-    return "";
+FLlamaSamplingParams FLlamaInternal::SamplingParamsFromModelParams(const FLLMModelParams& InModelParams)
+{
+    FLlamaSamplingParams Params;
+    Params.Temp = InModelParams.Advanced.Temp;
+    Params.MinP = InModelParams.Advanced.MinP;
+    Params.TopK = InModelParams.Advanced.TopK;
+    Params.TopP = InModelParams.Advanced.TopP;
+    Params.TypicalP = InModelParams.Advanced.TypicalP;
+    Params.PenaltyLastN = InModelParams.Advanced.PenaltyLastN;
+    Params.PenaltyRepeat = InModelParams.Advanced.PenaltyRepeat;
+    Params.PenaltyFrequency = InModelParams.Advanced.PenaltyFrequency;
+    Params.PenaltyPresence = InModelParams.Advanced.PenaltyPresence;
+    Params.Mirostat = InModelParams.Advanced.Mirostat;
+    Params.MirostatTau = InModelParams.Advanced.MirostatTau;
+    Params.MirostatEta = InModelParams.Advanced.MirostatEta;
+    Params.Seed = InModelParams.Seed;
+    return Params;
 }
 
-std::string FLlamaInternal::InsertTemplatedPrompt(const std::string& Prompt, EChatTemplateRole Role, bool bAddAssistantBoS, bool bGenerateReply)
+FLlamaInternal::FLlamaSamplerChain FLlamaInternal::BuildSamplerChain(const FLlamaSamplingParams& Params, bool bUseCommonSampler)
 {
-    if (!bIsModelLoaded)
-    {
-        UE_LOG(LlamaLog, Warning, TEXT("Model isn't loaded"));
-        return 0;
-    }
+    FLlamaSamplerChain Chain;
 
-    int32 NewLen = FilledContextCharLength;
+    //common sampler strategy
 
-    if (!Prompt.empty())
+    if (bUseCommonSampler)
+    {
+        common_params_sampling SamplingParams;
+        
+        if (Params.MinP != -1.f)
+        {
+            SamplingParams.min_p = Params.MinP;
+        }
+        if (Params.TopK != -1.f)
+        {
+            SamplingParams.top_k = Params.TopK;
+        }
+        if (Params.TopP != -1.f)
+        {
+            SamplingParams.top_p = Params.TopP;
+        }
+        if (Params.TypicalP != -1.f)
+        {
+            SamplingParams.typ_p = Params.TypicalP;
+        }
+        if (Params.Mirostat != -1)
+        {
+            SamplingParams.mirostat = Params.Mirostat;
+            SamplingParams.mirostat_eta = Params.MirostatEta;
+            SamplingParams.mirostat_tau = Params.MirostatTau;
+        }
+
+        //Seed is either default or the one specifically passed in for deterministic results
+        if (Params.Seed != -1)
+        {
+            SamplingParams.seed = Params.Seed;
+        }
+
+        Chain.CommonSampler = common_sampler_init(LlamaModel, SamplingParams);
+    }
+
+
+    llama_sampler* ChainSampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    Chain.Sampler = ChainSampler;
+
+    //Temperature is always applied
+    llama_sampler_chain_add(ChainSampler, llama_sampler_init_temp(Params.Temp));
+
+    //If any of the repeat penalties are set, apply penalties to sampler
+    if (Params.PenaltyLastN != 0 || 
+        Params.PenaltyRepeat != 1.f ||
+        Params.PenaltyFrequency != 0.f ||
+        Params.PenaltyPresence != 0.f)
+    {
+        llama_sampler_chain_add(ChainSampler, llama_sampler_init_penalties(
+            Params.PenaltyLastN, Params.PenaltyRepeat,
+            Params.PenaltyFrequency, Params.PenaltyPresence));
+    }
+    
+    //Optional sampling strategies - MinP should be applied by default of 0.05f
+    if (Params.MinP != -1.f)
+    {
+        llama_sampler_chain_add(ChainSampler, llama_sampler_init_min_p(Params.MinP, 1));
+    }
+    if (Params.TopK != -1.f)
+    {
+        llama_sampler_chain_add(ChainSampler, llama_sampler_init_top_k(Params.TopK));
+    }
+    if (Params.TopP != -1.f)
+    {
+        llama_sampler_chain_add(ChainSampler, llama_sampler_init_top_p(Params.TopP, 1));
+    }
+    if (Params.TypicalP != -1.f)
+    {
+        llama_sampler_chain_add(ChainSampler, llama_sampler_init_typical(Params.TypicalP, 1));
+    }
+    if (Params.Mirostat != -1)
+    {
+        llama_sampler_chain_add(ChainSampler, llama_sampler_init_mirostat_v2(
+            Params.Mirostat, Params.MirostatTau, Params.MirostatEta));
+    }
+
+    //Seed is either default or the one specifically passed in for deterministic results
+    if (Params.Seed == -1)
+    {
+        llama_sampler_chain_add(ChainSampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    }
+    else
+    {
+        llama_sampler_chain_add(ChainSampler, llama_sampler_init_dist(Params.Seed));
+    }
+
+    return Chain;
+}
+
+FLlamaInternal::FLlamaSamplerChain FLlamaInternal::AcquireOverrideSamplers(const FLlamaSamplingParams& Params)
+{
+    for (FCachedSamplerChain& Cached : SamplerCache)
+    {
+        if (Cached.Params == Params)
+        {
+            //Start from the seed with empty penalty history, as if freshly built, so a fixed seed reproduces its reply
+            llama_sampler_reset(Cached.Chain.Sampler);
+            if (Cached.Chain.CommonSampler)
+            {
+                common_sampler_reset(Cached.Chain.CommonSampler);
+            }
+            Cached.LastUsed = ++SamplerCacheCounter;
+            return Cached.Chain;
+        }
+    }
+
+    //Evict the least recently used chain when full
+    if ((int32)SamplerCache.size() >= SamplerCacheSize)
+    {
+        auto Oldest = std::min_element(SamplerCache.begin(), SamplerCache.end(), [](const FCachedSamplerChain& A, const FCachedSamplerChain& B)
+        {
+            return A.LastUsed < B.LastUsed;
+        });
+        llama_sampler_free(Oldest->Chain.Sampler);
+        if (Oldest->Chain.CommonSampler)
+        {
+            common_sampler_free(Oldest->Chain.CommonSampler);
+        }
+        SamplerCache.erase(Oldest);
+    }
+
+    FCachedSamplerChain Cached;
+    Cached.Params = Params;
+    Cached.Chain = BuildSamplerChain(Params, LoadedParams.Advanced.bUseCommonSampler);
+    Cached.LastUsed = ++SamplerCacheCounter;
+    SamplerCache.push_back(Cached);
+
+    return Cached.Chain;
+}
+
+void FLlamaInternal::FreeSamplers()
+{
+    if (Sampler)
+    {
+        llama_sampler_free(Sampler);
+        Sampler = nullptr;
+    }
+    if (CommonSampler)
+    {
+        common_sampler_free(CommonSampler);
+        CommonSampler = nullptr;
+    }
+
+    for (FCachedSamplerChain& Cached : SamplerCache)
+    {
+        llama_sampler_free(Cached.Chain.Sampler);
+        if (Cached.Chain.CommonSampler)
+        {
+            common_sampler_free(Cached.Chain.CommonSampler);
+        }
+    }
+    SamplerCache.clear();
+}
+
+uint32 FLlamaInternal::SamplerSeed()
+{
+    if (CommonSampler)
+    {
+        return common_sampler_get_seed(CommonSampler);
+    }
+    if (Sampler)
+    {
+        return llama_sampler_get_seed(Sampler);
+    }
+    return LLAMA_DEFAULT_SEED;
+}
+
+void FLlamaInternal::UnloadModel()
+{
+    UnloadDraftModel();
+    FreeSamplers();
+    FreeContext();
+
+    if (LlamaModel)
+    {
+        FLlamaModelRegistry::Get().ReleaseModel(LlamaModel);
+        LlamaModel = nullptr;
+    }
+    
+    ContextHistory.clear();
+    ClearMessages();
+    ContextTokens.clear();
+    ContextTokensRewrittenFrom = 0;
+    FilledContextCharLength = 0;
+    ContextHistoryRewrittenFrom = 0;
+    DanglingAssistantPrefixLength = 0;
+    DanglingAssistantPrefixTokens = 0;
+
+    bIsModelLoaded = false;
+}
+
+bool FLlamaInternal::SaveSessionToBuffer(TArray<uint8>& OutBuffer)
+{
+    if (!bIsModelLoaded)
+    {
+        UE_LOG(LlamaLog, Warning, TEXT("Model isn't loaded, no session to save."));
+        return false;
+    }
+
+    auto SerializeStdString = [](FArchive& Ar, const std::string& String)
+    {
+        int32 Length = String.length();
+        Ar << Length;
+        Ar.Serialize((void*)String.data(), Length);
+    };
+
+    //Metadata block
+    TArray<uint8> Meta;
+    FMemoryWriter Writer(Meta);
+
+    uint64 ModelParamCount = llama_model_n_params(LlamaModel);
+    uint32 Seed = SamplerSeed();
+    Writer << ModelParamCount;
+    Writer << Seed;
+
+    int32 NMessages = Messages.size();
+    Writer << NMessages;
+    for (int32 i = 0; i < NMessages; i++)
+    {
+        uint8 Role = (uint8)RoleForString(Messages[i].role);
+        Writer << Role;
+        SerializeStdString(Writer, std::string(Messages[i].content));
+
+        FLlamaMessageSpan Span = MessageSpans[i];
+        Writer << Span.TokenStart << Span.TokenCount << Span.CharStart << Span.AssistantPrefixTokens;
+    }
+
+    int32 NTokens = ContextTokens.size();
+    Writer << NTokens;
+    Writer.Serialize(ContextTokens.data(), NTokens * sizeof(llama_token));
+
+    SerializeStdString(Writer, std::string(ContextHistory.data(), ContextHistory.data() + FilledContextCharLength));
+    Writer << DanglingAssistantPrefixLength << DanglingAssistantPrefixTokens;
+
+    //Final layout: [int64 MetaSize][Meta][int64 KVSize][KV]
+    const int64 MetaSize = Meta.Num();
+    FLlamaContextLock ContextLock(BatchScheduler.Get());
+    const int64 KVSize = llama_state_seq_get_size(Context, SeqId);
+
+    //Large models with long contexts can have gigabytes of KV, more than a TArray holds
+    const int64 PayloadSize = sizeof(int64) * 2 + MetaSize + KVSize;
+    if (PayloadSize > MaxSessionPayloadSize)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: session is %lld bytes, more than the %lld a session file can hold. Use a smaller context to save it."),
+            __func__, PayloadSize, MaxSessionPayloadSize);
+        return false;
+    }
+
+    OutBuffer.Reset((int32)PayloadSize);
+    OutBuffer.Append((const uint8*)&MetaSize, sizeof(int64));
+    OutBuffer.Append(Meta);
+    OutBuffer.Append((const uint8*)&KVSize, sizeof(int64));
+
+    const int64 KVOffset = OutBuffer.Num();
+    OutBuffer.AddUninitialized((int32)KVSize);
+    if (llama_state_seq_get_data(Context, OutBuffer.GetData() + KVOffset, KVSize, SeqId) != KVSize)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: failed to copy KV sequence state"), __func__);
+        return false;
+    }
+
+    return true;
+}
+
+bool FLlamaInternal::LoadSessionFromBuffer(const uint8* Data, int64 DataSize)
+{
+    if (!bIsModelLoaded)
+    {
+        UE_LOG(LlamaLog, Warning, TEXT("Model isn't loaded, can't restore a session."));
+        return false;
+    }
+
+    int64 MetaSize = 0;
+    if (DataSize < (int64)sizeof(int64))
+    {
+        return false;
+    }
+    FMemory::Memcpy(&MetaSize, Data, sizeof(int64));
+
+    const int64 KVSizeOffset = sizeof(int64) + MetaSize;
+    if (MetaSize < 0 || MetaSize > MaxSessionPayloadSize || KVSizeOffset + (int64)sizeof(int64) > DataSize)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: truncated session data"), __func__);
+        return false;
+    }
+
+    auto SerializeStdString = [](FArchive& Ar, std::string& String)
+    {
+        int32 Length = 0;
+        Ar << Length;
+        if (Length < 0 || Length > Ar.TotalSize() - Ar.Tell())
+        {
+            Ar.SetError();
+            return;
+        }
+        String.resize(Length);
+        Ar.Serialize(String.data(), Length);
+    };
+
+    TArrayView<const uint8> MetaView(Data + sizeof(int64), MetaSize);
+    FMemoryReaderView Reader(MetaView);
+
+    uint64 ModelParamCount = 0;
+    uint32 Seed = 0;
+    Reader << ModelParamCount;
+    Reader << Seed;
+
+    if (ModelParamCount != llama_model_n_params(LlamaModel))
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: session was saved with a different model"), __func__);
+        return false;
+    }
+
+    int32 NMessages = 0;
+    Reader << NMessages;
+
+    std::vector<std::pair<EChatTemplateRole, std::string>> LoadedMessages;
+    std::vector<FLlamaMessageSpan> LoadedSpans;
+    for (int32 i = 0; i < NMessages && !Reader.IsError(); i++)
+    {
+        uint8 Role = 0;
+        std::string Content;
+        Reader << Role;
+        SerializeStdString(Reader, Content);
+
+        FLlamaMessageSpan Span;
+        Reader << Span.TokenStart << Span.TokenCount << Span.CharStart << Span.AssistantPrefixTokens;
+
+        LoadedMessages.push_back({ (EChatTemplateRole)Role, Content });
+        LoadedSpans.push_back(Span);
+    }
+
+    int32 NTokens = 0;
+    Reader << NTokens;
+    std::vector<llama_token> LoadedTokens;
+    if (NTokens >= 0 && NTokens <= MaxContext())
+    {
+        LoadedTokens.resize(NTokens);
+        Reader.Serialize(LoadedTokens.data(), NTokens * sizeof(llama_token));
+    }
+    else
+    {
+        Reader.SetError();
+    }
+
+    std::string LoadedHistory;
+    int32 LoadedDanglingLength = 0;
+    int32 LoadedDanglingTokens = 0;
+    SerializeStdString(Reader, LoadedHistory);
+    Reader << LoadedDanglingLength << LoadedDanglingTokens;
+
+    int64 KVSize = 0;
+    FMemory::Memcpy(&KVSize, Data + KVSizeOffset, sizeof(int64));
+    const int64 KVOffset = KVSizeOffset + sizeof(int64);
+
+    if (Reader.IsError() || KVSize < 0 || KVOffset + KVSize > DataSize)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: malformed session data"), __func__);
+        return false;
+    }
+
+    //Spans index into the token ledger and history, rollback and context shifting trust them blindly later
+    bool bLedgerValid = (int32)LoadedSpans.size() == NMessages &&
+        LoadedDanglingLength >= 0 && LoadedDanglingLength <= (int32)LoadedHistory.size() &&
+        LoadedDanglingTokens >= 0 && LoadedDanglingTokens <= NTokens;
+
+    int64 PreviousTokenEnd = 0;
+    int32 PreviousCharStart = 0;
+    for (int32 i = 0; i < (int32)LoadedSpans.size() && bLedgerValid; i++)
+    {
+        const FLlamaMessageSpan& Span = LoadedSpans[i];
+        const uint8 Role = (uint8)LoadedMessages[i].first;
+        const int64 TokenEnd = (int64)Span.TokenStart + Span.TokenCount;
+
+        bLedgerValid = (Role <= (uint8)EChatTemplateRole::System || Role == (uint8)EChatTemplateRole::Unknown) &&
+            Span.TokenStart >= PreviousTokenEnd && Span.TokenCount >= 0 && TokenEnd <= NTokens &&
+            Span.AssistantPrefixTokens >= 0 && Span.AssistantPrefixTokens <= Span.TokenCount &&
+            Span.CharStart >= PreviousCharStart && Span.CharStart <= (int32)LoadedHistory.size();
+
+        PreviousTokenEnd = TokenEnd;
+        PreviousCharStart = Span.CharStart;
+    }
+
+    if (!bLedgerValid)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: session message spans don't match its tokens and history"), __func__);
+        return false;
+    }
+
+    //Everything parsed, swap in the KV sequence
+    if (IsGenerating())
+    {
+        StopGeneration();
+    }
+    bool bKVRestored = false;
+    bool bLostConversation = false;
+    {
+        FLlamaContextLock ContextLock(BatchScheduler.Get());
+
+        //Keep the live conversation until the file is known good, a bad restore puts it back
+        std::vector<uint8> Snapshot(llama_state_seq_get_size(Context, SeqId));
+        Snapshot.resize(llama_state_seq_get_data(Context, Snapshot.data(), Snapshot.size(), SeqId));
+
+        llama_kv_cache_seq_rm(Context, SeqId, -1, -1);
+        const size_t KVRead = llama_state_seq_set_data(Context, Data + KVOffset, KVSize, SeqId);
+
+        //Every ledger token needs a KV cell, anything less desyncs the next decode
+        bKVRestored = KVRead == (size_t)KVSize && llama_kv_cache_seq_pos_max(Context, SeqId) + 1 == NTokens;
+
+        if (!bKVRestored)
+        {
+            llama_kv_cache_seq_rm(Context, SeqId, -1, -1);
+            bLostConversation = !ContextTokens.empty() &&
+                (Snapshot.empty() || llama_state_seq_set_data(Context, Snapshot.data(), Snapshot.size(), SeqId) == 0);
+        }
+    }
+    bLogitsValid = false;
+
+    if (bLostConversation)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: failed to restore KV sequence state or put back the previous one"), __func__);
+        ResetContextHistory(false);
+        return false;
+    }
+    if (!bKVRestored)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: failed to restore KV sequence state, kept the current conversation"), __func__);
+        return false;
+    }
+
+    ClearMessages();
+    for (const std::pair<EChatTemplateRole, std::string>& Message : LoadedMessages)
+    {
+        Messages.push_back({ RoleForEnum(Message.first), _strdup(Message.second.c_str()) });
+    }
+    MessageSpans = MoveTemp(LoadedSpans);
+    ContextTokens = MoveTemp(LoadedTokens);
+    ContextTokensRewrittenFrom = 0;
+
+    ContextHistory.assign(LoadedHistory.begin(), LoadedHistory.end());
+    FilledContextCharLength = ContextHistory.size();
+    ContextHistoryRewrittenFrom = 0;
+    DanglingAssistantPrefixLength = LoadedDanglingLength;
+    DanglingAssistantPrefixTokens = LoadedDanglingTokens;
+
+    //Resume with the same seed the session was sampled with
+    if (Seed != SamplerSeed())
+    {
+        FLLMModelParams SeededParams = LoadedParams;
+        SeededParams.Seed = Seed;
+        CreateSamplers(SeededParams);
+    }
+
+    return true;
+}
+
+std::string FLlamaInternal::WrapPromptForRole(const std::string& Text, EChatTemplateRole Role, const std::string& OverrideTemplate, bool bAddAssistantBoS)
+{
+    std::vector<llama_chat_message> MessageListWrapper;
+    MessageListWrapper.push_back({ RoleForEnum(Role), _strdup(Text.c_str()) });
+
+    //pre-allocate buffer 2x the size of text
+    std::vector<char> Buffer;
+
+    int32 NewLen = 0;
+
+    if (OverrideTemplate.empty())
+    {
+        NewLen = ApplyTemplateFromMessagesToBuffer(Template, MessageListWrapper, Buffer, bAddAssistantBoS);
+    }
+    else
+    {
+        NewLen = ApplyTemplateFromMessagesToBuffer(OverrideTemplate, MessageListWrapper, Buffer, bAddAssistantBoS);
+    }
+
+    if(NewLen > 0)
+    {
+        return std::string(Buffer.data(), Buffer.data() + NewLen);
+    }
+    else
+    {
+        return std::string("");
+    }
+}
+
+void FLlamaInternal::StopGeneration()
+{
+    bGenerationActive = false;
+    bPromptStopRequested = true;
+}
+
+void FLlamaInternal::SetCancelToken(const FLlamaCancelTokenPtr& InCancelToken)
+{
+    CancelToken = InCancelToken;
+    bPreempted = false;
+
+    //Stops only apply to the task they were issued for (or the next one if none was running)
+    if (InCancelToken.IsValid())
+    {
+        bPromptStopRequested = false;
+    }
+}
+
+void FLlamaInternal::SetDecodeThreads(int32 NThreads)
+{
+    //The shared context decodes for everyone, leave it alone
+    if (BatchScheduler || !Context || NThreads <= 0 || NThreads == llama_n_threads(Context))
+    {
+        return;
+    }
+    llama_set_n_threads(Context, NThreads, llama_n_threads_batch(Context));
+}
+
+bool FLlamaInternal::WasPreempted()
+{
+    return bPreempted;
+}
+
+bool FLlamaInternal::ShouldPreempt()
+{
+    if (!bPreempted && bYieldAllowed && bDecodeCancellable && OnShouldYield)
+    {
+        bPreempted = OnShouldYield();
+    }
+    return bPreempted;
+}
+
+bool FLlamaInternal::IsTaskCancelled()
+{
+    return CancelToken.IsValid() && CancelToken->IsCancelled();
+}
+
+bool FLlamaInternal::AbortDecodeCallback(void* UserData)
+{
+    //Runs on ggml worker threads while the LLM thread is blocked in llama_decode, CancelToken doesn't change meanwhile
+    FLlamaInternal* Self = static_cast<FLlamaInternal*>(UserData);
+    return Self->bDecodeCancellable && Self->IsTaskCancelled();
+}
+
+bool FLlamaInternal::IsGenerating()
+{
+    return bGenerationActive;
+}
+
+bool FLlamaInternal::IsProcessingPrompt()
+{
+    return bPromptProcessingActive;
+}
+
+int32 FLlamaInternal::MaxContext()
+{
+    if (BatchScheduler)
+    {
+        return BatchScheduler->MaxContextPerSequence();
+    }
+    else if (Context)
+    {
+        return llama_n_ctx(Context);
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+int32 FLlamaInternal::UsedContext()
+{
+    if (Context)
+    {
+        return ContextTokens.size();
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+FLlamaPrefixCacheStats FLlamaInternal::PrefixCacheStats()
+{
+    FLlamaPrefixCache* PrefixCache = BatchScheduler ? BatchScheduler->GetPrefixCache() : nullptr;
+    if (PrefixCache)
+    {
+        return PrefixCache->Stats();
+    }
+    return FLlamaPrefixCacheStats();
+}
+
+bool FLlamaInternal::IsModelLoaded()
+{
+    return bIsModelLoaded;
+}
+
+bool FLlamaInternal::WasModelLoadCancelled()
+{
+    return IsTaskCancelled();
+}
+
+void FLlamaInternal::ResetContextHistory(bool bKeepSystemsPrompt)
+{
+    if (IsGenerating())
+    {
+        StopGeneration();
+    }
+
+    if (bKeepSystemsPrompt)
+    {
+        //Valid trim case
+        if (Messages.size() > 1)
+        {
+            //Rollback all the messages except the first one
+            RollbackContextHistoryByMessages(Messages.size() - 1);
+            return;
+        }
+    }
+
+    //Full Reset
+    ContextHistory.clear();
+    ClearMessages();
+    ContextTokens.clear();
+    ContextTokensRewrittenFrom = 0;
+
+    {
+        FLlamaContextLock ContextLock(BatchScheduler.Get());
+        llama_kv_cache_seq_rm(Context, SeqId, -1, -1);
+    }
+    bLogitsValid = false;
+    FilledContextCharLength = 0;
+    ContextHistoryRewrittenFrom = 0;
+    DanglingAssistantPrefixLength = 0;
+    DanglingAssistantPrefixTokens = 0;
+}
+
+void FLlamaInternal::RollbackContextHistoryByTokens(int32 NTokensToErase)
+{
+    const int32 NewTokenCount = FMath::Max(0, (int32)ContextTokens.size() - NTokensToErase);
+    int32 NewCharLength = FilledContextCharLength;
+
+    //Messages which no longer have any tokens in the KV cache get dropped with them
+    while (!MessageSpans.empty() && MessageSpans.back().TokenStart >= NewTokenCount)
+    {
+        NewCharLength = MessageSpans.back().CharStart;
+        free((void*)Messages.back().content);
+        Messages.pop_back();
+        MessageSpans.pop_back();
+        MessagesEpoch++;
+    }
+    if (!MessageSpans.empty())
+    {
+        FLlamaMessageSpan& LastSpan = MessageSpans.back();
+        LastSpan.TokenCount = FMath::Min(LastSpan.TokenCount, NewTokenCount - LastSpan.TokenStart);
+        LastSpan.AssistantPrefixTokens = 0;
+    }
+
+    TruncateContext(NewTokenCount, NewCharLength);
+
+    DanglingAssistantPrefixLength = 0;
+    DanglingAssistantPrefixTokens = 0;
+}
+
+void FLlamaInternal::RollbackContextHistoryByMessages(int32 NMessagesToErase)
+{
+    if (IsGenerating())
+    {
+        StopGeneration();
+    }
+
+    const int32 NMessages = Messages.size();
+    NMessagesToErase = FMath::Clamp(NMessagesToErase, 0, NMessages);
+    if (NMessagesToErase == 0)
+    {
+        return;
+    }
+
+    //Ledger tells us exactly where the first erased message starts in both KV cache and ContextHistory
+    const int32 FirstErased = NMessages - NMessagesToErase;
+    const FLlamaMessageSpan EraseFrom = MessageSpans[FirstErased];
+
+    TruncateContext(EraseFrom.TokenStart, EraseFrom.CharStart);
+
+    for (int32 i = FirstErased; i < NMessages; i++)
+    {
+        free((void*)Messages[i].content);
+    }
+    Messages.resize(FirstErased);
+    MessagesEpoch++;
+    MessageSpans.resize(FirstErased);
+
+    //If the remaining last message was inserted with a generation prompt, history ends with it again
+    if (!MessageSpans.empty() && MessageSpans.back().AssistantPrefixTokens > 0)
+    {
+        DanglingAssistantPrefixLength = DanglingAssistantPrefix.length();
+        DanglingAssistantPrefixTokens = MessageSpans.back().AssistantPrefixTokens;
+    }
+    else
+    {
+        DanglingAssistantPrefixLength = 0;
+        DanglingAssistantPrefixTokens = 0;
+    }
+}
+
+int32 FLlamaInternal::ShiftContext(int32 TokensNeeded)
+{
+    if (!LoadedParams.Advanced.bShiftContextWhenFull)
+    {
+        return 0;
+    }
+    if (!llama_kv_cache_can_shift(Context))
+    {
+        UE_LOG(LlamaLog, Warning, TEXT("Context shift requested but this model's KV cache can't be shifted."));
+        return 0;
+    }
+
+    const int32 NContext = MaxContext();
+    const int32 NPast = ContextTokens.size();
+
+    //System prompt is pinned, otherwise the first few tokens are kept as attention sinks
+    const bool bPinSystem = !Messages.empty() && !MessageSpans.empty() &&
+        FCStringAnsi::Strcmp(Messages[0].role, RoleForEnum(EChatTemplateRole::System)) == 0;
+    const int32 FirstEvictable = bPinSystem ? 1 : 0;
+
+    //Always keep the last message, it's the one currently being processed or replied to
+    const int32 LastEvictable = (int32)MessageSpans.size() - 2;
+    if (LastEvictable < FirstEvictable)
+    {
+        return 0;
+    }
+
+    const FLlamaMessageSpan& FirstSpan = MessageSpans[FirstEvictable];
+    const int32 KeepTokens = bPinSystem ? FirstSpan.TokenStart : FMath::Max(FirstSpan.TokenStart, FMath::Min(LoadedParams.Advanced.ContextShiftKeepTokens, NPast));
+
+    //Discard at least what we need, or half of the unpinned context similar to llama.cpp's context shift
+    const int32 TargetDiscard = FMath::Max(TokensNeeded - (NContext - NPast), (NPast - KeepTokens) / 2);
+
+    int32 NEvicted = 0;
+    int32 DiscardEnd = KeepTokens;
+    for (int32 i = FirstEvictable; i <= LastEvictable && DiscardEnd - KeepTokens < TargetDiscard; i++)
+    {
+        DiscardEnd = MessageSpans[i + 1].TokenStart;
+        NEvicted++;
+    }
+
+    const int32 NDiscard = DiscardEnd - KeepTokens;
+    if (NDiscard <= 0)
+    {
+        return 0;
+    }
+
+    //KV: drop the evicted range and slide everything after it down
+    {
+        FLlamaContextLock ContextLock(BatchScheduler.Get());
+        llama_kv_cache_seq_rm(Context, SeqId, KeepTokens, DiscardEnd);
+        llama_kv_cache_seq_add(Context, SeqId, DiscardEnd, -1, -NDiscard);
+    }
+
+    //Any sink tokens kept from an evicted message stay in history as plain text
+    std::string KeptText;
+    const llama_vocab* Vocab = llama_model_get_vocab(LlamaModel);
+    for (int32 i = FirstSpan.TokenStart; i < KeepTokens; i++)
+    {
+        KeptText += common_token_to_piece(Vocab, ContextTokens[i], true);
+    }
+
+    const int32 CharStart = FirstSpan.CharStart;
+    const int32 CharEnd = MessageSpans[FirstEvictable + NEvicted].CharStart;
+    const int32 NCharDiscard = (CharEnd - CharStart) - (int32)KeptText.length();
+
+    ContextHistory.erase(ContextHistory.begin() + CharStart, ContextHistory.begin() + CharEnd);
+    ContextHistory.insert(ContextHistory.begin() + CharStart, KeptText.begin(), KeptText.end());
+    FilledContextCharLength -= NCharDiscard;
+    ContextHistoryRewrittenFrom = FMath::Min(ContextHistoryRewrittenFrom, CharStart);
+
+    ContextTokens.erase(ContextTokens.begin() + KeepTokens, ContextTokens.begin() + DiscardEnd);
+    ContextTokensRewrittenFrom = FMath::Min(ContextTokensRewrittenFrom, KeepTokens);
+
+    for (int32 i = FirstEvictable; i < FirstEvictable + NEvicted; i++)
+    {
+        free((void*)Messages[i].content);
+    }
+    Messages.erase(Messages.begin() + FirstEvictable, Messages.begin() + FirstEvictable + NEvicted);
+    MessagesEpoch++;
+    MessageSpans.erase(MessageSpans.begin() + FirstEvictable, MessageSpans.begin() + FirstEvictable + NEvicted);
+
+    for (int32 i = FirstEvictable; i < MessageSpans.size(); i++)
+    {
+        MessageSpans[i].TokenStart -= NDiscard;
+        MessageSpans[i].CharStart -= NCharDiscard;
+    }
+
+    UE_LOG(LlamaLog, Log, TEXT("Context shifted: evicted %d messages (%d tokens), %d/%d tokens used"), NEvicted, NDiscard, (int32)ContextTokens.size(), NContext);
+
+    return NDiscard;
+}
+
+void FLlamaInternal::TruncateContext(int32 TokenPosition, int32 CharPosition)
+{
+    TruncateTokens(TokenPosition);
+
+    ContextHistory.resize(CharPosition);
+    FilledContextCharLength = CharPosition;
+    ContextHistoryRewrittenFrom = FMath::Min(ContextHistoryRewrittenFrom, CharPosition);
+}
+
+void FLlamaInternal::TruncateTokens(int32 TokenPosition)
+{
+    {
+        FLlamaContextLock ContextLock(BatchScheduler.Get());
+        llama_kv_cache_seq_rm(Context, SeqId, TokenPosition, -1);
+    }
+    ContextTokens.resize(TokenPosition);
+    ContextTokensRewrittenFrom = FMath::Min(ContextTokensRewrittenFrom, TokenPosition);
+    bLogitsValid = false;
+}
+
+void FLlamaInternal::ClearMessages()
+{
+    for (const llama_chat_message& Message : Messages)
+    {
+        free((void*)Message.content);
+    }
+    Messages.clear();
+    MessageSpans.clear();
+    MessagesEpoch++;
+}
+
+std::string FLlamaInternal::InsertRawPrompt(const std::string& Prompt, bool bGenerateReply)
+{
+    if (!bIsModelLoaded)
+    {
+        UE_LOG(LlamaLog, Warning, TEXT("Model isn't loaded"));
+        return 0;
+    }
+
+    int32 TokensProcessed = ProcessPrompt(Prompt, EChatTemplateRole::Unknown, bGenerateReply);
+
+    if (TokensProcessed < 0)
+    {
+        return std::string();
+    }
+
+    ContextHistory.resize(FilledContextCharLength);
+    FLlamaString::AppendToCharVector(ContextHistory, Prompt);
+    DanglingAssistantPrefixLength = 0;
+    DanglingAssistantPrefixTokens = 0;
+
+    if (bGenerateReply)
+    {
+        std::string Response = Generate("", false);
+        FLlamaString::AppendToCharVector(ContextHistory, Response);
+    }
+    FilledContextCharLength = ContextHistory.size();
+    return "";
+}
+
+std::string FLlamaInternal::InsertTemplatedPrompt(const std::string& Prompt, EChatTemplateRole Role, bool bAddAssistantBoS, bool bGenerateReply,
+    const FLlamaGenerationOptions& Options)
+{
+    if (!bIsModelLoaded)
+    {
+        UE_LOG(LlamaLog, Warning, TEXT("Model isn't loaded"));
+        return 0;
+    }
+
+    int32 NewLen = FilledContextCharLength;
+    int32 DeltaStart = FilledContextCharLength;
+    const int32 PreviousDanglingLength = DanglingAssistantPrefixLength;
+    const int32 PreviousDanglingTokens = DanglingAssistantPrefixTokens;
+
+    if (!Prompt.empty())
     {
         Messages.push_back({ RoleForEnum(Role), _strdup(Prompt.c_str()) });
 
-        NewLen = ApplyTemplateToContextHistory(bAddAssistantBoS);
+        NewLen = ApplyTemplateIncrementally(bAddAssistantBoS, DeltaStart);
+    }
+
+    //A dangling assistant prefix was replaced by this message, the ledger knows how many tokens it took
+    const bool bDroppedDanglingPrefix = DeltaStart < FilledContextCharLength;
+    if (bDroppedDanglingPrefix)
+    {
+        TruncateTokens(ContextTokens.size() - PreviousDanglingTokens);
+        FilledContextCharLength = DeltaStart;
+        ContextHistoryRewrittenFrom = FMath::Min(ContextHistoryRewrittenFrom, DeltaStart);
+
+        if (!MessageSpans.empty())
+        {
+            MessageSpans.back().TokenCount -= MessageSpans.back().AssistantPrefixTokens;
+            MessageSpans.back().AssistantPrefixTokens = 0;
+        }
+    }
+
+    //Tokenize the generation prompt separately so the ledger knows its exact token count
+    const int32 PrefixChars = (!Prompt.empty() && bAddAssistantBoS) ? DanglingAssistantPrefixLength : 0;
+    const int32 BodyEnd = FMath::Max(DeltaStart, NewLen - PrefixChars);
+
+    std::vector<llama_token> PromptTokens;
+    const bool bTokenized = TokenizePrompt(std::string(ContextHistory.data() + DeltaStart, ContextHistory.data() + BodyEnd), PromptTokens);
+    const int32 BodyTokens = PromptTokens.size();
+    const bool bTokenizedPrefix = bTokenized && TokenizePrompt(std::string(ContextHistory.data() + BodyEnd, ContextHistory.data() + NewLen), PromptTokens);
+    const int32 PrefixTokens = PromptTokens.size() - BodyTokens;
+
+    //Fresh conversation: fork a cached prefix of the first message instead of prefilling it
+    FLlamaPrefixCache* PrefixCache = BatchScheduler ? BatchScheduler->GetPrefixCache() : nullptr;
+    const bool bFirstInContext = ContextTokens.empty();
+    int32 NForked = 0;
+    if (PrefixCache && bFirstInContext && bTokenizedPrefix)
+    {
+        NForked = PrefixCache->Fork(PromptTokens, SeqId);
+        if (NForked > 0)
+        {
+            ContextTokens.assign(PromptTokens.begin(), PromptTokens.begin() + NForked);
+            PromptTokens.erase(PromptTokens.begin(), PromptTokens.begin() + NForked);
+            bLogitsValid = false;
+        }
+    }
+
+    //Context shifting during processing may move everything before this message
+    const int32 HistoryLengthBefore = ContextHistory.size();
+    TGuardValue<bool> YieldGuard(bYieldAllowed, !Prompt.empty());
+    TGuardValue<double> DeadlineGuard(PromptDeadlineSeconds, bGenerateReply ? Options.DeadlineSeconds : 0.0);
+    bPromptDeadlinePassed = false;
+    int32 TokensProcessed = bTokenizedPrefix ? ProcessPrompt(PromptTokens, Role, bGenerateReply) : -1;
+    const int32 ShiftedChars = HistoryLengthBefore - ContextHistory.size();
+    DeltaStart -= ShiftedChars;
+    NewLen -= ShiftedChars;
+
+    if (TokensProcessed < 0 && NForked > 0)
+    {
+        TruncateTokens(ContextTokens.size() - NForked);
+    }
+    else if (TokensProcessed >= 0)
+    {
+        TokensProcessed += NForked;
+    }
+
+    if (TokensProcessed < 0)
+    {
+        //Prompt was stopped or failed, undo the message so history matches the KV cache
+        if (!Prompt.empty())
+        {
+            free((void*)Messages.back().content);
+            Messages.pop_back();
+            MessagesEpoch++;
+        }
+        ContextHistory.resize(FilledContextCharLength);
+        DanglingAssistantPrefixLength = bDroppedDanglingPrefix ? 0 : PreviousDanglingLength;
+        DanglingAssistantPrefixTokens = bDroppedDanglingPrefix ? 0 : PreviousDanglingTokens;
+
+        //The reply ends empty, report why like a deadline during generation would
+        if (bPromptDeadlinePassed && OnGenerationComplete)
+        {
+            FLlamaRunTimings Timings;
+            Timings.StopReason = ELlamaStopReason::Deadline;
+            OnGenerationComplete(std::string(), 0.f, 0, 0.f, Timings);
+        }
+        return std::string();
+    }
+
+    if (!Prompt.empty())
+    {
+        FLlamaMessageSpan Span;
+        Span.TokenStart = ContextTokens.size() - TokensProcessed;
+        Span.TokenCount = TokensProcessed;
+        Span.CharStart = DeltaStart;
+        Span.AssistantPrefixTokens = PrefixTokens;
+        MessageSpans.push_back(Span);
+
+        DanglingAssistantPrefixTokens = PrefixTokens;
+
+        //Let the next conversation with the same opening fork from us
+        if (PrefixCache && bFirstInContext && NForked < TokensProcessed)
+        {
+            PrefixCache->Donate(ContextTokens, SeqId);
+        }
+    }
+
+    FilledContextCharLength = NewLen;
+
+    //Check for a reply if we want to generate one, otherwise return an empty reply
+    std::string Response;
+    if (bGenerateReply)
+    {
+        //Run generation
+        Response = Generate("", true, Options);
+
+        //Reply tokens sit after our message in KV, dropping the message drops them too
+        if (bPreempted)
+        {
+            RollbackContextHistoryByMessages(1);
+        }
+    }
+
+    return Response;
+}
+
+std::string FLlamaInternal::ResumeGeneration()
+{
+    //Todo: erase last assistant message to merge the two messages if the last message was the assistant one.
+
+    //run an empty user prompt
+    return Generate();
+}
+
+bool FLlamaInternal::TokenizePrompt(const std::string& Text, std::vector<llama_token>& OutTokens)
+{
+    if (Text.empty())
+    {
+        return true;
+    }
+
+    const llama_vocab* Vocab = llama_model_get_vocab(LlamaModel);
+
+    //Only the very first tokens in the context get BOS
+    const bool IsFirst = ContextTokens.empty() && OutTokens.empty();
+
+    const int32 Offset = OutTokens.size();
+    const int NTokens = -llama_tokenize(Vocab, Text.c_str(), Text.size(), NULL, 0, IsFirst, true);
+    OutTokens.resize(Offset + NTokens);
+
+    if (llama_tokenize(Vocab, Text.c_str(), Text.size(), OutTokens.data() + Offset, NTokens, IsFirst, true) < 0)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: failed to tokenize the prompt"), __func__);
+        OutTokens.resize(Offset);
+        return false;
+    }
+    return true;
+}
+
+int32 FLlamaInternal::ProcessPrompt(const std::string& Prompt, EChatTemplateRole Role, bool bWantLogits)
+{
+    std::vector<llama_token> PromptTokens;
+    if (!TokenizePrompt(Prompt, PromptTokens))
+    {
+        return -1;
+    }
+    return ProcessPrompt(PromptTokens, Role, bWantLogits);
+}
+
+int32 FLlamaInternal::ProcessPrompt(const std::vector<llama_token>& PromptTokens, EChatTemplateRole Role, bool bWantLogits)
+{
+    const auto StartTime = ggml_time_us();
+
+    int32 NPromptTokens = 0;
+    {
+        TGuardValue<bool> CancellableGuard(bDecodeCancellable, true);
+        NPromptTokens = DecodePromptTokens(PromptTokens, Role, true, bWantLogits);
+    }
+    if (NPromptTokens < 0)
+    {
+        return -1;
+    }
+
+    const auto StopTime = ggml_time_us();
+    const float Duration = (StopTime - StartTime) / 1000000.0f;
+
+    if (OnPromptProcessed)
+    {
+        float Speed = NPromptTokens / Duration;
+        OnPromptProcessed(NPromptTokens, Role, Speed);
+    }
+
+    return NPromptTokens;
+}
+
+int32 FLlamaInternal::DecodePromptTokens(const std::vector<llama_token>& PromptTokens, EChatTemplateRole Role, bool bEmitProgress, bool bWantLogits)
+{
+    bPromptProcessingActive = true;
+
+    const int32 NPromptTokens = PromptTokens.size();
+    const int32 NContext = MaxContext();
+    if ((int32)ContextTokens.size() + NPromptTokens > NContext)
+    {
+        ShiftContext(NPromptTokens);
+    }
+
+    const int32 NContextUsed = ContextTokens.size();
+    if (NContextUsed + NPromptTokens > NContext)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: prompt of %d tokens exceeds remaining context (%d/%d used)"), __func__, NPromptTokens, NContextUsed, NContext);
+        bPromptProcessingActive = false;
+        return -1;
+    }
+
+    //Decode in ubatch sized chunks so long prompts never exceed n_batch and can be stopped between chunks
+    const int32 ChunkSize = FMath::Max<int32>(1, llama_n_ubatch(Context));
+    int32 TokensProcessed = 0;
+
+    while (TokensProcessed < NPromptTokens)
+    {
+        //Out of time before the reply could start, same rollback as a stop
+        if (bDecodeCancellable && PromptDeadlineSeconds > 0.0 && FPlatformTime::Seconds() >= PromptDeadlineSeconds)
+        {
+            UE_LOG(LlamaLog, Log, TEXT("Prompt processing passed its deadline after %d/%d tokens"), TokensProcessed, NPromptTokens);
+            TruncateTokens(NContextUsed);
+            bPromptProcessingActive = false;
+            bPromptDeadlinePassed = true;
+            return -1;
+        }
+
+        //Stopped or cancelled, drop the partial prompt so KV matches what we had before. Cleanup decodes aren't cancellable.
+        if ((bDecodeCancellable && (bPromptStopRequested || IsTaskCancelled())) || ShouldPreempt())
+        {
+            UE_LOG(LlamaLog, Log, TEXT("Prompt processing stopped after %d/%d tokens"), TokensProcessed, NPromptTokens);
+            TruncateTokens(NContextUsed);
+            bPromptProcessingActive = false;
+            return -1;
+        }
+
+        const int32 NChunkTokens = FMath::Min(ChunkSize, NPromptTokens - TokensProcessed);
+        const bool bLastChunk = TokensProcessed + NChunkTokens == NPromptTokens;
+
+        // run the prompt chunk through the decode (input), an aborted chunk may leave earlier ubatches in KV
+        if (DecodeTokens(PromptTokens.data() + TokensProcessed, NChunkTokens, bWantLogits && bLastChunk) < 0)
+        {
+            if (bDecodeCancellable && IsTaskCancelled())
+            {
+                UE_LOG(LlamaLog, Log, TEXT("Prompt processing aborted after %d/%d tokens"), TokensProcessed, NPromptTokens);
+            }
+            else
+            {
+                UE_LOG(LlamaLog, Error, TEXT("%hs: failed to decode prompt chunk at %d/%d"), __func__, TokensProcessed, NPromptTokens);
+            }
+            TruncateTokens(NContextUsed);
+            bPromptProcessingActive = false;
+            return -1;
+        }
+
+        TokensProcessed += NChunkTokens;
+
+        if (bEmitProgress && OnPromptProgress)
+        {
+            OnPromptProgress(TokensProcessed, NPromptTokens, Role);
+        }
+    }
+
+    bPromptProcessingActive = false;
+
+    return NPromptTokens;
+}
+
+int32 FLlamaInternal::DecodeTokens(const llama_token* Tokens, int32 NTokens, bool bWantLogits)
+{
+    int32 LogitsIndex = 0;
+
+    if (BatchScheduler)
+    {
+        LogitsIndex = BatchScheduler->Decode(SeqId, Tokens, NTokens, ContextTokens.size(), bWantLogits);
+        if (LogitsIndex < 0)
+        {
+            return -1;
+        }
+
+        //Other sequences decode into the same logits buffer, they're only ours until we finish sampling
+        bSamplingPending = bWantLogits;
+        bLogitsValid = bWantLogits;
+    }
+    else
+    {
+        llama_batch Batch = llama_batch_get_one(const_cast<llama_token*>(Tokens), NTokens);
+        if (llama_decode(Context, Batch))
+        {
+            return -1;
+        }
+
+        //single sequence batches always output the last token's logits
+        LogitsIndex = NTokens - 1;
+        bLogitsValid = true;
+    }
+
+    ContextTokens.insert(ContextTokens.end(), Tokens, Tokens + NTokens);
+    LastLogitsIndex = LogitsIndex;
+
+    return LogitsIndex;
+}
+
+int32 FLlamaInternal::PrepareLogitsForSampling()
+{
+    //Once more if the shared context's scheduler expired the logits we just decoded
+    for (int32 Attempt = 0; Attempt < 2; Attempt++)
+    {
+        if (!bLogitsValid)
+        {
+            if (ContextTokens.empty())
+            {
+                return -1;
+            }
+
+            //Re-decode the last token to get its logits back, KV otherwise stays as is. It's already part of the
+            //ledger (and maybe the reply), so this decode can't be aborted.
+            TGuardValue<bool> NotCancellable(bDecodeCancellable, false);
+            const llama_token LastToken = ContextTokens.back();
+            TruncateTokens(ContextTokens.size() - 1);
+
+            if (DecodeTokens(&LastToken, 1, true) < 0)
+            {
+                return -1;
+            }
+        }
+
+        //Another sequence's decode overwrites the logits if the scheduler stopped waiting for us
+        if (!bSamplingPending || BatchScheduler->BeginSampling(SeqId))
+        {
+            return LastLogitsIndex;
+        }
+        bSamplingPending = false;
+        bLogitsValid = false;
+    }
+    return -1;
+}
+
+void FLlamaInternal::FinishSampling()
+{
+    if (!BatchScheduler)
+    {
+        return;
     }
+    if (bSamplingPending)
+    {
+        bSamplingPending = false;
+        BatchScheduler->FinishSampling(SeqId);
+    }
+    bLogitsValid = false;
+}
 
-    std::string FormattedPrompt(ContextHistory.data() + FilledContextCharLength, ContextHistory.data() + NewLen);
+bool FLlamaInternal::CanSpeculate()
+{
+    //Only allocated if there's a draft source and we own the context
+    return SpeculativeBatch.token != nullptr;
+}
 
-    int32 TokensProcessed = ProcessPrompt(FormattedPrompt, Role);
+bool FLlamaInternal::SyncDraftContext(llama_token LastToken)
+{
+    //Draft has to see what the main model sees plus the token we're about to verify
+    const int32 NTarget = ContextTokens.size() + 1;
+    auto TargetAt = [this, LastToken](int32 Index)
+    {
+        return Index < (int32)ContextTokens.size() ? ContextTokens[Index] : LastToken;
+    };
 
-    FilledContextCharLength = NewLen;
+    int32 NCommon = 0;
+    const int32 NMaxCommon = FMath::Min((int32)DraftContextTokens.size(), NTarget);
+    while (NCommon < NMaxCommon && DraftContextTokens[NCommon] == TargetAt(NCommon))
+    {
+        NCommon++;
+    }
 
-    //Check for a reply if we want to generate one, otherwise return an empty reply
-    std::string Response;
-    if (bGenerateReply)
+    //Always re-decode at least the last token so its logits are fresh
+    NCommon = FMath::Min(NCommon, NTarget - 1);
+
+    llama_kv_cache_seq_rm(DraftContext, 0, NCommon, -1);
+    DraftContextTokens.resize(NCommon);
+
+    std::vector<llama_token> Pending;
+    Pending.reserve(NTarget - NCommon);
+    for (int32 i = NCommon; i < NTarget; i++)
     {
-        //Run generation
-        Response = Generate();
+        Pending.push_back(TargetAt(i));
     }
 
-    return Response;
+    const int32 ChunkSize = FMath::Max<int32>(1, llama_n_batch(DraftContext));
+    for (int32 Offset = 0; Offset < (int32)Pending.size(); Offset += ChunkSize)
+    {
+        const int32 NChunkTokens = FMath::Min(ChunkSize, (int32)Pending.size() - Offset);
+        if (llama_decode(DraftContext, llama_batch_get_one(Pending.data() + Offset, NChunkTokens)))
+        {
+            UE_LOG(LlamaLog, Warning, TEXT("%hs: draft context decode failed, skipping speculation"), __func__);
+            llama_kv_cache_seq_rm(DraftContext, 0, -1, -1);
+            DraftContextTokens.clear();
+            return false;
+        }
+        DraftContextTokens.insert(DraftContextTokens.end(), Pending.begin() + Offset, Pending.begin() + Offset + NChunkTokens);
+    }
+    return true;
 }
 
-std::string FLlamaInternal::ResumeGeneration()
+std::vector<llama_token> FLlamaInternal::DraftContinuation(llama_token LastToken, int32 MaxTokens)
 {
-    //Todo: erase last assistant message to merge the two messages if the last message was the assistant one.
+    std::vector<llama_token> Draft;
+    if (MaxTokens <= 0)
+    {
+        return Draft;
+    }
 
-    //run an empty user prompt
-    return Generate();
+    //Copying from context is free, only ask the draft model if nothing matched
+    if (LoadedParams.Advanced.bUsePromptLookupDecoding)
+    {
+        Draft = DraftFromContext(LastToken, MaxTokens);
+    }
+    if (Draft.empty() && DraftContext)
+    {
+        Draft = DraftWithModel(LastToken, MaxTokens);
+    }
+    return Draft;
 }
 
-int32 FLlamaInternal::ProcessPrompt(const std::string& Prompt, EChatTemplateRole Role)
+std::vector<llama_token> FLlamaInternal::DraftFromContext(llama_token LastToken, int32 MaxTokens)
 {
-    const auto StartTime = ggml_time_us();
+    std::vector<llama_token> Draft;
 
-    //Grab vocab
-    const llama_vocab* Vocab = llama_model_get_vocab(LlamaModel);
-    const bool IsFirst = llama_get_kv_cache_used_cells(Context) == 0;
+    //Prefer the longest ngram, it's the most likely to continue the same way
+    const int32 MinNgram = FMath::Max(1, LoadedParams.Advanced.PromptLookupMinNgram);
+    const int32 MaxNgram = FMath::Max(MinNgram, LoadedParams.Advanced.PromptLookupMaxNgram);
 
-    // tokenize the prompt
-    const int NPromptTokens = -llama_tokenize(Vocab, Prompt.c_str(), Prompt.size(), NULL, 0, IsFirst, true);
-    std::vector<llama_token> PromptTokens(NPromptTokens);
-    if (llama_tokenize(Vocab, Prompt.c_str(), Prompt.size(), PromptTokens.data(), PromptTokens.size(), IsFirst, true) < 0)
+    //Index covers every ngram that lies fully inside ContextTokens, i.e. everything before the query ngram
+    NgramIndex.Sync(ContextTokens, ContextTokensRewrittenFrom, MinNgram, MaxNgram);
+    ContextTokensRewrittenFrom = MAX_int32;
+
+    //The ngram is the tail of ContextTokens + LastToken
+    const int32 NHistory = ContextTokens.size();
+    auto TokenAt = [this, NHistory, LastToken](int32 Index)
     {
-        bGenerationActive = false;
-        GGML_ABORT("failed to tokenize the prompt\n");
+        return Index < NHistory ? ContextTokens[Index] : LastToken;
+    };
+    const int32 NTotal = NHistory + 1;
+
+    std::vector<llama_token> Ngram;
+    for (int32 NgramSize = FMath::Min(MaxNgram, NTotal - 1); NgramSize >= MinNgram; NgramSize--)
+    {
+        Ngram.assign(ContextTokens.end() - (NgramSize - 1), ContextTokens.end());
+        Ngram.push_back(LastToken);
+
+        //Most recent earlier occurrence wins
+        const int32 MatchStart = NgramIndex.FindLast(Ngram.data(), NgramSize);
+        if (MatchStart < 0)
+        {
+            continue;
+        }
+
+        //Propose what followed it last time
+        for (int32 j = MatchStart + NgramSize; j < NTotal && (int32)Draft.size() < MaxTokens; j++)
+        {
+            Draft.push_back(TokenAt(j));
+        }
+        if (!Draft.empty())
+        {
+            return Draft;
+        }
     }
 
-    // prepare a batch for the prompt
-    llama_batch Batch = llama_batch_get_one(PromptTokens.data(), PromptTokens.size());
+    return Draft;
+}
 
-    // run it through the decode (input)
-    if (llama_decode(Context, Batch))
+std::vector<llama_token> FLlamaInternal::DraftWithModel(llama_token LastToken, int32 MaxTokens)
+{
+    std::vector<llama_token> Draft;
+    if (!SyncDraftContext(LastToken))
     {
-        GGML_ABORT("failed to decode\n");
+        return Draft;
     }
 
-    const auto StopTime = ggml_time_us();
-    const float Duration = (StopTime - StartTime) / 1000000.0f;
+    common_sampler_reset(DraftSampler);
 
-    if (OnPromptProcessed)
+    while ((int32)Draft.size() < MaxTokens)
     {
-        float Speed = NPromptTokens / Duration;
-        OnPromptProcessed(NPromptTokens, Role, Speed);
+        //Greedy over the top candidates, stop as soon as the draft gets unsure
+        common_sampler_sample(DraftSampler, DraftContext, -1, true);
+        const llama_token_data_array* Candidates = common_sampler_get_candidates(DraftSampler);
+        if (Candidates->size == 0 || Candidates->data[0].p < LoadedParams.Advanced.SpeculativeDraftMinP)
+        {
+            break;
+        }
+
+        llama_token DraftTokenId = Candidates->data[0].id;
+        common_sampler_accept(DraftSampler, DraftTokenId, true);
+        Draft.push_back(DraftTokenId);
+
+        //Last draft token doesn't need decoding, next sync picks up whatever gets accepted
+        if ((int32)Draft.size() >= MaxTokens)
+        {
+            break;
+        }
+        if (llama_decode(DraftContext, llama_batch_get_one(&DraftTokenId, 1)))
+        {
+            break;
+        }
+        DraftContextTokens.push_back(DraftTokenId);
     }
 
-    return NPromptTokens;
+    return Draft;
+}
+
+bool FLlamaInternal::DecodeForVerification(llama_token LastToken, const std::vector<llama_token>& Draft)
+{
+    //Logits for every position: position i verifies Draft[i], the last one yields the next token
+    const int32 StartPos = ContextTokens.size();
+    common_batch_clear(SpeculativeBatch);
+    common_batch_add(SpeculativeBatch, LastToken, StartPos, { SeqId }, true);
+    for (int32 i = 0; i < (int32)Draft.size(); i++)
+    {
+        common_batch_add(SpeculativeBatch, Draft[i], StartPos + 1 + i, { SeqId }, true);
+    }
+
+    if (llama_decode(Context, SpeculativeBatch))
+    {
+        return false;
+    }
+
+    ContextTokens.push_back(LastToken);
+    ContextTokens.insert(ContextTokens.end(), Draft.begin(), Draft.end());
+    bLogitsValid = false;
+
+    return true;
+}
+
+std::vector<llama_token> FLlamaInternal::SampleAndAcceptDraft(const std::vector<llama_token>& Draft)
+{
+    if (CommonSampler)
+    {
+        return common_sampler_sample_and_accept_n(CommonSampler, Context, Draft);
+    }
+
+    //Same rule for the plain sampler chain: accept while samples match the draft, the first mismatch is kept as the next token
+    std::vector<llama_token> Accepted;
+    for (int32 i = 0; i <= (int32)Draft.size(); i++)
+    {
+        const llama_token TokenId = llama_sampler_sample(Sampler, Context, i);
+        Accepted.push_back(TokenId);
+
+        if (i == (int32)Draft.size() || TokenId != Draft[i])
+        {
+            break;
+        }
+    }
+    return Accepted;
 }
 
-std::string FLlamaInternal::Generate(const std::string& Prompt, bool bAppendToMessageHistory)
+std::string FLlamaInternal::Generate(const std::string& Prompt, bool bAppendToMessageHistory, const FLlamaGenerationOptions& Options)
 {
     const auto StartTime = ggml_time_us();
  
     bGenerationActive = true;
+
+    //Per request sampling swaps in a prebuilt chain for this reply only
+    const FLlamaSamplerChain DefaultSamplers = { Sampler, CommonSampler };
+    if (Options.bOverrideSampling)
+    {
+        const FLlamaSamplerChain OverrideSamplers = AcquireOverrideSamplers(Options.Sampling);
+        Sampler = OverrideSamplers.Sampler;
+        CommonSampler = OverrideSamplers.CommonSampler;
+    }
+    ON_SCOPE_EXIT
+    {
+        Sampler = DefaultSamplers.Sampler;
+        CommonSampler = DefaultSamplers.CommonSampler;
+    };
     
     if (!Prompt.empty())
     {
-        int32 TokensProcessed = ProcessPrompt(Prompt);
+        int32 TokensProcessed = ProcessPrompt(Prompt, EChatTemplateRole::Unknown, true);
+        if (TokensProcessed < 0)
+        {
+            bGenerationActive = false;
+            return std::string();
+        }
     }
 
     std::string Response;
 
     const llama_vocab* Vocab = llama_model_get_vocab(LlamaModel);
 
-    llama_batch Batch;
-    
-    llama_token NewTokenId;
+    llama_token NewTokenId = 0;
     int32 NDecoded = 0;
 
     // check if we have enough space in the context to evaluate this batch - might need to be inside loop
-    int NContext = llama_n_ctx(Context);
-    int NContextUsed = llama_get_kv_cache_used_cells(Context);
+    int NContext = MaxContext();
     bool bEOGExit = false;
+    ELlamaStopReason StopReason = ELlamaStopReason::Stopped;
+
+    //Response tokens that made it into KV, used for the assistant message span
+    int32 NResponseTokens = 0;
+
+    //Speculative stats
+    const bool bSpeculate = CanSpeculate();
+    int32 NMainDecodes = 0;
+    int32 NDrafted = 0;
+    int32 NDraftAccepted = 0;
+    bool bHasPendingToken = false;     //sampled during draft verification, not decoded yet
+
+    //Stop sequences are matched over the byte stream, text that could still become one is held back from streaming
+    const bool bMatchStopSequences = !StopSequenceMatcher.IsEmpty();
+    int32 StopState = 0;
+    int32 NStreamedBytes = 0;
+    int32 NStreamableBytes = 0;         //clear of stop sequences, streamed once its token decoded
+    int32 StopMatchStart = -1;
+    std::vector<int32> PieceEnds;       //Response length after each emitted token
+
+    //Checked before every token is emitted
+    auto LimitReached = [&]()
+    {
+        if (Options.MaxTokens > 0 && NDecoded >= Options.MaxTokens)
+        {
+            StopReason = ELlamaStopReason::MaxTokens;
+            return true;
+        }
+        if (Options.DeadlineSeconds > 0.0 && FPlatformTime::Seconds() >= Options.DeadlineSeconds)
+        {
+            StopReason = ELlamaStopReason::Deadline;
+            return true;
+        }
+        return false;
+    };
+
+    //Returns true if a stop sequence completed in this piece, Response then ends before the match
+    auto EmitPiece = [&](llama_token TokenId)
+    {
+        // convert the token to a string, print it and add it to the response
+        std::string Piece = common_token_to_piece(Vocab, TokenId, true);
+
+        const int32 PieceStart = Response.size();
+        Response += Piece;
+        NDecoded += 1;
+        PieceEnds.push_back(Response.size());
+
+        if (!bMatchStopSequences)
+        {
+            NStreamableBytes = Response.size();
+            return false;
+        }
+
+        for (int32 i = PieceStart; i < (int32)Response.size(); i++)
+        {
+            StopState = StopSequenceMatcher.Step(StopState, (uint8)Response[i]);
+            const int32 MatchLength = StopSequenceMatcher.MatchLength(StopState);
+            if (MatchLength > 0)
+            {
+                StopMatchStart = i + 1 - MatchLength;
+                Response.resize(StopMatchStart);
+                StopReason = ELlamaStopReason::StopSequence;
+                return true;
+            }
+        }
+
+        const int32 SafeEnd = Response.size() - StopSequenceMatcher.PrefixLength(StopState);
+        NStreamableBytes = FMath::Max(NStreamableBytes, SafeEnd);
+        return false;
+    };
+
+    //Pieces are only streamed once their token is in KV, an aborted decode then never shows up in the stream
+    auto StreamDecoded = [&]()
+    {
+        if (NStreamableBytes > NStreamedBytes && OnTokenGenerated)
+        {
+            OnTokenGenerated(Response.substr(NStreamedBytes, NStreamableBytes - NStreamedBytes));
+        }
+        NStreamedBytes = FMath::Max(NStreamedBytes, NStreamableBytes);
+    };
+
+    //A cancelled decode never made it into KV, the token it carried leaves Response again
+    auto DropAbortedPiece = [&](int32 KVEnd)
+    {
+        TruncateTokens(KVEnd);
+        PieceEnds.pop_back();
+        Response.resize(PieceEnds.empty() ? 0 : PieceEnds.back());
+        NDecoded -= 1;
+        NStreamableBytes = FMath::Min<int32>(NStreamableBytes, Response.size());
+        StopReason = ELlamaStopReason::Stopped;
+    };
+
+    int32 LogitsIndex = PrepareLogitsForSampling();
+    if (LogitsIndex < 0)
+    {
+        UE_LOG(LlamaLog, Error, TEXT("%hs: no logits to sample from"), __func__);
+        bGenerationActive = false;
+        return std::string();
+    }
+
+    //Token decodes in the loop can be aborted mid graph by the task's cancel token
+    TOptional<TGuardValue<bool>> CancellableGuard;
+    CancellableGuard.Emplace(bDecodeCancellable, true);
     
     while (bGenerationActive) //processing can be aborted by flipping the boolean
     {
-        //Common sampler is a bit faster
-        if (CommonSampler)
+        if (LimitReached())
         {
-            NewTokenId = common_sampler_sample(CommonSampler, Context, -1); //sample using common sampler
-            common_sampler_accept(CommonSampler, NewTokenId, true);
+            break;
         }
-        else
+        if (IsTaskCancelled())
+        {
+            StopReason = ELlamaStopReason::Stopped;
+            break;
+        }
+        if (ShouldPreempt())
+        {
+            break;
+        }
+
+        if (!bHasPendingToken)
         {
-            NewTokenId = llama_sampler_sample(Sampler, Context, -1);
+            //Claims the logits in a shared context, decodes them again if the scheduler expired them meanwhile
+            LogitsIndex = PrepareLogitsForSampling();
+            if (LogitsIndex < 0)
+            {
+                UE_LOG(LlamaLog, Error, TEXT("%hs: no logits to sample from"), __func__);
+                StopReason = ELlamaStopReason::Error;
+                break;
+            }
+
+            //Common sampler is a bit faster
+            if (CommonSampler)
+            {
+                NewTokenId = common_sampler_sample(CommonSampler, Context, LogitsIndex); //sample using common sampler
+                common_sampler_accept(CommonSampler, NewTokenId, true);
+            }
+            else
+            {
+                NewTokenId = llama_sampler_sample(Sampler, Context, LogitsIndex);
+            }
+            FinishSampling();
         }
+        bHasPendingToken = false;
 
         // is it an end of generation?
         if (llama_vocab_is_eog(Vocab, NewTokenId))
         {
             bEOGExit = true;
+            StopReason = ELlamaStopReason::EndOfGeneration;
             break;
         }
 
-        // convert the token to a string, print it and add it to the response
-        std::string Piece = common_token_to_piece(Vocab, NewTokenId, true);
-        
-        Response += Piece;
-        NDecoded += 1;
+        //Only once the logits are consumed, a shared context's scheduler waits for every speaker to finish sampling
+        if (OnPaceToken)
+        {
+            OnPaceToken();
+        }
 
-        if (NContextUsed + NDecoded > NContext)
+        //Out of room, end the reply so far through the normal commit below, ledger and messages then still agree
+        if ((int32)ContextTokens.size() + 1 > NContext && ShiftContext(1) == 0)
         {
             UE_LOG(LlamaLog, Error, TEXT("context size %d exceeded\n"), NContext);
-            bGenerationActive = false;
-            return "";
+            StopReason = ELlamaStopReason::Error;
+            break;
+        }
+
+        if (EmitPiece(NewTokenId))
+        {
+            break;
         }
 
-        if (OnTokenGenerated)
+        //Propose a continuation to verify together with the sampled token in a single decode
+        std::vector<llama_token> Draft;
+        if (bSpeculate)
         {
-            OnTokenGenerated(Piece);
+            const int32 DraftRoom = NContext - (int32)ContextTokens.size() - 1;
+            Draft = DraftContinuation(NewTokenId, FMath::Min(SpeculativeDraftMax, DraftRoom));
         }
 
-        // prepare the next batch with the sampled token
-        Batch = llama_batch_get_one(&NewTokenId, 1);
+        if (Draft.empty())
+        {
+            // decode the sampled token, in a shared context this batches with every other generating sequence
+            const int32 KVEnd = ContextTokens.size();
+            LogitsIndex = DecodeTokens(&NewTokenId, 1, true);
+            if (LogitsIndex < 0 && IsTaskCancelled())
+            {
+                DropAbortedPiece(KVEnd);
+                break;
+            }
+            if (LogitsIndex < 0)
+            {
+                UE_LOG(LlamaLog, Error, TEXT("%hs: failed to decode generated token"), __func__);
+                StopReason = ELlamaStopReason::Error;
+                break;
+            }
+
+            NResponseTokens++;
+            NMainDecodes++;
+            StreamDecoded();
+            continue;
+        }
 
-        if (llama_decode(Context, Batch))
+        const int32 VerifyStart = ContextTokens.size();
+        if (!DecodeForVerification(NewTokenId, Draft))
+        {
+            if (IsTaskCancelled())
+            {
+                DropAbortedPiece(VerifyStart);
+                break;
+            }
+            UE_LOG(LlamaLog, Error, TEXT("%hs: failed to decode draft for verification"), __func__);
+            StopReason = ELlamaStopReason::Error;
+            break;
+        }
+        NResponseTokens++;
+        NMainDecodes++;
+        StreamDecoded();
+
+        //All but the last accepted token match the draft, the last one is the main model's own next sample
+        const std::vector<llama_token> Accepted = SampleAndAcceptDraft(Draft);
+        const int32 NAcceptedDraft = Accepted.size() - 1;
+        NDrafted += Draft.size();
+        NDraftAccepted += NAcceptedDraft;
+
+        //Rejected draft tokens leave the KV cache, accepted ones are already decoded
+        TruncateTokens(VerifyStart + 1 + NAcceptedDraft);
+
+        int32 NEmitted = 0;
+        for (; NEmitted < NAcceptedDraft && bGenerationActive; NEmitted++)
+        {
+            if (llama_vocab_is_eog(Vocab, Accepted[NEmitted]))
+            {
+                bEOGExit = true;
+                StopReason = ELlamaStopReason::EndOfGeneration;
+                break;
+            }
+            if (LimitReached() || EmitPiece(Accepted[NEmitted]))
+            {
+                break;
+            }
+            NResponseTokens++;
+            StreamDecoded();
+        }
+
+        if (NEmitted < NAcceptedDraft)
+        {
+            //Stopped, reached end of generation, a limit or a stop sequence inside the accepted run, only keep what was emitted
+            TruncateTokens(VerifyStart + 1 + NEmitted);
+            break;
+        }
+
+        NewTokenId = Accepted.back();
+        bHasPendingToken = true;
+    }
+
+    //Cleanup below has to finish even when cancelled
+    CancellableGuard.Reset();
+
+    //Stopped after a decode without sampling it, don't hold up the other sequences
+    FinishSampling();
+
+    //The caller rolls the whole request back, the partial reply is never committed or reported
+    if (bPreempted)
+    {
+        bGenerationActive = false;
+        return std::string();
+    }
+
+    if (StopMatchStart >= 0)
+    {
+        //The token completing the match was never decoded. Earlier tokens reaching into the match leave the KV cache
+        //and whatever they carried before the match is decoded again so KV still matches Response.
+        const int32 NEmittedTokens = PieceEnds.size() - 1;
+        int32 NKeep = 0;
+        while (NKeep < NEmittedTokens && PieceEnds[NKeep] <= StopMatchStart)
+        {
+            NKeep++;
+        }
+        const int32 NDrop = FMath::Min(NResponseTokens, NEmittedTokens - NKeep);
+        if (NDrop > 0)
         {
-            GGML_ABORT("failed to decode\n");
+            TruncateTokens(ContextTokens.size() - NDrop);
+            NResponseTokens -= NDrop;
         }
+
+        const int32 KeptEnd = NKeep > 0 ? PieceEnds[NKeep - 1] : 0;
+        std::vector<llama_token> LeftoverTokens;
+        if (KeptEnd < StopMatchStart && TokenizePrompt(Response.substr(KeptEnd), LeftoverTokens))
+        {
+            NResponseTokens += FMath::Max(0, DecodePromptTokens(LeftoverTokens, EChatTemplateRole::Assistant, false));
+        }
+    }
+
+    //Release text held back for a stop sequence that never completed or a token whose decode failed, the stream ends as the reply
+    if (NStreamedBytes < (int32)Response.size() && OnTokenGenerated)
+    {
+        OnTokenGenerated(Response.substr(NStreamedBytes));
     }
 
     bGenerationActive = false;
@@ -538,24 +2375,192 @@ std::string FLlamaInternal::Generate(const std::string& Prompt, bool bAppendToMe
         //Add the response to our templated messages
         Messages.push_back({ RoleForEnum(EChatTemplateRole::Assistant), _strdup(Response.c_str()) });
 
-        //Sync ContextHistory
-        FilledContextCharLength = ApplyTemplateToContextHistory(false);
+        //Sync ContextHistory, only the new assistant message gets templated
+        int32 DeltaStart = FilledContextCharLength;
+        const int32 NewLen = ApplyTemplateIncrementally(false, DeltaStart);
+
+        //The template closes the reply after the response text (end of turn etc), decode that tail so KV matches history
+        int32 NTailTokens = 0;
+        int32 ShiftedChars = 0;
+        if (NewLen >= DeltaStart)
+        {
+            const int32 ResponseEnd = FindResponseEnd(Response, std::string(ContextHistory.data() + DeltaStart, ContextHistory.data() + NewLen));
+            if (ResponseEnd < 0)
+            {
+                //Can't tell where the reply ends, re-decode the whole rendered turn instead of leaving it unclosed in KV
+                UE_LOG(LlamaLog, Warning, TEXT("%hs: reply not found in the templated history, decoding the whole assistant turn again"), __func__);
+                TruncateTokens(ContextTokens.size() - NResponseTokens);
+                NResponseTokens = 0;
+            }
+            const int32 TailStart = DeltaStart + FMath::Max(0, ResponseEnd);
+
+            std::vector<llama_token> TailTokens;
+            if (TokenizePrompt(std::string(ContextHistory.data() + TailStart, ContextHistory.data() + NewLen), TailTokens))
+            {
+                const int32 HistoryLengthBefore = ContextHistory.size();
+                NTailTokens = FMath::Max(0, DecodePromptTokens(TailTokens, EChatTemplateRole::Assistant, false));
+                ShiftedChars = HistoryLengthBefore - ContextHistory.size();
+            }
+        }
+
+        FLlamaMessageSpan Span;
+        Span.TokenCount = NResponseTokens + NTailTokens;
+        Span.TokenStart = ContextTokens.size() - Span.TokenCount;
+        Span.CharStart = DeltaStart - ShiftedChars;
+        MessageSpans.push_back(Span);
+
+        FilledContextCharLength = NewLen - ShiftedChars;
+        DanglingAssistantPrefixTokens = 0;
+    }
+
+    FLlamaRunTimings Timings;
+    Timings.EvalTime = Duration;
+    Timings.TotalTime = Duration;
+    Timings.TokensGenerated = NDecoded;
+    Timings.TokensPerSecond = NDecoded / Duration;
+    Timings.StopReason = StopReason;
+    if (NDrafted > 0)
+    {
+        Timings.DraftAcceptanceRate = (float)NDraftAccepted / NDrafted;
+        Timings.TokensPerMainDecode = (float)NResponseTokens / FMath::Max(1, NMainDecodes);
     }
 
     if (OnGenerationComplete)
     {
-        OnGenerationComplete(Response, Duration, NDecoded, NDecoded / Duration);
+        OnGenerationComplete(Response, Duration, NDecoded, NDecoded / Duration, Timings);
     }
 
     return Response;
 }
 
+int32 FLlamaInternal::FindResponseEnd(const std::string& Response, const std::string& RenderedTurn)
+{
+    if (RenderedTurn.compare(0, Response.length(), Response) == 0)
+    {
+        return Response.length();
+    }
+
+    //Templates like Llama 3's `| trim` drop the reply's surrounding whitespace
+    const char* Whitespace = " \t\r\n";
+    const size_t First = Response.find_first_not_of(Whitespace);
+    if (First == std::string::npos)
+    {
+        return 0;
+    }
+    const std::string Trimmed = Response.substr(First, Response.find_last_not_of(Whitespace) - First + 1);
+
+    const size_t Found = RenderedTurn.rfind(Trimmed);
+    return Found != std::string::npos ? (int32)(Found + Trimmed.length()) : -1;
+}
+
 //NB: this function will apply out of range errors in log, this is normal behavior due to how templates are applied
 int32 FLlamaInternal::ApplyTemplateToContextHistory(bool bAddAssistantBOS)
 {
     return ApplyTemplateFromMessagesToBuffer(Template, Messages, ContextHistory, bAddAssistantBOS);
 }
 
+int32 FLlamaInternal::ApplyTemplateIncrementally(bool bAddAssistantBoS, int32& OutDeltaStart)
+{
+    OutDeltaStart = FilledContextCharLength;
+
+    if (!bTemplateIsPrefixStable || Messages.empty())
+    {
+        //Full re-render, a previous generation prompt is overwritten unless this is the reply it prompted
+        if (DanglingAssistantPrefixLength > 0 && !Messages.empty() &&
+            FCStringAnsi::Strcmp(Messages.back().role, RoleForEnum(EChatTemplateRole::Assistant)) != 0)
+        {
+            OutDeltaStart -= DanglingAssistantPrefixLength;
+        }
+        const int32 NewLen = ApplyTemplateToContextHistory(bAddAssistantBoS);
+        DanglingAssistantPrefixLength = bAddAssistantBoS ? DanglingAssistantPrefix.length() : 0;
+        ContextHistoryRewrittenFrom = 0;
+        return NewLen;
+    }
+
+    //Render only the newest message into scratch space
+    std::vector<llama_chat_message> LastMessage = { Messages.back() };
+    const int32 DeltaLen = ApplyTemplateFromMessagesToBuffer(Template, LastMessage, TemplateScratchBuffer, bAddAssistantBoS);
+    if (DeltaLen < 0)
+    {
+        return DeltaLen;
+    }
+
+    int32 InsertAt = FilledContextCharLength;
+    int32 SkipChars = 0;
+
+    if (DanglingAssistantPrefixLength > 0)
+    {
+        const bool bContinuesPrefix = FCStringAnsi::Strcmp(Messages.back().role, RoleForEnum(EChatTemplateRole::Assistant)) == 0 &&
+            DeltaLen >= DanglingAssistantPrefixLength &&
+            FCStringAnsi::Strncmp(TemplateScratchBuffer.data(), DanglingAssistantPrefix.c_str(), DanglingAssistantPrefixLength) == 0;
+
+        if (bContinuesPrefix)
+        {
+            //assistant reply already has its prefix in history
+            SkipChars = DanglingAssistantPrefixLength;
+        }
+        else
+        {
+            //any other role replaces the unused generation prompt
+            InsertAt -= DanglingAssistantPrefixLength;
+            OutDeltaStart = InsertAt;
+        }
+    }
+
+    ContextHistoryRewrittenFrom = FMath::Min(ContextHistoryRewrittenFrom, InsertAt);
+    ContextHistory.resize(InsertAt);
+    ContextHistory.insert(ContextHistory.end(), TemplateScratchBuffer.data() + SkipChars, TemplateScratchBuffer.data() + DeltaLen);
+
+    DanglingAssistantPrefixLength = bAddAssistantBoS ? DanglingAssistantPrefix.length() : 0;
+
+    return ContextHistory.size();
+}
+
+void FLlamaInternal::ProbeTemplatePrefixStability()
+{
+    bTemplateIsPrefixStable = false;
+    DanglingAssistantPrefix.clear();
+
+    //Render a small synthetic conversation in full and per message, if the concatenation of
+    //per message renders matches the full render we can safely template only the delta each turn.
+    std::vector<char> Buffer;
+    auto Render = [this, &Buffer](std::vector<llama_chat_message> ProbeMessages, bool bAddAssistantBoS)
+    {
+        const int32 Len = ApplyTemplateFromMessagesToBuffer(Template, ProbeMessages, Buffer, bAddAssistantBoS);
+        return Len < 0 ? std::string() : std::string(Buffer.data(), Buffer.data() + Len);
+    };
+
+    const llama_chat_message ProbeSystem = { RoleForEnum(EChatTemplateRole::System), "S" };
+    const llama_chat_message ProbeUserA = { RoleForEnum(EChatTemplateRole::User), "U1" };
+    const llama_chat_message ProbeAssistant = { RoleForEnum(EChatTemplateRole::Assistant), "A1" };
+    const llama_chat_message ProbeUserB = { RoleForEnum(EChatTemplateRole::User), "U2" };
+
+    const std::string UserB = Render({ ProbeUserB }, false);
+    const std::string UserBWithPrefix = Render({ ProbeUserB }, true);
+    const std::string Assistant = Render({ ProbeAssistant }, false);
+
+    if (UserB.empty() || UserBWithPrefix.compare(0, UserB.length(), UserB) != 0)
+    {
+        return;
+    }
+
+    const std::string Prefix = UserBWithPrefix.substr(UserB.length());
+    const std::string PerMessage = Render({ ProbeUserA }, false) + Assistant + UserB;
+    const std::string PerMessageWithSystem = Render({ ProbeSystem }, false) + PerMessage;
+
+    bTemplateIsPrefixStable =
+        Render({ ProbeUserA, ProbeAssistant, ProbeUserB }, false) == PerMessage &&
+        Render({ ProbeSystem, ProbeUserA, ProbeAssistant, ProbeUserB }, false) == PerMessageWithSystem &&
+        Render({ ProbeSystem, ProbeUserA, ProbeAssistant, ProbeUserB }, true) == PerMessageWithSystem + Prefix;
+
+    DanglingAssistantPrefix = Prefix;
+
+    if (!bTemplateIsPrefixStable)
+    {
+        UE_LOG(LlamaLog, Log, TEXT("Chat template is not prefix stable, falling back to full history templating per turn."));
+    }
+}
+
 int32 FLlamaInternal::ApplyTemplateFromMessagesToBuffer(const std::string& InTemplate, std::vector<llama_chat_message>& FromMessages, std::vector<char>& ToBuffer, bool bAddAssistantBoS)
 {
     int32 NewLen = llama_chat_apply_template(InTemplate.c_str(), FromMessages.data(), FromMessages.size(),
@@ -594,6 +2599,25 @@ const char* FLlamaInternal::RoleForEnum(EChatTemplateRole Role)
     }
 }
 
+EChatTemplateRole FLlamaInternal::RoleForString(const char* Role)
+{
+    if (FCStringAnsi::Stricmp(Role, "user") == 0)
+    {
+        return EChatTemplateRole::User;
+    }
+    else if (FCStringAnsi::Stricmp(Role, "assistant") == 0)
+    {
+        return EChatTemplateRole::Assistant;
+    }
+    else if (FCStringAnsi::Stricmp(Role, "system") == 0)
+    {
+        return EChatTemplateRole::System;
+    }
+    else {
+        return EChatTemplateRole::Unknown;
+    }
+}
+
 FLlamaInternal::FLlamaInternal()
 {
 
@@ -0,0 +1,185 @@
+#include "Internal/LlamaModelRegistry.h"
+#include <algorithm>
+#include "LlamaUtility.h"
+#include "Internal/LlamaCancelToken.h"
+#include "ggml-backend.h"
+
+FLlamaModelRegistry& FLlamaModelRegistry::Get()
+{
+    static FLlamaModelRegistry Registry;
+    return Registry;
+}
+
+std::string FLlamaModelRegistry::KeyForModel(const std::string& Path, const llama_model_params& Params)
+{
+    //Only params that change the loaded weights matter for sharing
+    return Path + "|gpu:" + std::to_string(Params.n_gpu_layers) +
+        "|split:" + std::to_string((int32)Params.split_mode) + ":" + std::to_string(Params.main_gpu) +
+        "|mmap:" + std::to_string(Params.use_mmap) + "|mlock:" + std::to_string(Params.use_mlock);
+}
+
+FLlamaModelRegistry::FModelEntry::~FModelEntry()
+{
+    if (LoadedEvent)
+    {
+        FPlatformProcess::ReturnSynchEventToPool(LoadedEvent);
+    }
+}
+
+namespace
+{
+    //How often a waiter checks its cancel flag and forwards the loader's progress
+    constexpr uint32 LoadWaitPollMs = 50;
+}
+
+bool FLlamaModelRegistry::OnLoadProgress(float Progress, void* UserData)
+{
+    FModelEntry* Entry = static_cast<FModelEntry*>(UserData);
+    Entry->Progress = Progress;
+
+    const bool bContinue = Entry->LoaderCallback ? Entry->LoaderCallback(Progress, Entry->LoaderUserData) : true;
+    if (!bContinue)
+    {
+        Entry->bLoadCancelled = true;
+    }
+    return bContinue;
+}
+
+llama_model* FLlamaModelRegistry::AcquireModel(const std::string& Path, const llama_model_params& Params, const FLlamaCancelToken* CancelToken, bool* bOutShared)
+{
+    const std::string Key = KeyForModel(Path, Params);
+
+    //Loops when the user loading our model cancelled, we then load it ourselves
+    while (true)
+    {
+        if (CancelToken && CancelToken->IsCancelled())
+        {
+            return nullptr;
+        }
+
+        TSharedPtr<FModelEntry> LoadingEntry;
+        TSharedPtr<FModelEntry> Waiting;
+        {
+            FScopeLock Lock(&RegistryMutex);
+
+            auto Found = std::find_if(Entries.begin(), Entries.end(), [&Key](const TSharedPtr<FModelEntry>& Entry) { return Entry->Key == Key; });
+            if (Found != Entries.end())
+            {
+                if (!(*Found)->bLoading)
+                {
+                    (*Found)->RefCount++;
+                    UE_LOG(LlamaLog, Log, TEXT("Sharing already loaded model %hs (%d users)"), Path.c_str(), (*Found)->RefCount);
+                    if (bOutShared)
+                    {
+                        *bOutShared = true;
+                    }
+                    return (*Found)->Model;
+                }
+
+                //Someone else is loading it, we only take a reference once it's there
+                Waiting = *Found;
+            }
+            else
+            {
+                if (!bBackendsLoaded)
+                {
+                    // load dynamic backends
+                    ggml_backend_load_all();
+                    bBackendsLoaded = true;
+                }
+
+                LoadingEntry = MakeShared<FModelEntry>();
+                LoadingEntry->Key = Key;
+                LoadingEntry->RefCount = 1;
+                LoadingEntry->bLoading = true;
+                LoadingEntry->LoadedEvent = FPlatformProcess::GetSynchEventFromPool(true);
+                LoadingEntry->LoaderCallback = Params.progress_callback;
+                LoadingEntry->LoaderUserData = Params.progress_callback_user_data;
+                Entries.push_back(LoadingEntry);
+            }
+        }
+
+        if (Waiting)
+        {
+            //Wait without holding up the rest of the registry, passing their progress on as ours
+            float ForwardedProgress = 0.f;
+            while (!Waiting->LoadedEvent->Wait(LoadWaitPollMs))
+            {
+                if (CancelToken && CancelToken->IsCancelled())
+                {
+                    return nullptr;
+                }
+
+                const float Progress = Waiting->Progress;
+                if (Params.progress_callback && Progress > ForwardedProgress)
+                {
+                    ForwardedProgress = Progress;
+                    Params.progress_callback(Progress, Params.progress_callback_user_data);
+                }
+            }
+
+            //Only a genuine failure is ours too, after a cancel we retry and may end up loading it
+            if (!Waiting->Model && !Waiting->bLoadCancelled)
+            {
+                return nullptr;
+            }
+            continue;
+        }
+
+        llama_model_params LoadParams = Params;
+        LoadParams.progress_callback = &FLlamaModelRegistry::OnLoadProgress;
+        LoadParams.progress_callback_user_data = LoadingEntry.Get();
+
+        llama_model* Model = llama_model_load_from_file(Path.c_str(), LoadParams);
+
+        {
+            FScopeLock Lock(&RegistryMutex);
+            LoadingEntry->Model = Model;
+            LoadingEntry->bLoading = false;
+            LoadingEntry->LoaderCallback = nullptr;
+            LoadingEntry->LoaderUserData = nullptr;
+            if (!Model)
+            {
+                Entries.erase(std::remove(Entries.begin(), Entries.end(), LoadingEntry), Entries.end());
+            }
+        }
+        LoadingEntry->LoadedEvent->Trigger();
+
+        return Model;
+    }
+}
+
+void FLlamaModelRegistry::ReleaseModel(llama_model* Model)
+{
+    if (!Model)
+    {
+        return;
+    }
+
+    {
+        FScopeLock Lock(&RegistryMutex);
+
+        auto Found = std::find_if(Entries.begin(), Entries.end(), [Model](const TSharedPtr<FModelEntry>& Entry) { return Entry->Model == Model; });
+        if (Found == Entries.end())
+        {
+            UE_LOG(LlamaLog, Warning, TEXT("ReleaseModel called with a model not owned by the registry."));
+            return;
+        }
+
+        (*Found)->RefCount--;
+        if ((*Found)->RefCount > 0)
+        {
+            return;
+        }
+        Entries.erase(Found);
+    }
+
+    //Last user, unmapping gigabytes of weights shouldn't block other acquires
+    llama_model_free(Model);
+}
+
+int32 FLlamaModelRegistry::NumLoadedModels()
+{
+    FScopeLock Lock(&RegistryMutex);
+    return std::count_if(Entries.begin(), Entries.end(), [](const TSharedPtr<FModelEntry>& Entry) { return !Entry->bLoading; });
+}
@@ -0,0 +1,79 @@
+#include "Internal/LlamaNgramIndex.h"
+#include <algorithm>
+
+void FLlamaNgramIndex::Sync(const std::vector<llama_token>& Tokens, int32 KeepLength, int32 InMinNgram, int32 InMaxNgram)
+{
+    if (InMinNgram != MinNgram || InMaxNgram != MaxNgram)
+    {
+        MinNgram = InMinNgram;
+        MaxNgram = InMaxNgram;
+        KeepLength = 0;
+    }
+    KeepLength = FMath::Clamp(KeepLength, 0, FMath::Min((int32)IndexedTokens.size(), (int32)Tokens.size()));
+
+    if (KeepLength == 0)
+    {
+        NgramStarts.clear();
+        IndexedTokens.clear();
+    }
+
+    //Unindex ngrams ending past KeepLength, newest first
+    for (int32 End = IndexedTokens.size(); End > KeepLength; End--)
+    {
+        for (int32 NgramSize = MinNgram; NgramSize <= MaxNgram && End - NgramSize >= 0; NgramSize++)
+        {
+            const int32 Start = End - NgramSize;
+            auto Found = NgramStarts.find(HashNgram(IndexedTokens.data() + Start, NgramSize));
+            if (Found != NgramStarts.end() && !Found->second.empty() && Found->second.back() == Start)
+            {
+                Found->second.pop_back();
+                if (Found->second.empty())
+                {
+                    NgramStarts.erase(Found);
+                }
+            }
+        }
+    }
+    IndexedTokens.resize(KeepLength);
+
+    //Index ngrams ending in the new tokens
+    for (int32 End = KeepLength + 1; End <= (int32)Tokens.size(); End++)
+    {
+        IndexedTokens.push_back(Tokens[End - 1]);
+        for (int32 NgramSize = MinNgram; NgramSize <= MaxNgram && End - NgramSize >= 0; NgramSize++)
+        {
+            const int32 Start = End - NgramSize;
+            NgramStarts[HashNgram(IndexedTokens.data() + Start, NgramSize)].push_back(Start);
+        }
+    }
+}
+
+int32 FLlamaNgramIndex::FindLast(const llama_token* Ngram, int32 NgramSize) const
+{
+    auto Found = NgramStarts.find(HashNgram(Ngram, NgramSize));
+    if (Found == NgramStarts.end())
+    {
+        return -1;
+    }
+
+    //Verify against hash collisions
+    for (auto It = Found->second.rbegin(); It != Found->second.rend(); ++It)
+    {
+        if (std::equal(Ngram, Ngram + NgramSize, IndexedTokens.data() + *It))
+        {
+            return *It;
+        }
+    }
+    return -1;
+}
+
+uint64 FLlamaNgramIndex::HashNgram(const llama_token* Tokens, int32 NgramSize)
+{
+    //FNV-1a over the token ids, seeded with the size so different lengths don't share buckets
+    uint64 Hash = 14695981039346656037ull ^ (uint64)NgramSize;
+    for (int32 i = 0; i < NgramSize; i++)
+    {
+        Hash = (Hash ^ (uint32)Tokens[i]) * 1099511628211ull;
+    }
+    return Hash;
+}
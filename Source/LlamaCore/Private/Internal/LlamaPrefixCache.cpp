@@ -0,0 +1,160 @@
+#include "Internal/LlamaPrefixCache.h"
+#include <algorithm>
+#include "LlamaUtility.h"
+
+FLlamaPrefixCache::FLlamaPrefixCache(llama_context* InContext, FCriticalSection* InContextMutex, llama_seq_id InFirstDonorSeqId, int32 InNumSlots, int32 InMinPrefixTokens)
+{
+    Context = InContext;
+    ContextMutex = InContextMutex;
+    MinPrefixTokens = FMath::Max(1, InMinPrefixTokens);
+
+    for (int32 i = InNumSlots - 1; i >= 0; i--)
+    {
+        FreeDonors.push_back(InFirstDonorSeqId + i);
+    }
+}
+
+std::vector<uint32> FLlamaPrefixCache::HashBlocks(const std::vector<llama_token>& Tokens)
+{
+    std::vector<uint32> Hashes;
+    Hashes.reserve(Tokens.size() / BlockSize);
+
+    //FNV-1a over the token ids, sampled at each block boundary so it hashes the whole prefix up to there
+    uint32 Hash = 2166136261u;
+    for (int32 i = 0; i < (int32)Tokens.size(); i++)
+    {
+        Hash = (Hash ^ (uint32)Tokens[i]) * 16777619u;
+        if ((i + 1) % BlockSize == 0)
+        {
+            Hashes.push_back(Hash);
+        }
+    }
+    return Hashes;
+}
+
+int32 FLlamaPrefixCache::Fork(const std::vector<llama_token>& Tokens, llama_seq_id ToSeqId)
+{
+    if ((int32)Tokens.size() < MinPrefixTokens)
+    {
+        return 0;
+    }
+
+    const std::vector<uint32> Hashes = HashBlocks(Tokens);
+
+    FScopeLock Lock(&CacheMutex);
+
+    FPrefixEntry* BestEntry = nullptr;
+    int32 BestLength = 0;
+
+    for (FPrefixEntry& Entry : Entries)
+    {
+        //Whole matching blocks first, cheap rejection for unrelated prefixes
+        int32 NBlocks = 0;
+        const int32 MaxBlocks = FMath::Min(Hashes.size(), Entry.BlockHashes.size());
+        while (NBlocks < MaxBlocks && Hashes[NBlocks] == Entry.BlockHashes[NBlocks])
+        {
+            NBlocks++;
+        }
+
+        //Verify against collisions, then extend into the partial block
+        int32 Length = NBlocks * BlockSize;
+        if (!std::equal(Tokens.begin(), Tokens.begin() + Length, Entry.Tokens.begin()))
+        {
+            continue;
+        }
+        const int32 MaxLength = FMath::Min(Tokens.size(), Entry.Tokens.size());
+        while (Length < MaxLength && Tokens[Length] == Entry.Tokens[Length])
+        {
+            Length++;
+        }
+
+        if (Length > BestLength)
+        {
+            BestLength = Length;
+            BestEntry = &Entry;
+        }
+    }
+
+    if (!BestEntry || BestLength < MinPrefixTokens)
+    {
+        CacheStats.Misses++;
+        return 0;
+    }
+
+    {
+        FScopeLock ContextLock(ContextMutex);
+        llama_kv_cache_seq_cp(Context, BestEntry->DonorSeqId, ToSeqId, 0, BestLength);
+    }
+
+    BestEntry->LastUsed = ++UseCounter;
+    CacheStats.Hits++;
+    CacheStats.TokensReused += BestLength;
+
+    return BestLength;
+}
+
+void FLlamaPrefixCache::Donate(const std::vector<llama_token>& Tokens, llama_seq_id FromSeqId)
+{
+    if ((int32)Tokens.size() < MinPrefixTokens)
+    {
+        return;
+    }
+
+    FScopeLock Lock(&CacheMutex);
+
+    FPrefixEntry* Target = nullptr;
+    for (FPrefixEntry& Entry : Entries)
+    {
+        //Already covered by a longer (or identical) donor
+        if (Entry.Tokens.size() >= Tokens.size() && std::equal(Tokens.begin(), Tokens.end(), Entry.Tokens.begin()))
+        {
+            Entry.LastUsed = ++UseCounter;
+            return;
+        }
+        //We extend an existing donor, take its slot
+        if (Entry.Tokens.size() < Tokens.size() && std::equal(Entry.Tokens.begin(), Entry.Tokens.end(), Tokens.begin()))
+        {
+            Target = &Entry;
+        }
+    }
+
+    if (!Target)
+    {
+        if (!FreeDonors.empty())
+        {
+            Entries.emplace_back();
+            Target = &Entries.back();
+            Target->DonorSeqId = FreeDonors.back();
+            FreeDonors.pop_back();
+        }
+        else if (!Entries.empty())
+        {
+            Target = &*std::min_element(Entries.begin(), Entries.end(), [](const FPrefixEntry& A, const FPrefixEntry& B)
+            {
+                return A.LastUsed < B.LastUsed;
+            });
+        }
+        else
+        {
+            return;
+        }
+    }
+
+    {
+        FScopeLock ContextLock(ContextMutex);
+        llama_kv_cache_seq_rm(Context, Target->DonorSeqId, -1, -1);
+        llama_kv_cache_seq_cp(Context, FromSeqId, Target->DonorSeqId, 0, Tokens.size());
+    }
+
+    Target->Tokens = Tokens;
+    Target->BlockHashes = HashBlocks(Tokens);
+    Target->LastUsed = ++UseCounter;
+
+    CacheStats.Entries = Entries.size();
+}
+
+FLlamaPrefixCacheStats FLlamaPrefixCache::Stats()
+{
+    FScopeLock Lock(&CacheMutex);
+    return CacheStats;
+}
@@ -0,0 +1,35 @@
+#include "Internal/LlamaSentenceSegmenter.h"
+
+void FLlamaSentenceSegmenter::SetSeparators(const std::vector<std::string>& Separators)
+{
+    Automaton.Build(Separators);
+    Reset();
+}
+
+void FLlamaSentenceSegmenter::Feed(const char* Utf8, int32 Length, TFunctionRef<void(const char* Segment, int32 SegmentLength)> OnSegment)
+{
+    if (Automaton.IsEmpty())
+    {
+        return;
+    }
+
+    int32 SegmentStart = 0;
+    for (int32 i = 0; i < Length; i++)
+    {
+        State = Automaton.Step(State, (uint8)Utf8[i]);
+        if (Automaton.MatchLength(State) > 0)
+        {
+            Pending.append(Utf8 + SegmentStart, i + 1 - SegmentStart);
+            OnSegment(Pending.data(), Pending.size());
+            Pending.clear();
+            SegmentStart = i + 1;
+        }
+    }
+    Pending.append(Utf8 + SegmentStart, Length - SegmentStart);
+}
+
+void FLlamaSentenceSegmenter::Reset()
+{
+    State = 0;
+    Pending.clear();
+}
@@ -0,0 +1,36 @@
+#include "Internal/LlamaStateSnapshot.h"
+
+FLlamaStateSnapshot& FLlamaStateSnapshotBuffer::BeginWrite()
+{
+    return Slots[BackIndex];
+}
+
+void FLlamaStateSnapshotBuffer::Publish()
+{
+    //Hand the filled slot over and take whichever one was waiting in the middle
+    const uint8 Previous = MiddleIndex.exchange(BackIndex | FreshBit, std::memory_order_acq_rel);
+    BackIndex = Previous & IndexMask;
+}
+
+const FLlamaStateSnapshot* FLlamaStateSnapshotBuffer::AcquireLatest()
+{
+    if (!(MiddleIndex.load(std::memory_order_relaxed) & FreshBit))
+    {
+        return nullptr;
+    }
+    const uint8 Previous = MiddleIndex.exchange(FrontIndex, std::memory_order_acq_rel);
+    FrontIndex = Previous & IndexMask;
+    return &Slots[FrontIndex];
+}
+
+void FLlamaStateSnapshotBuffer::Acknowledge(uint32 MessagesEpoch, int32 NumMessages)
+{
+    Acknowledged.store(((uint64)MessagesEpoch << 32) | (uint32)NumMessages, std::memory_order_release);
+}
+
+void FLlamaStateSnapshotBuffer::GetAcknowledged(uint32& OutMessagesEpoch, int32& OutNumMessages) const
+{
+    const uint64 Packed = Acknowledged.load(std::memory_order_acquire);
+    OutMessagesEpoch = (uint32)(Packed >> 32);
+    OutNumMessages = (int32)(Packed & 0xFFFFFFFF);
+}
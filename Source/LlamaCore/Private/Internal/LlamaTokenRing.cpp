@@ -0,0 +1,104 @@
+#include "Internal/LlamaTokenRing.h"
+
+FLlamaTokenRing::FLlamaTokenRing(int32 CapacityBytes)
+{
+    const uint64 Capacity = FMath::RoundUpToPowerOfTwo(FMath::Max(CapacityBytes, 1024));
+    Buffer.resize(Capacity);
+    Mask = Capacity - 1;
+}
+
+bool FLlamaTokenRing::Push(const char* Utf8, int32 Length, float MaxWaitSeconds)
+{
+    Length = FMath::Min(Length, (int32)MAX_uint16);
+    const uint64 EventSize = HeaderSize + Length;
+    if (EventSize > Buffer.size())
+    {
+        EventsDropped++;
+        return false;
+    }
+
+    const uint64 Write = WritePosition.load(std::memory_order_relaxed);
+
+    //Full: give the game thread a moment to drain before dropping
+    double WaitDeadline = 0.0;
+    while (Write + EventSize - ReadPosition.load(std::memory_order_acquire) > Buffer.size())
+    {
+        const double Now = FPlatformTime::Seconds();
+        if (WaitDeadline == 0.0)
+        {
+            WaitDeadline = Now + MaxWaitSeconds;
+        }
+        else if (Now > WaitDeadline)
+        {
+            EventsDropped++;
+            return false;
+        }
+        FPlatformProcess::Sleep(0.001f);
+    }
+
+    const uint16 EventLength = Length;
+    CopyIn(Write, &EventLength, sizeof(uint16));
+    CopyIn(Write + HeaderSize, Utf8, Length);
+
+    //Publish bytes before the position and count
+    WritePosition.store(Write + EventSize, std::memory_order_release);
+    EventsPushed.fetch_add(1, std::memory_order_release);
+    return true;
+}
+
+int64 FLlamaTokenRing::PushedEvents() const
+{
+    return EventsPushed.load(std::memory_order_acquire);
+}
+
+int32 FLlamaTokenRing::Drain(int64 UpToEvent, std::string& OutUtf8)
+{
+    //Count first, it's published after the bytes so everything counted is readable
+    const int64 Available = FMath::Min(UpToEvent, PushedEvents()) - EventsDrained;
+    if (Available <= 0)
+    {
+        return 0;
+    }
+
+    uint64 Read = ReadPosition.load(std::memory_order_relaxed);
+    for (int64 i = 0; i < Available; i++)
+    {
+        uint16 EventLength = 0;
+        CopyOut(Read, &EventLength, sizeof(uint16));
+
+        const int32 Offset = OutUtf8.size();
+        OutUtf8.resize(Offset + EventLength);
+        CopyOut(Read + HeaderSize, OutUtf8.data() + Offset, EventLength);
+        Read += HeaderSize + EventLength;
+    }
+
+    EventsDrained += Available;
+    ReadPosition.store(Read, std::memory_order_release);
+    return Available;
+}
+
+bool FLlamaTokenRing::IsEmpty() const
+{
+    return PushedEvents() == EventsDrained;
+}
+
+int64 FLlamaTokenRing::DroppedEvents() const
+{
+    return EventsDropped.load(std::memory_order_relaxed);
+}
+
+void FLlamaTokenRing::CopyIn(uint64 Position, const void* Source, int32 Length)
+{
+    const uint64 Start = Position & Mask;
+    const int32 FirstPart = FMath::Min<uint64>(Length, Buffer.size() - Start);
+    FMemory::Memcpy(Buffer.data() + Start, Source, FirstPart);
+    FMemory::Memcpy(Buffer.data(), (const uint8*)Source + FirstPart, Length - FirstPart);
+}
+
+void FLlamaTokenRing::CopyOut(uint64 Position, void* Dest, int32 Length) const
+{
+    const uint64 Start = Position & Mask;
+    const int32 FirstPart = FMath::Min<uint64>(Length, Buffer.size() - Start);
+    FMemory::Memcpy(Dest, Buffer.data() + Start, FirstPart);
+    FMemory::Memcpy((uint8*)Dest + FirstPart, Buffer.data(), Length - FirstPart);
+}
@@ -0,0 +1,61 @@
+#include "Internal/LlamaWorkerThread.h"
+#include "HAL/RunnableThread.h"
+
+FLlamaWorkerThread::FLlamaWorkerThread(TFunction<void()> InDrainTasks, const TCHAR* ThreadName, EThreadPriority Priority)
+{
+    DrainTasks = InDrainTasks;
+    WakeEvent = FPlatformProcess::GetSynchEventFromPool(false);
+    Thread = FRunnableThread::Create(this, ThreadName, 0, Priority);
+}
+
+FLlamaWorkerThread::~FLlamaWorkerThread()
+{
+    Stop();
+
+    if (Thread)
+    {
+        Thread->WaitForCompletion();
+        delete Thread;
+        Thread = nullptr;
+    }
+
+    FPlatformProcess::ReturnSynchEventToPool(WakeEvent);
+    WakeEvent = nullptr;
+}
+
+void FLlamaWorkerThread::Wake()
+{
+    WakeEvent->Trigger();
+}
+
+void FLlamaWorkerThread::SetPriority(EThreadPriority Priority)
+{
+    if (Thread)
+    {
+        Thread->SetThreadPriority(Priority);
+    }
+}
+
+uint32 FLlamaWorkerThread::Run()
+{
+    while (bShouldRun)
+    {
+        if (DrainTasks)
+        {
+            DrainTasks();
+        }
+
+        //Blocks without polling, Wake or Stop release it
+        WakeEvent->Wait();
+    }
+    return 0;
+}
+
+void FLlamaWorkerThread::Stop()
+{
+    bShouldRun = false;
+    if (WakeEvent)
+    {
+        WakeEvent->Trigger();
+    }
+}
@@ -27,6 +27,15 @@ ULlamaComponent::ULlamaComponent(const FObjectInitializer &ObjectInitializer)
     {
         OnPromptProcessed.Broadcast(TokensProcessed, Role, Speed);
     };
+    LlamaNative->OnModelLoadProgress = [this](float Progress)
+    {
+        OnModelLoadProgress.Broadcast(Progress);
+    };
+
+    LlamaNative->OnPromptProgress = [this](int32 TokensProcessed, int32 TokensTotal, EChatTemplateRole Role)
+    {
+        OnPromptProgress.Broadcast(TokensProcessed, TokensTotal, Role);
+    };
 
     PrimaryComponentTick.bCanEverTick = true;
     PrimaryComponentTick.bStartWithTickEnabled = true;
@@ -67,36 +76,36 @@ void ULlamaComponent::TickComponent(float DeltaTime,
     LlamaNative->OnTick(DeltaTime);
 }
 
-void ULlamaComponent::InsertTemplatedPrompt(const FString& Text, EChatTemplateRole Role, bool bAddAssistantBOS, bool bGenerateReply)
+int64 ULlamaComponent::InsertTemplatedPrompt(const FString& Text, EChatTemplateRole Role, bool bAddAssistantBOS, bool bGenerateReply)
 {
     FLlamaChatPrompt ChatPrompt;
     ChatPrompt.Prompt = Text;
     ChatPrompt.Role = Role;
     ChatPrompt.bAddAssistantBOS = bAddAssistantBOS;
     ChatPrompt.bGenerateReply = bGenerateReply;
-    InsertTemplatedPromptStruct(ChatPrompt);
+    return InsertTemplatedPromptStruct(ChatPrompt);
 }
 
-void ULlamaComponent::InsertTemplatedPromptStruct(const FLlamaChatPrompt& ChatPrompt)
+int64 ULlamaComponent::InsertTemplatedPromptStruct(const FLlamaChatPrompt& ChatPrompt)
 {
-    LlamaNative->InsertTemplatedPrompt(ChatPrompt, [this, ChatPrompt](const FString& Response)
+    return LlamaNative->InsertTemplatedPrompt(ChatPrompt, [this, ChatPrompt](const FString& Response)
     {
         if (ChatPrompt.bGenerateReply)
         {
             OnResponseGenerated.Broadcast(Response);
-            OnEndOfStream.Broadcast(true, ModelState.LastTokenGenerationSpeed);
+            OnEndOfStream.Broadcast(ModelState.LastStopReason == ELlamaStopReason::StopSequence, ModelState.LastTokenGenerationSpeed, ModelState.LastStopReason);
         }
     });
 }
 
-void ULlamaComponent::InsertRawPrompt(const FString& Text, bool bGenerateReply)
+int64 ULlamaComponent::InsertRawPrompt(const FString& Text, bool bGenerateReply)
 {
-    LlamaNative->InsertRawPrompt(Text, bGenerateReply, [this, bGenerateReply](const FString& Response)
+    return LlamaNative->InsertRawPrompt(Text, bGenerateReply, [this, bGenerateReply](const FString& Response)
     {
         if (bGenerateReply)
         {
             OnResponseGenerated.Broadcast(Response);
-            OnEndOfStream.Broadcast(true, ModelState.LastTokenGenerationSpeed);
+            OnEndOfStream.Broadcast(ModelState.LastStopReason == ELlamaStopReason::StopSequence, ModelState.LastTokenGenerationSpeed, ModelState.LastStopReason);
         }
     });
 }
@@ -106,6 +115,12 @@ void ULlamaComponent::LoadModel()
     LlamaNative->SetModelParams(ModelParams);
     LlamaNative->LoadModel([this](const FString& ModelPath, int32 StatusCode)
     {
+        //failures are reported through OnError, cancels are silent
+        if (StatusCode != 0)
+        {
+            return;
+        }
+
         if (ModelParams.bAutoInsertSystemPromptOnLoad)
         {
             InsertTemplatedPrompt(ModelParams.SystemPrompt, EChatTemplateRole::System, false, false);
@@ -116,6 +131,16 @@ void ULlamaComponent::LoadModel()
     });
 }
 
+void ULlamaComponent::CancelModelLoad()
+{
+    LlamaNative->CancelModelLoad();
+}
+
+void ULlamaComponent::ReconfigureContext()
+{
+    LlamaNative->ReconfigureContext(ModelParams);
+}
+
 void ULlamaComponent::UnloadModel()
 {
     LlamaNative->UnloadModel([this](int32 StatusCode)
@@ -132,6 +157,22 @@ void ULlamaComponent::ResetContextHistory(bool bKeepSystemPrompt)
     LlamaNative->ResetContextHistory(bKeepSystemPrompt);
 }
 
+void ULlamaComponent::SaveSession(const FString& SessionPath, bool bCompress)
+{
+    LlamaNative->SaveSession(SessionPath, bCompress, [this](const FString& FullPath, int32 StatusCode)
+    {
+        OnSessionSaved.Broadcast(FullPath, StatusCode == 0);
+    });
+}
+
+void ULlamaComponent::LoadSession(const FString& SessionPath)
+{
+    LlamaNative->LoadSession(SessionPath, [this](const FString& FullPath, int32 StatusCode)
+    {
+        OnSessionLoaded.Broadcast(FullPath, StatusCode == 0);
+    });
+}
+
 void ULlamaComponent::RemoveLastAssistantReply()
 {
     LlamaNative->RemoveLastReply();
@@ -152,6 +193,11 @@ void ULlamaComponent::StopGeneration()
     LlamaNative->StopGeneration();
 }
 
+bool ULlamaComponent::CancelTask(int64 TaskId)
+{
+    return LlamaNative->CancelTask(TaskId);
+}
+
 void ULlamaComponent::ResumeGeneration()
 {
     LlamaNative->ResumeGeneration();
@@ -159,10 +205,15 @@ void ULlamaComponent::ResumeGeneration()
 
 FString ULlamaComponent::RawContextHistory()
 {
-    return ModelState.ContextHistory;
+    return LlamaNative->RawContextHistory();
 }
 
 FStructuredChatHistory ULlamaComponent::GetStructuredChatHistory()
 {
     return ModelState.ChatHistory;
 }
+
+FLlamaGovernorStats ULlamaComponent::GetGovernorStats()
+{
+    return LlamaNative->GovernorStats();
+}
@@ -3,82 +3,127 @@
 #include "LlamaNative.h"
 #include "LlamaUtility.h"
 #include "Internal/LlamaInternal.h"
+#include "Internal/LlamaWorkerThread.h"
+#include "Internal/LlamaTokenRing.h"
+#include "Internal/LlamaStateSnapshot.h"
+#include "Internal/LlamaGovernor.h"
 #include "Async/TaskGraphInterfaces.h"
 #include "Async/Async.h"
+#include "Async/MappedFileHandle.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/Compression.h"
+#include "Misc/FileHelper.h"
+
+namespace
+{
+    //Session file header, payload follows (zlib compressed if flagged)
+    struct FLlamaSessionHeader
+    {
+        uint32 Magic = 0x4E534C4C;  //'LLSN'
+        uint32 Version = 1;
+        uint32 Flags = 0;
+        uint32 Reserved = 0;
+        int64 PayloadSize = 0;      //uncompressed size
+    };
+
+    constexpr uint32 LlamaSessionFlagCompressed = 1 << 0;
+
+    //Published context history chunks before they're collapsed into one
+    constexpr int32 MaxHistoryChunks = 64;
+
+    //Deflate can't do better than ~1032:1, a header claiming more is corrupt
+    constexpr int64 LlamaSessionMaxCompressionRatio = 1032;
+
+    //After this many rollbacks a background task runs to completion, a steady trickle of interactive prompts can't starve it
+    constexpr int32 MaxBackgroundPreemptions = 3;
+
+    EThreadPriority ToThreadPriority(ELlamaThreadPriority Priority)
+    {
+        switch (Priority)
+        {
+        case ELlamaThreadPriority::Lowest:
+            return TPri_Lowest;
+        case ELlamaThreadPriority::BelowNormal:
+            return TPri_BelowNormal;
+        case ELlamaThreadPriority::AboveNormal:
+            return TPri_AboveNormal;
+        case ELlamaThreadPriority::Highest:
+            return TPri_Highest;
+        default:
+            return TPri_Normal;
+        }
+    }
+}
 
 FLlamaNative::FLlamaNative()
 {
     Internal = new FLlamaInternal();
+    TokenStream = MakeUnique<FLlamaTokenStreamState>();
+    StateSnapshots = MakeUnique<FLlamaStateSnapshotBuffer>();
+    Governor = MakeUnique<FLlamaGenerationGovernor>();
 
     //Hookup internal listeners - these get called on BG thread
     Internal->OnTokenGenerated = [this](const std::string& TokenPiece)
     {
-        const FString Token = FLlamaString::ToUE(TokenPiece);
+        if (!OnTokenGenerated && !OnPartialGenerated)
+        {
+            return;
+        }
 
-        //Accumalate
-        CombinedPieceText += Token;
+        //Background replies may still be rolled back, they're only emitted whole
+        if (RunningPriority == ELlamaTaskPriority::Background)
+        {
+            return;
+        }
 
-        FString Partial;
+        //Emit token to game thread, conversion and partials happen there
+        TokenStream->Ring.Push(TokenPiece.data(), TokenPiece.size());
+    };
 
-        //Compute Partials
-        if (ModelParams.Advanced.bEmitPartials)
+    Internal->OnGenerationComplete = [this](const std::string& Response, float Duration, int32 TokensGenerated, float SpeedTps, const FLlamaRunTimings& Timings)
+    {
+        if (ModelParams.Advanced.bLogGenerationStats)
         {
-            bool bSplitFound = false;
-            //Check new token for separators
-            for (const FString& Separator : ModelParams.Advanced.PartialsSeparators)
-            {
-                if (Token.Contains(Separator))
-                {
-                    bSplitFound = true;
-                }
-            }
-            if (bSplitFound)
+            UE_LOG(LlamaLog, Log, TEXT("Generated %d tokens in %1.2fs (%1.2ftps)"), TokensGenerated, Duration, SpeedTps);
+
+            if (Timings.TokensPerMainDecode > 0.f)
             {
-                Partial = FLlamaString::GetLastSentence(CombinedPieceText);
+                UE_LOG(LlamaLog, Log, TEXT("Speculative: %1.0f%% of drafted tokens accepted, %1.2f tokens per main model decode"), Timings.DraftAcceptanceRate * 100.f, Timings.TokensPerMainDecode);
             }
         }
 
-        //Emit token to game thread
-        if (OnTokenGenerated)
+        if (OnGenerationFinished)
         {
-            EnqueueGTTask([this, Token, Partial]()
+            EnqueueGTTask([this, Timings]
             {
-                if (OnTokenGenerated)
+                if (OnGenerationFinished)
                 {
-                    OnTokenGenerated(Token);
-                }
-                if (OnPartialGenerated && !Partial.IsEmpty())
-                {
-                    OnPartialGenerated(Partial);
+                    OnGenerationFinished(Timings);
                 }
             });
         }
-    };
-
-    Internal->OnGenerationComplete = [this](const std::string& Response, float Duration, int32 TokensGenerated, float SpeedTps)
-    {
-        if (ModelParams.Advanced.bLogGenerationStats)
-        {
-            UE_LOG(LlamaLog, Log, TEXT("Generated %d tokens in %1.2fs (%1.2ftps)"), TokensGenerated, Duration, SpeedTps);
-        }
 
         int32 UsedContext = UsedContextLength();
 
         //Sync history data on bg thread
-        SyncModelStateToInternal([this, UsedContext, SpeedTps]
+        const ELlamaStopReason StopReason = Timings.StopReason;
+        SyncModelStateToInternal([this, UsedContext, SpeedTps, StopReason]
         {
             ModelState.ContextUsed = UsedContext;
             ModelState.LastTokenGenerationSpeed = SpeedTps;
+            ModelState.LastStopReason = StopReason;
         });
 
-        //Clear our partial text parser
-        CombinedPieceText.Empty();
-
-        //Emit response generated to general listeners
+        //Emit response generated to general listeners, unless the task was cancelled by handle meanwhile
         FString ResponseString = FLlamaString::ToUE(Response);
-        EnqueueGTTask([this, ResponseString]
+        FLlamaCancelTokenPtr CancelToken = GetRunningTask();
+        EnqueueGTTask([this, ResponseString, CancelToken]
         {
-            if (OnResponseGenerated)
+            //Every token of this response has been flushed by now, clear our partial text parser
+            TokenStream->Segmenter.Reset();
+            TokenStream->Batch.clear();
+
+            if (OnResponseGenerated && !(CancelToken && CancelToken->IsDiscarded()))
             {
                 OnResponseGenerated(ResponseString);
             }
@@ -88,14 +133,25 @@ FLlamaNative::FLlamaNative()
     Internal->OnPromptProcessed = [this](int32 TokensProcessed, EChatTemplateRole RoleProcessed, float SpeedTps)
     {
         int32 UsedContext = UsedContextLength();
+        FLlamaPrefixCacheStats PrefixStats = Internal->PrefixCacheStats();
 
         //Sync history data with additional state updates
-        SyncModelStateToInternal([this, UsedContext, SpeedTps]
+        SyncModelStateToInternal([this, UsedContext, SpeedTps, PrefixStats]
         {
             ModelState.ContextUsed = UsedContext;
             ModelState.LastPromptProcessingSpeed = SpeedTps;
+            ModelState.PrefixCacheHits = PrefixStats.Hits;
+            ModelState.PrefixCacheMisses = PrefixStats.Misses;
+            ModelState.PrefixCacheTokensReused = PrefixStats.TokensReused;
         });
 
+        //A preempted task reruns its prompt, it was already reported the first time around
+        if (bRunningPromptReported)
+        {
+            return;
+        }
+        bRunningPromptReported = true;
+
         //Separate enqueue to ensure it happens after modelstate update
         EnqueueGTTask([this, TokensProcessed, RoleProcessed, SpeedTps]
         {
@@ -105,18 +161,70 @@ FLlamaNative::FLlamaNative()
             }
         });
     };
+
+    Internal->OnShouldYield = [this]()
+    {
+        if (RunningPriority != ELlamaTaskPriority::Background || RunningPreemptions >= MaxBackgroundPreemptions)
+        {
+            return false;
+        }
+
+        //Only live prompts are worth a rollback, cancelled ones and state syncs wait their turn
+        FScopeLock Lock(&TaskMutex);
+        return PendingInteractivePrompts.Num() > 0;
+    };
+
+    Internal->OnPaceToken = [this]()
+    {
+        Internal->SetDecodeThreads(Governor->PaceToken());
+    };
+
+    Internal->OnModelLoadProgress = [this](float Progress)
+    {
+        //The loader reports per tensor, only forward whole percent steps
+        if (Progress < 1.f && Progress - LastModelLoadProgress < 0.01f)
+        {
+            return;
+        }
+        LastModelLoadProgress = Progress;
+
+        if (OnModelLoadProgress)
+        {
+            EnqueueGTTask([this, Progress]
+            {
+                if (OnModelLoadProgress)
+                {
+                    OnModelLoadProgress(Progress);
+                }
+            });
+        }
+    };
+
+    Internal->OnPromptProgress = [this](int32 TokensProcessed, int32 TokensTotal, EChatTemplateRole RoleProcessed)
+    {
+        if (OnPromptProgress)
+        {
+            EnqueueGTTask([this, TokensProcessed, TokensTotal, RoleProcessed]
+            {
+                if (OnPromptProgress)
+                {
+                    OnPromptProgress(TokensProcessed, TokensTotal, RoleProcessed);
+                }
+            });
+        }
+    };
 }
 
 FLlamaNative::~FLlamaNative()
 {
+    //Skip everything still queued and abort the running task or load, the join below then only waits for
+    //the decode step in flight instead of draining the whole queue
+    ClearPendingTasks(true);
     StopGeneration();
-    bThreadShouldRun = false;
+    CancelModelLoad();
+
+    LLMThread.Reset();
 
-    //Wait for the thread to stop
-    while (bThreadIsActive) 
-    {
-        FPlatformProcess::Sleep(0.01f);
-    }
     delete Internal;
 }
 
@@ -124,23 +232,12 @@ void FLlamaNative::SyncModelStateToInternal(TFunction<void()> AdditionalGTStateU
 {
     TFunction<void(int64)> BGSyncAction = [this, AdditionalGTStateUpdates](int64 TaskId)
     {
-        //Copy states internal states, emit to 
-        FStructuredChatHistory ChatHistory;
-        FString ContextHistory;
-        GetStructuredChatHistory(ChatHistory);
-        RawContextHistory(ContextHistory);
+        PublishStateSnapshot();
 
-        EnqueueGTTask([this, ChatHistory, ContextHistory, AdditionalGTStateUpdates]
+        EnqueueGTTask([this, AdditionalGTStateUpdates]
         {
-            //Update state on gamethread
-            ModelState.ChatHistory = ChatHistory;
-            ModelState.ContextHistory = ContextHistory;
-
-            //derived state update
-            if (ModelState.ChatHistory.History.Num() > 0)
-            {
-                ModelState.LastRole = ModelState.ChatHistory.History.Last().Role;
-            }
+            //Update state on gamethread, syncs queued behind a newer snapshot find nothing new
+            ApplyStateSnapshot();
 
             //Run the updates before model state changes happen
             if (AdditionalGTStateUpdates)
@@ -170,30 +267,61 @@ void FLlamaNative::SyncModelStateToInternal(TFunction<void()> AdditionalGTStateU
 
 void FLlamaNative::StartLLMThread()
 {
-    bThreadShouldRun = true;
-    Async(EAsyncExecution::Thread, [this]
+    LLMThread = MakeUnique<FLlamaWorkerThread>([this]
     {
-        bThreadIsActive = true;
-
-        while (bThreadShouldRun)
+        //Run all queued tasks
+        FLLMThreadTask Task;
+        while (DequeueNextTask(Task))
         {
-            //Run all queued tasks
-            while (!BackgroundTasks.IsEmpty())
+            //Discarded while queued, a plain cancel still runs it so the task can report that (cancelled loads call back with -2)
+            if (!Task.TaskFunction || Task.CancelToken->IsDiscarded())
             {
-                FLLMThreadTask Task;
-                BackgroundTasks.Dequeue(Task);
-                if (Task.TaskFunction)
-                {
-                    //Run Task
-                    Task.TaskFunction(Task.TaskId);
-                }
+                ForgetTask(Task.TaskId);
+                continue;
             }
 
-            FPlatformProcess::Sleep(ThreadIdleSleepDuration);
+            RunningPriority = Task.Priority;
+            bRunningPromptReported = Task.bPromptReported;
+            RunningPreemptions = Task.Preemptions;
+            SetRunningTask(Task.CancelToken);
+
+            //Run Task
+            Task.TaskFunction(Task.TaskId);
+
+            const bool bPreempted = Internal->WasPreempted();
+            SetRunningTask(nullptr);
+
+            //Rolled back in favor of interactive work, runs again once that lane is empty
+            if (bPreempted && !Task.CancelToken->IsCancelled())
+            {
+                Task.bPromptReported = bRunningPromptReported;
+                Task.Preemptions++;
+                PreemptedTask = Task;
+            }
+            else
+            {
+                ForgetTask(Task.TaskId);
+            }
         }
+    }, TEXT("LlamaLLMThread"), ToThreadPriority(ModelParams.Advanced.LLMThreadPriority));
+}
 
-        bThreadIsActive = false;
-    });
+bool FLlamaNative::DequeueNextTask(FLLMThreadTask& OutTask)
+{
+    if (BackgroundTasks[(int32)ELlamaTaskPriority::Interactive].Dequeue(OutTask))
+    {
+        //No longer waiting, background work stops yielding to it
+        FScopeLock Lock(&TaskMutex);
+        PendingInteractivePrompts.Remove(OutTask.TaskId);
+        return true;
+    }
+    if (PreemptedTask.IsSet())
+    {
+        OutTask = PreemptedTask.GetValue();
+        PreemptedTask.Reset();
+        return true;
+    }
+    return BackgroundTasks[(int32)ELlamaTaskPriority::Background].Dequeue(OutTask);
 }
 
 int64 FLlamaNative::GetNextTaskId()
@@ -202,10 +330,10 @@ int64 FLlamaNative::GetNextTaskId()
     return TaskIdCounter.Increment();
 }
 
-void FLlamaNative::EnqueueBGTask(TFunction<void(int64)> TaskFunction)
+int64 FLlamaNative::EnqueueBGTask(TFunction<void(int64)> TaskFunction, ELlamaTaskPriority Priority, bool bIsPrompt)
 {
     //Lazy start the thread on first enqueue
-    if (!bThreadIsActive)
+    if (!LLMThread)
     {
         StartLLMThread();
     }
@@ -213,8 +341,22 @@ void FLlamaNative::EnqueueBGTask(TFunction<void(int64)> TaskFunction)
     FLLMThreadTask Task;
     Task.TaskId = GetNextTaskId();
     Task.TaskFunction = TaskFunction;
+    Task.Priority = Priority;
+    Task.CancelToken = MakeShared<FLlamaCancelToken, ESPMode::ThreadSafe>();
+
+    {
+        FScopeLock Lock(&TaskMutex);
+        CancelTokens.Add(Task.TaskId, Task.CancelToken);
+        if (bIsPrompt && Priority == ELlamaTaskPriority::Interactive)
+        {
+            PendingInteractivePrompts.Add(Task.TaskId);
+        }
+    }
 
-    BackgroundTasks.Enqueue(Task);
+    BackgroundTasks[(int32)Priority].Enqueue(Task);
+    LLMThread->Wake();
+
+    return Task.TaskId;
 }
 
 void FLlamaNative::EnqueueGTTask(TFunction<void()> TaskFunction, int64 LinkedTaskId)
@@ -234,33 +376,61 @@ void FLlamaNative::EnqueueGTTask(TFunction<void()> TaskFunction, int64 LinkedTas
     {
         TaskFunction();
     };
+    Task.TokenSequence = TokenStream->Ring.PushedEvents();
 
+    PendingGameThreadTasks.Increment();
     GameThreadTasks.Enqueue(Task);
 }
 
 void FLlamaNative::SetModelParams(const FLLMModelParams& Params)
 {
 	ModelParams = Params;
+
+    std::vector<std::string> Separators;
+    for (const FString& Separator : ModelParams.Advanced.PartialsSeparators)
+    {
+        Separators.push_back(FLlamaString::ToStd(Separator));
+    }
+    TokenStream->Segmenter.SetSeparators(Separators);
+
+    if (LLMThread)
+    {
+        LLMThread->SetPriority(ToThreadPriority(ModelParams.Advanced.LLMThreadPriority));
+    }
 }
 
 void FLlamaNative::LoadModel(TFunction<void(const FString&, int32 StatusCode)> ModelLoadedCallback)
 {
-    EnqueueBGTask([this, ModelLoadedCallback](int64 TaskId)
+    const int64 LoadTaskId = EnqueueBGTask([this, ModelLoadedCallback](int64 TaskId)
     {
         //Unload first if any is loaded
         Internal->UnloadModel();
 
         //Now load it
+        LastModelLoadProgress = 0.f;
         bool bSuccess = Internal->LoadModelFromParams(ModelParams);
 
+        //Weights already held by the registry load without any progress reports
+        if (bSuccess && LastModelLoadProgress < 1.f)
+        {
+            Internal->OnModelLoadProgress(1.f);
+        }
+
         //Sync model state
         if (bSuccess)
         {
             const FString TemplateString = FLlamaString::ToUE(Internal->Template);
             const FString TemplateSource = FLlamaString::ToUE(Internal->TemplateSource);
+            const FLLMModelParams LoadedParams = Internal->LoadedParams;
 
-            EnqueueGTTask([this, TemplateString, TemplateSource, ModelLoadedCallback]
+            EnqueueGTTask([this, TemplateString, TemplateSource, LoadedParams, ModelLoadedCallback]
             {
+                //Autotuning may have replaced these, keep ours in sync so the governor scales from the tuned threads
+                ModelParams.MaxBatchLength = LoadedParams.MaxBatchLength;
+                ModelParams.Advanced.DecodeThreads = LoadedParams.Advanced.DecodeThreads;
+                ModelParams.Advanced.PrefillThreads = LoadedParams.Advanced.PrefillThreads;
+                ModelParams.Advanced.MicroBatchLength = LoadedParams.Advanced.MicroBatchLength;
+
                 FJinjaChatTemplate ChatTemplate;
                 ChatTemplate.TemplateSource = TemplateSource;
                 ChatTemplate.Jinja = TemplateString;
@@ -278,6 +448,18 @@ void FLlamaNative::LoadModel(TFunction<void(const FString&, int32 StatusCode)> M
                 }
             }, TaskId);
         }
+        else if (Internal->WasModelLoadCancelled())
+        {
+            Internal->UnloadModel();
+
+            EnqueueGTTask([this, ModelLoadedCallback]
+            {
+                if (ModelLoadedCallback)
+                {
+                    ModelLoadedCallback(ModelParams.PathToModel, -2);
+                }
+            }, TaskId);
+        }
         else
         {
             EnqueueGTTask([this, ModelLoadedCallback]
@@ -290,6 +472,26 @@ void FLlamaNative::LoadModel(TFunction<void(const FString&, int32 StatusCode)> M
             }, TaskId);
         }
     });
+
+    //Only loads enqueued before a CancelModelLoad get cancelled by it, a finished one is already forgotten
+    FScopeLock Lock(&TaskMutex);
+    if (CancelTokens.Contains(LoadTaskId))
+    {
+        ModelLoadTasks.Add(LoadTaskId);
+    }
+}
+
+void FLlamaNative::CancelModelLoad()
+{
+    //Not discarded, queued loads still run to report the cancel through their callback
+    FScopeLock Lock(&TaskMutex);
+    for (int64 LoadTaskId : ModelLoadTasks)
+    {
+        if (FLlamaCancelTokenPtr* CancelToken = CancelTokens.Find(LoadTaskId))
+        {
+            (*CancelToken)->Cancel(false);
+        }
+    }
 }
 
 void FLlamaNative::UnloadModel(TFunction<void(int32 StatusCode)> ModelUnloadedCallback)
@@ -312,35 +514,85 @@ void FLlamaNative::UnloadModel(TFunction<void(int32 StatusCode)> ModelUnloadedCa
     });
 }
 
+void FLlamaNative::ReconfigureContext(const FLLMModelParams& Params, TFunction<void(int32 StatusCode)> OnReconfigured)
+{
+    SetModelParams(Params);
+
+    EnqueueBGTask([this, Params, OnReconfigured](int64 TaskId)
+    {
+        const bool bSuccess = Internal->ReconfigureContext(Params);
+
+        int32 UsedContext = UsedContextLength();
+        SyncModelStateToInternal([this, UsedContext]
+        {
+            ModelState.ContextUsed = UsedContext;
+        });
+
+        EnqueueGTTask([this, bSuccess, OnReconfigured]
+        {
+            if (!bSuccess && OnError)
+            {
+                OnError(TEXT("Failed to reconfigure the context, see logs."));
+            }
+            if (OnReconfigured)
+            {
+                OnReconfigured(bSuccess ? 0 : -1);
+            }
+        });
+    });
+}
+
 bool FLlamaNative::IsModelLoaded()
 {
     return Internal->IsModelLoaded();
 }
 
-void FLlamaNative::InsertTemplatedPrompt(const FLlamaChatPrompt& Prompt, TFunction<void(const FString& Response)> OnResponseFinished)
+int64 FLlamaNative::InsertTemplatedPrompt(const FLlamaChatPrompt& Prompt, TFunction<void(const FString& Response)> OnResponseFinished)
 {
     if (!IsModelLoaded())
     {
         UE_LOG(LlamaLog, Warning, TEXT("Model isn't loaded, can't run prompt."));
-        return;
+        return -1;
     }
 
     //Copy so we can deal with it on different threads
     FLlamaChatPrompt ThreadSafePrompt = Prompt;
 
     //run prompt insert on a background thread
-    EnqueueBGTask([this, ThreadSafePrompt, OnResponseFinished](int64 TaskId)
+    return EnqueueBGTask([this, ThreadSafePrompt, OnResponseFinished](int64 TaskId)
     {
         const std::string UserStdString = FLlamaString::ToStd(ThreadSafePrompt.Prompt);
         
         if (ThreadSafePrompt.bGenerateReply)
         {
-            FString Response = FLlamaString::ToUE(Internal->InsertTemplatedPrompt(UserStdString, ThreadSafePrompt.Role, ThreadSafePrompt.bAddAssistantBOS, true));
+            FLlamaGenerationOptions Options;
+            Options.MaxTokens = ThreadSafePrompt.MaxTokens;
+            if (ThreadSafePrompt.DeadlineMs > 0)
+            {
+                Options.DeadlineSeconds = FPlatformTime::Seconds() + ThreadSafePrompt.DeadlineMs / 1000.0;
+            }
+            Options.bOverrideSampling = ThreadSafePrompt.bOverrideSampling;
+            Options.Sampling = ThreadSafePrompt.Sampling;
+
+            FString Response = FLlamaString::ToUE(Internal->InsertTemplatedPrompt(UserStdString, ThreadSafePrompt.Role, ThreadSafePrompt.bAddAssistantBOS, true, Options));
+
+            //Rolled back, the rerun reports the reply
+            if (Internal->WasPreempted())
+            {
+                return;
+            }
+
+            //Cancelled by handle, the caller doesn't want this reply. Checked again on GT for cancels in between.
+            FLlamaCancelTokenPtr CancelToken = GetRunningTask();
+            if (CancelToken->IsDiscarded())
+            {
+                return;
+            }
 
             //NB: OnResponseGenerated will also be called separately from this
-            EnqueueGTTask([this, Response, OnResponseFinished]()
+            EnqueueGTTask([this, Response, OnResponseFinished, CancelToken]()
             {
-                if (OnResponseFinished)
+                if (OnResponseFinished && !CancelToken->IsDiscarded())
                 {
                     OnResponseFinished(Response);
                 }
@@ -351,30 +603,37 @@ void FLlamaNative::InsertTemplatedPrompt(const FLlamaChatPrompt& Prompt, TFuncti
             //We don't want to generate a reply, just append a prompt. (last param = false turns it off)
             Internal->InsertTemplatedPrompt(UserStdString, ThreadSafePrompt.Role, ThreadSafePrompt.bAddAssistantBOS, false);
         }
-    });
+    }, ThreadSafePrompt.Priority, true);
 }
 
-void FLlamaNative::InsertRawPrompt(const FString& Prompt, bool bGenerateReply, TFunction<void(const FString& Response)>OnResponseFinished)
+int64 FLlamaNative::InsertRawPrompt(const FString& Prompt, bool bGenerateReply, TFunction<void(const FString& Response)>OnResponseFinished)
 {
     if (!IsModelLoaded())
     {
         UE_LOG(LlamaLog, Warning, TEXT("Model isn't loaded, can't run prompt."));
-        return;
+        return -1;
     }
 
     const std::string PromptStdString = FLlamaString::ToStd(Prompt);
 
-    EnqueueBGTask([this, PromptStdString, OnResponseFinished, bGenerateReply](int64 TaskId)
+    return EnqueueBGTask([this, PromptStdString, OnResponseFinished, bGenerateReply](int64 TaskId)
     {
         FString Response = FLlamaString::ToUE(Internal->InsertRawPrompt(PromptStdString, bGenerateReply));
-        EnqueueGTTask([this, Response, OnResponseFinished]
+
+        FLlamaCancelTokenPtr CancelToken = GetRunningTask();
+        if (CancelToken->IsDiscarded())
         {
-            if (OnResponseFinished)
+            return;
+        }
+
+        EnqueueGTTask([this, Response, OnResponseFinished, CancelToken]
+        {
+            if (OnResponseFinished && !CancelToken->IsDiscarded())
             {
                 OnResponseFinished(Response);
             }
         });
-    });
+    }, ELlamaTaskPriority::Interactive, true);
 }
 
 void FLlamaNative::RemoveLastNMessages(int32 MessageCount)
@@ -388,6 +647,164 @@ void FLlamaNative::RemoveLastNMessages(int32 MessageCount)
     });
 }
 
+void FLlamaNative::SaveSession(const FString& SessionPath, bool bCompress, TFunction<void(const FString& SessionPath, int32 StatusCode)> OnSaved)
+{
+    const FString FullPath = FLlamaPaths::ParseSessionPathIntoFullPath(SessionPath);
+
+    EnqueueBGTask([this, FullPath, bCompress, OnSaved](int64 TaskId)
+    {
+        TArray<uint8> Payload;
+        bool bSuccess = Internal->SaveSessionToBuffer(Payload);
+
+        if (bSuccess)
+        {
+            FLlamaSessionHeader Header;
+            Header.PayloadSize = Payload.Num();
+
+            TArray<uint8> FileData;
+            FileData.Append((const uint8*)&Header, sizeof(Header));
+
+            bool bCompressed = false;
+            int32 CompressedSize = bCompress ? FCompression::CompressMemoryBound(NAME_Zlib, Payload.Num()) : 0;
+            if (bCompress)
+            {
+                FileData.AddUninitialized(CompressedSize);
+                bCompressed = FCompression::CompressMemory(NAME_Zlib, FileData.GetData() + sizeof(Header), CompressedSize, Payload.GetData(), Payload.Num());
+            }
+
+            if (bCompressed)
+            {
+                FileData.SetNum(sizeof(Header) + CompressedSize);
+                ((FLlamaSessionHeader*)FileData.GetData())->Flags |= LlamaSessionFlagCompressed;
+            }
+            else
+            {
+                //Uncompressed sessions can be memory mapped straight into the KV cache on load
+                FileData.SetNum(sizeof(Header));
+                FileData.Append(Payload);
+            }
+
+            bSuccess = FFileHelper::SaveArrayToFile(FileData, *FullPath);
+
+            if (ModelParams.Advanced.bLogGenerationStats)
+            {
+                UE_LOG(LlamaLog, Log, TEXT("Saved session %s (%d bytes, %d on disk)"), *FullPath, Payload.Num(), FileData.Num());
+            }
+        }
+
+        EnqueueGTTask([this, FullPath, bSuccess, OnSaved]
+        {
+            if (!bSuccess && OnError)
+            {
+                OnError(FString::Printf(TEXT("Failed saving session to %s, see logs."), *FullPath));
+            }
+            if (OnSaved)
+            {
+                OnSaved(FullPath, bSuccess ? 0 : -1);
+            }
+        }, TaskId);
+    });
+}
+
+void FLlamaNative::LoadSession(const FString& SessionPath, TFunction<void(const FString& SessionPath, int32 StatusCode)> OnLoaded)
+{
+    const FString FullPath = FLlamaPaths::ParseSessionPathIntoFullPath(SessionPath);
+
+    EnqueueBGTask([this, FullPath, OnLoaded](int64 TaskId)
+    {
+        const double StartTime = FPlatformTime::Seconds();
+        bool bSuccess = false;
+
+        //Prefer mapping the file, uncompressed payloads then never get copied before hitting the KV cache
+        TUniquePtr<IMappedFileHandle> MappedHandle(FPlatformFileManager::Get().GetPlatformFile().OpenMapped(*FullPath));
+        TUniquePtr<IMappedFileRegion> MappedRegion(MappedHandle ? MappedHandle->MapRegion() : nullptr);
+
+        TArray<uint8> FileData;
+        const uint8* Data = nullptr;
+        int64 DataSize = 0;
+
+        if (MappedRegion)
+        {
+            Data = MappedRegion->GetMappedPtr();
+            DataSize = MappedRegion->GetMappedSize();
+        }
+        else if (FFileHelper::LoadFileToArray(FileData, *FullPath))
+        {
+            Data = FileData.GetData();
+            DataSize = FileData.Num();
+        }
+
+        FLlamaSessionHeader Header;
+        if (Data && DataSize >= (int64)sizeof(Header))
+        {
+            FMemory::Memcpy(&Header, Data, sizeof(Header));
+        }
+
+        const FLlamaSessionHeader ExpectedHeader;
+        if (!Data || Header.Magic != ExpectedHeader.Magic || Header.Version != ExpectedHeader.Version)
+        {
+            UE_LOG(LlamaLog, Error, TEXT("%s is not a valid llama session file (version %d expected)."), *FullPath, ExpectedHeader.Version);
+        }
+        else if (Header.Flags & LlamaSessionFlagCompressed)
+        {
+            //Size comes from the file, check it before allocating
+            const int64 CompressedSize = DataSize - sizeof(Header);
+            if (Header.PayloadSize <= 0 || Header.PayloadSize > FLlamaInternal::MaxSessionPayloadSize || CompressedSize > MAX_int32 ||
+                Header.PayloadSize > CompressedSize * LlamaSessionMaxCompressionRatio)
+            {
+                UE_LOG(LlamaLog, Error, TEXT("%s has an invalid payload size (%lld bytes from %lld compressed)."), *FullPath, Header.PayloadSize, CompressedSize);
+            }
+            else
+            {
+                //The zlib path fails unless it inflates to exactly PayloadSize bytes
+                TArray<uint8> Payload;
+                Payload.SetNumUninitialized((int32)Header.PayloadSize);
+                if (FCompression::UncompressMemory(NAME_Zlib, Payload.GetData(), Payload.Num(), Data + sizeof(Header), (int32)CompressedSize))
+                {
+                    bSuccess = Internal->LoadSessionFromBuffer(Payload.GetData(), Payload.Num());
+                }
+                else
+                {
+                    UE_LOG(LlamaLog, Error, TEXT("%s failed to decompress to its %lld byte payload."), *FullPath, Header.PayloadSize);
+                }
+            }
+        }
+        else
+        {
+            bSuccess = Internal->LoadSessionFromBuffer(Data + sizeof(Header), DataSize - sizeof(Header));
+        }
+
+        MappedRegion.Reset();
+        MappedHandle.Reset();
+
+        if (bSuccess && ModelParams.Advanced.bLogGenerationStats)
+        {
+            UE_LOG(LlamaLog, Log, TEXT("Restored session %s (%d tokens) in %1.1fms"), *FullPath, UsedContextLength(), (FPlatformTime::Seconds() - StartTime) * 1000.0);
+        }
+
+        if (bSuccess)
+        {
+            const int32 UsedContext = UsedContextLength();
+            SyncModelStateToInternal([this, UsedContext]
+            {
+                ModelState.ContextUsed = UsedContext;
+            });
+        }
+
+        EnqueueGTTask([this, FullPath, bSuccess, OnLoaded]
+        {
+            if (!bSuccess && OnError)
+            {
+                OnError(FString::Printf(TEXT("Failed loading session from %s, see logs."), *FullPath));
+            }
+            if (OnLoaded)
+            {
+                OnLoaded(FullPath, bSuccess ? 0 : -1);
+            }
+        });
+    });
+}
+
 bool FLlamaNative::IsGenerating()
 {
     //this is threadsafe
@@ -398,6 +815,61 @@ void FLlamaNative::StopGeneration()
 {
     //this is threadsafe
     Internal->StopGeneration();
+
+    //Also aborts a prompt chunk or token decode that is already running instead of waiting for it, the partial reply is still reported.
+    //Model loads only stop through CancelModelLoad.
+    FScopeLock Lock(&TaskMutex);
+    if (RunningCancelToken && !IsModelLoadTask(RunningCancelToken))
+    {
+        RunningCancelToken->Cancel(false);
+    }
+}
+
+bool FLlamaNative::CancelTask(int64 TaskId)
+{
+    FScopeLock Lock(&TaskMutex);
+    if (FLlamaCancelTokenPtr* CancelToken = CancelTokens.Find(TaskId))
+    {
+        (*CancelToken)->Cancel();
+        PendingInteractivePrompts.Remove(TaskId);
+        return true;
+    }
+    return false;
+}
+
+void FLlamaNative::SetRunningTask(const FLlamaCancelTokenPtr& CancelToken)
+{
+    {
+        FScopeLock Lock(&TaskMutex);
+        RunningCancelToken = CancelToken;
+    }
+    Internal->SetCancelToken(CancelToken);
+}
+
+FLlamaCancelTokenPtr FLlamaNative::GetRunningTask()
+{
+    FScopeLock Lock(&TaskMutex);
+    return RunningCancelToken;
+}
+
+void FLlamaNative::ForgetTask(int64 TaskId)
+{
+    FScopeLock Lock(&TaskMutex);
+    CancelTokens.Remove(TaskId);
+    ModelLoadTasks.Remove(TaskId);
+}
+
+bool FLlamaNative::IsModelLoadTask(const FLlamaCancelTokenPtr& CancelToken)
+{
+    FScopeLock Lock(&TaskMutex);
+    for (int64 LoadTaskId : ModelLoadTasks)
+    {
+        if (CancelTokens.FindRef(LoadTaskId) == CancelToken)
+        {
+            return true;
+        }
+    }
+    return false;
 }
 
 void FLlamaNative::ResumeGeneration()
@@ -416,31 +888,126 @@ void FLlamaNative::ResumeGeneration()
 
 void FLlamaNative::ClearPendingTasks(bool bClearGameThreadCallbacks)
 {
-    BackgroundTasks.Empty();
+    //Only the LLM thread dequeues, cancelled tasks are skipped when it reaches them
+    {
+        FScopeLock Lock(&TaskMutex);
+        for (const TPair<int64, FLlamaCancelTokenPtr>& Pair : CancelTokens)
+        {
+            if (Pair.Value != RunningCancelToken)
+            {
+                Pair.Value->Cancel();
+            }
+        }
+        PendingInteractivePrompts.Empty();
+    }
 
     if (bClearGameThreadCallbacks)
     {
         GameThreadTasks.Empty();
+        PendingGameThreadTasks.Reset();
     }
 }
 
 void FLlamaNative::OnTick(float DeltaTime)
 {
-    //Handle all the game thread callbacks
-    if (!GameThreadTasks.IsEmpty())
+    const double BudgetSeconds = ModelParams.Advanced.GameThreadBudgetMs / 1000.0;
+    const int32 MaxTasks = ModelParams.Advanced.MaxGameThreadTasksPerTick;
+    const double StartTime = FPlatformTime::Seconds();
+
+    //Handle the game thread callbacks within our budget, always run at least one so we keep making progress
+    int32 TasksRun = 0;
+    bool bBudgetExceeded = false;
+    while (!GameThreadTasks.IsEmpty())
     {
-        //Run all queued tasks
-        while (!GameThreadTasks.IsEmpty())
+        if (TasksRun > 0 &&
+            ((MaxTasks > 0 && TasksRun >= MaxTasks) ||
+            (BudgetSeconds > 0.0 && FPlatformTime::Seconds() - StartTime >= BudgetSeconds)))
         {
-            FLLMThreadTask Task;
-            GameThreadTasks.Dequeue(Task);
-            if (Task.TaskFunction)
+            bBudgetExceeded = true;
+            break;
+        }
+
+        FLLMThreadTask Task;
+        GameThreadTasks.Dequeue(Task);
+        PendingGameThreadTasks.Decrement();
+
+        //Tokens streamed before this task keep their order relative to it
+        FlushTokenStream(Task.TokenSequence);
+
+        if (Task.TaskFunction)
+        {
+            //Run Task
+            Task.TaskFunction(Task.TaskId);
+        }
+        TasksRun++;
+    }
+
+    //Emit all tokens since, coalesced into one payload. With leftover tasks only up to the next one.
+    const FLLMThreadTask* NextTask = GameThreadTasks.Peek();
+    FlushTokenStream(NextTask ? NextTask->TokenSequence : MAX_int64);
+
+    //Overflow stats, only ticks cut short by the budget or task cap count as overruns
+    if (bBudgetExceeded)
+    {
+        ModelState.GameThreadBudgetOverruns++;
+    }
+    ModelState.GameThreadTasksPending = PendingGameThreadTasks.GetValue();
+
+    const int64 Dropped = TokenStream->Ring.DroppedEvents();
+    if (Dropped > ModelState.TokenEventsDropped)
+    {
+        UE_LOG(LlamaLog, Warning, TEXT("%hs: %lld tokens dropped from the token stream, game thread is not keeping up"), __func__, Dropped - ModelState.TokenEventsDropped);
+        ModelState.TokenEventsDropped = Dropped;
+    }
+
+    //DeltaTime is the game's frame time, the governor backs generation off while it runs over target
+    const int32 BaseDecodeThreads = ModelParams.Advanced.DecodeThreads > 0 ? ModelParams.Advanced.DecodeThreads : ModelParams.Threads;
+    Governor->Update(DeltaTime, ModelParams.Advanced, BaseDecodeThreads);
+}
+
+const FLlamaGovernorStats& FLlamaNative::GovernorStats()
+{
+    return Governor->Stats();
+}
+
+void FLlamaNative::FlushTokenStream(int64 UpToEvent)
+{
+    FLlamaTokenStreamState& Stream = *TokenStream;
+
+    if (Stream.Ring.Drain(UpToEvent, Stream.Batch) == 0)
+    {
+        return;
+    }
+
+    //A token may end mid character, keep those bytes for the next flush
+    const int32 NComplete = FLlamaString::CompleteUtf8Length(Stream.Batch.data(), Stream.Batch.size());
+    if (NComplete == 0)
+    {
+        return;
+    }
+
+    //One conversion and one callback for everything streamed since the last flush
+    if (OnTokenGenerated)
+    {
+        FUTF8ToTCHAR Converted(Stream.Batch.data(), NComplete);
+        OnTokenGenerated(FString(Converted.Length(), Converted.Get()));
+    }
+
+    //Partials are cut incrementally, only the new bytes get scanned
+    if (ModelParams.Advanced.bEmitPartials)
+    {
+        Stream.Segmenter.Feed(Stream.Batch.data(), NComplete, [this](const char* Segment, int32 SegmentLength)
+        {
+            FUTF8ToTCHAR Converted(Segment, SegmentLength);
+            const FString Partial = FString(Converted.Length(), Converted.Get()).TrimStartAndEnd();
+            if (OnPartialGenerated && !Partial.IsEmpty())
             {
-                //Run Task
-                Task.TaskFunction(Task.TaskId);
+                OnPartialGenerated(Partial);
             }
-        }
+        });
     }
+
+    Stream.Batch.erase(0, NComplete);
 }
 
 void FLlamaNative::ResetContextHistory(bool bKeepSystemPrompt)
@@ -477,50 +1044,34 @@ void FLlamaNative::RegenerateLastReply()
     ResumeGeneration();
 }
 
-int32 FLlamaNative::RawContextHistory(FString& OutContextString)
+void FLlamaNative::PublishStateSnapshot()
 {
     if (IsGenerating())
     {
         //Todo: handle this case gracefully
-        UE_LOG(LlamaLog, Warning, TEXT("RawContextString cannot be called yet during generation."));
-        return -1;
-    }
-
-    if (Internal->ContextHistory.size() == 0)
-    {
-        return 0;
-    }
-
-    // Find the first null terminator (0) in the buffer
-    int32 ValidLength = Internal->ContextHistory.size();
-    for (int32 i = 0; i < Internal->ContextHistory.size(); i++)
-    {
-        if (Internal->ContextHistory[i] == '\0')
-        {
-            ValidLength = i;
-            break;
-        }
+        UE_LOG(LlamaLog, Warning, TEXT("Model state cannot be published yet during generation."));
+        return;
     }
 
-    // Convert only the valid part to an FString
-    OutContextString = FString(ValidLength, ANSI_TO_TCHAR(Internal->ContextHistory.data()));
+    FLlamaStateSnapshot& Snapshot = StateSnapshots->BeginWrite();
 
-    return ValidLength;
-}
+    //Only convert messages the game thread doesn't have yet, everything if messages were removed since
+    uint32 AckedEpoch = 0;
+    int32 AckedMessages = 0;
+    StateSnapshots->GetAcknowledged(AckedEpoch, AckedMessages);
 
-void FLlamaNative::GetStructuredChatHistory(FStructuredChatHistory& OutChatHistory)
-{
-    if (IsGenerating())
-    {
-        //Todo: handle this case gracefully
-        UE_LOG(LlamaLog, Warning, TEXT("GetStructuredChatHistory cannot be called yet during generation."));
-        return;
-    }
+    const int32 NMessages = Internal->Messages.size();
+    const bool bRebuild = AckedEpoch != Internal->MessagesEpoch || AckedMessages > NMessages;
 
-    OutChatHistory.History.Empty();
+    Snapshot.Version = ++PublishedStateVersion;
+    Snapshot.MessagesEpoch = Internal->MessagesEpoch;
+    Snapshot.FirstMessageIndex = bRebuild ? 0 : AckedMessages;
+    Snapshot.TotalMessages = NMessages;
+    Snapshot.Messages.Reset();
 
-    for (const llama_chat_message& Msg : Internal->Messages)
+    for (int32 i = Snapshot.FirstMessageIndex; i < NMessages; i++)
     {
+        const llama_chat_message& Msg = Internal->Messages[i];
         FStructuredChatMessage StructuredMsg;
 
         // Convert role
@@ -544,15 +1095,102 @@ void FLlamaNative::GetStructuredChatHistory(FStructuredChatHistory& OutChatHisto
         }
 
         // Convert content
-        StructuredMsg.Content = FString(ANSI_TO_TCHAR(Msg.content));
+        StructuredMsg.Content = FLlamaString::ToUE(Msg.content);
+
+        Snapshot.Messages.Add(StructuredMsg);
+    }
+
+    //Context history is an append-only chain, chunks below anything rewritten are kept and only the rest is copied
+    const std::vector<char>& History = Internal->ContextHistory;
+    const int32 ValidLength = FMath::Min<int32>(Internal->FilledContextCharLength, History.size());
+    const int32 KeepLength = FMath::Min(Internal->ContextHistoryRewrittenFrom, ValidLength);
+    Internal->ContextHistoryRewrittenFrom = MAX_int32;
+
+    TSharedPtr<const FLlamaHistoryChunk> KeptTail = PublishedHistoryTail;
+    while (KeptTail && KeptTail->TotalLength > KeepLength)
+    {
+        KeptTail = KeptTail->Previous;
+    }
+
+    //Collapse long chains now and then, keeps reads and chunk teardown short
+    if (KeptTail && KeptTail->Depth >= MaxHistoryChunks)
+    {
+        KeptTail.Reset();
+    }
+
+    const int32 KeptLength = KeptTail ? KeptTail->TotalLength : 0;
+    if (KeptLength < ValidLength || KeptTail != PublishedHistoryTail)
+    {
+        TSharedPtr<FLlamaHistoryChunk> Chunk = MakeShared<FLlamaHistoryChunk>();
+        Chunk->Text.assign(History.data() + KeptLength, ValidLength - KeptLength);
+        Chunk->TotalLength = ValidLength;
+        Chunk->Depth = KeptTail ? KeptTail->Depth + 1 : 1;
+        Chunk->Previous = KeptTail;
+        PublishedHistoryTail = Chunk;
+    }
+    Snapshot.ContextHistoryTail = PublishedHistoryTail;
+
+    StateSnapshots->Publish();
+}
+
+void FLlamaNative::ApplyStateSnapshot()
+{
+    const FLlamaStateSnapshot* Snapshot = StateSnapshots->AcquireLatest();
+    if (!Snapshot)
+    {
+        return;
+    }
+    AppliedSnapshot = Snapshot;
+
+    //Keep what we already have, append the rest
+    TArray<FStructuredChatMessage>& History = ModelState.ChatHistory.History;
+    History.SetNum(FMath::Min(History.Num(), Snapshot->FirstMessageIndex));
+    if (History.Num() == Snapshot->FirstMessageIndex)
+    {
+        History.Append(Snapshot->Messages);
+        StateSnapshots->Acknowledge(Snapshot->MessagesEpoch, History.Num());
+    }
+    else
+    {
+        //Missing messages before this delta, make the next snapshot carry everything
+        StateSnapshots->Acknowledge(Snapshot->MessagesEpoch + 1, 0);
+    }
+
+    //derived state update
+    if (History.Num() > 0)
+    {
+        ModelState.LastRole = History.Last().Role;
+    }
+
+    bContextHistoryStale = true;
+}
+
+const FString& FLlamaNative::RawContextHistory()
+{
+    if (bContextHistoryStale && AppliedSnapshot)
+    {
+        TArray<const FLlamaHistoryChunk*, TInlineAllocator<MaxHistoryChunks>> Chunks;
+        for (const FLlamaHistoryChunk* Chunk = AppliedSnapshot->ContextHistoryTail.Get(); Chunk; Chunk = Chunk->Previous.Get())
+        {
+            Chunks.Add(Chunk);
+        }
+
+        std::string HistoryUtf8;
+        HistoryUtf8.reserve(Chunks.Num() > 0 ? Chunks[0]->TotalLength : 0);
+        for (int32 i = Chunks.Num() - 1; i >= 0; i--)
+        {
+            HistoryUtf8 += Chunks[i]->Text;
+        }
 
-        // Add to history
-        OutChatHistory.History.Add(StructuredMsg);
+        ModelState.ContextHistory = FLlamaString::ToUE(HistoryUtf8);
+        bContextHistoryStale = false;
     }
+    return ModelState.ContextHistory;
 }
 
 void FLlamaNative::SyncPassedModelStateToNative(FLLMModelState& StateToSync)
 {
+    RawContextHistory();
     StateToSync = ModelState;
 }
 
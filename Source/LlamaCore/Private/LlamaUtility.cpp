@@ -41,6 +41,41 @@ FString FLlamaPaths::ParsePathIntoFullPath(const FString& InRelativeOrAbsolutePa
     return FinalPath;
 }
 
+FString FLlamaPaths::SessionsRelativeRootPath()
+{
+    FString AbsoluteFilePath;
+
+#if PLATFORM_ANDROID
+    AbsoluteFilePath = FPaths::Combine(FString(FAndroidMisc::GamePersistentDownloadDir()), "Sessions/");
+#else
+    AbsoluteFilePath = FPaths::ConvertRelativePathToFull(FPaths::Combine(FPaths::ProjectSavedDir(), "Sessions/"));
+#endif
+
+    return AbsoluteFilePath;
+}
+
+FString FLlamaPaths::AutotuneRootPath()
+{
+    FString AbsoluteFilePath;
+
+#if PLATFORM_ANDROID
+    AbsoluteFilePath = FPaths::Combine(FString(FAndroidMisc::GamePersistentDownloadDir()), "Autotune/");
+#else
+    AbsoluteFilePath = FPaths::ConvertRelativePathToFull(FPaths::Combine(FPaths::ProjectSavedDir(), "Autotune/"));
+#endif
+
+    return AbsoluteFilePath;
+}
+
+FString FLlamaPaths::ParseSessionPathIntoFullPath(const FString& InRelativeOrAbsolutePath)
+{
+    if (InRelativeOrAbsolutePath.StartsWith(TEXT(".")))
+    {
+        return FPaths::ConvertRelativePathToFull(FLlamaPaths::SessionsRelativeRootPath() + InRelativeOrAbsolutePath);
+    }
+    return FPaths::ConvertRelativePathToFull(InRelativeOrAbsolutePath);
+}
+
 TArray<FString> FLlamaPaths::DebugListDirectoryContent(const FString& InPath)
 {
     TArray<FString> Entries;
@@ -169,6 +204,37 @@ FString FLlamaString::GetLastSentence(const FString& InputString)
     return InputString.Mid(StartIndex, LastPunctuationIndex - StartIndex + 1).TrimStartAndEnd();
 }
 
+int32 FLlamaString::CompleteUtf8Length(const char* Text, int32 Length)
+{
+    //Walk back over continuation bytes to the lead byte of the last character
+    int32 LeadIndex = Length - 1;
+    while (LeadIndex >= 0 && Length - LeadIndex < 4 && (Text[LeadIndex] & 0xC0) == 0x80)
+    {
+        LeadIndex--;
+    }
+    if (LeadIndex < 0)
+    {
+        return Length;
+    }
+
+    const uint8 Lead = Text[LeadIndex];
+    int32 Expected = 1;
+    if ((Lead & 0xE0) == 0xC0)
+    {
+        Expected = 2;
+    }
+    else if ((Lead & 0xF0) == 0xE0)
+    {
+        Expected = 3;
+    }
+    else if ((Lead & 0xF8) == 0xF0)
+    {
+        Expected = 4;
+    }
+
+    return (Length - LeadIndex) < Expected ? LeadIndex : Length;
+}
+
 void FLlamaString::AppendToCharVector(std::vector<char>& VectorHistory, const std::string& Text)
 {
     VectorHistory.insert(VectorHistory.end(), Text.begin(), Text.end());
@@ -0,0 +1,168 @@
+#include "Misc/AutomationTest.h"
+#include "Misc/FileHelper.h"
+#include "HAL/FileManager.h"
+#include "Internal/LlamaAutotuner.h"
+#include "Internal/LlamaInternal.h"
+#include "Tests/LlamaTestModel.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+    class FLlamaAutotunerTestAccess : public FLlamaAutotuner
+    {
+    public:
+        using FLlamaAutotuner::CacheFilePath;
+    };
+
+    //Generates a short reply and returns its timings, false if the model didn't load
+    bool TimeReply(const FLLMModelParams& Params, FLlamaRunTimings& OutTimings, double& OutLoadSeconds)
+    {
+        FLlamaInternal Internal;
+        const double LoadStart = FPlatformTime::Seconds();
+        if (!Internal.LoadModelFromParams(Params))
+        {
+            return false;
+        }
+        OutLoadSeconds = FPlatformTime::Seconds() - LoadStart;
+
+        Internal.OnGenerationComplete = [&OutTimings](const std::string& Response, float Time, int32 Tokens, float Speed, const FLlamaRunTimings& Timings)
+        {
+            OutTimings = Timings;
+        };
+
+        FLlamaGenerationOptions Options;
+        Options.MaxTokens = 128;
+        Internal.InsertTemplatedPrompt("Describe a busy harbor at dawn in a few paragraphs.", EChatTemplateRole::User, true, true, Options);
+        return true;
+    }
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaAutotuneCacheKeyTest, "LlamaCore.Autotune.CacheKeyTracksContextSetup",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaAutotuneCacheKeyTest::RunTest(const FString& Parameters)
+{
+    //Only the file's size and bytes are hashed, any file stands in for a gguf
+    const FString ModelPath = FPaths::Combine(FPaths::AutomationTransientDir(), TEXT("LlamaAutotuneKey.gguf"));
+    if (!FFileHelper::SaveStringToFile(TEXT("not really a model"), *ModelPath))
+    {
+        AddError(FString::Printf(TEXT("Couldn't write %s"), *ModelPath));
+        return false;
+    }
+    const std::string ModelPathStd = FLlamaString::ToStd(ModelPath);
+
+    FLLMModelParams Params;
+    Params.MaxContextLength = 2048;
+    const FString BasePath = FLlamaAutotunerTestAccess::CacheFilePath(ModelPathStd, Params);
+    TestFalse(TEXT("Cache path resolved"), BasePath.IsEmpty());
+    TestEqual(TEXT("Same setup, same cache file"), FLlamaAutotunerTestAccess::CacheFilePath(ModelPathStd, Params), BasePath);
+
+    FLLMModelParams LongerContext = Params;
+    LongerContext.MaxContextLength = 8192;
+    TestNotEqual(TEXT("Context length changes the cache file"), FLlamaAutotunerTestAccess::CacheFilePath(ModelPathStd, LongerContext), BasePath);
+
+    FLLMModelParams SharedContext = Params;
+    SharedContext.Advanced.bUseSharedBatchedContext = true;
+    TestNotEqual(TEXT("Shared batched context changes the cache file"), FLlamaAutotunerTestAccess::CacheFilePath(ModelPathStd, SharedContext), BasePath);
+
+    //Thread settings are what gets tuned, they can't be part of the key
+    FLLMModelParams OtherThreads = Params;
+    OtherThreads.Advanced.DecodeThreads = 3;
+    TestEqual(TEXT("Thread settings don't change the cache file"), FLlamaAutotunerTestAccess::CacheFilePath(ModelPathStd, OtherThreads), BasePath);
+
+    IFileManager::Get().Delete(*ModelPath);
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaAutotuneSharedModelTest, "LlamaCore.Autotune.SharedModelIsNotProbed",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaAutotuneSharedModelTest::RunTest(const FString& Parameters)
+{
+    const FString ModelPath = LlamaTestModelPath();
+    if (ModelPath.IsEmpty())
+    {
+        AddInfo(TEXT("LLAMA_TEST_MODEL not set, skipping the shared model autotune test."));
+        return true;
+    }
+
+    FLLMModelParams Params;
+    Params.PathToModel = ModelPath;
+    Params.MaxContextLength = 1536;
+    Params.Advanced.DecodeThreads = 3;
+    Params.Advanced.bAutotuneOnLoad = true;
+
+    //Nothing cached for this setup, so only probes could change the thread settings
+    const FString CachePath = FLlamaAutotunerTestAccess::CacheFilePath(FLlamaString::ToStd(ModelPath), Params);
+    IFileManager::Get().Delete(*CachePath);
+
+    FLLMModelParams OwnerParams = Params;
+    OwnerParams.Advanced.bAutotuneOnLoad = false;
+    FLlamaInternal Owner;
+    if (!Owner.LoadModelFromParams(OwnerParams))
+    {
+        AddError(FString::Printf(TEXT("Failed to load %s"), *ModelPath));
+        return false;
+    }
+
+    FLlamaInternal Sharer;
+    if (!Sharer.LoadModelFromParams(Params))
+    {
+        AddError(TEXT("Failed to share the loaded model"));
+        return false;
+    }
+
+    TestEqual(TEXT("Shared model keeps the configured decode threads"), Sharer.LoadedParams.Advanced.DecodeThreads, Params.Advanced.DecodeThreads);
+    TestFalse(TEXT("Shared model wrote no autotune results"), FPaths::FileExists(CachePath));
+
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaAutotuneSpeedTest, "LlamaCore.Autotune.SpeedOverConfigured",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaAutotuneSpeedTest::RunTest(const FString& Parameters)
+{
+    const FString ModelPath = LlamaTestModelPath();
+    if (ModelPath.IsEmpty())
+    {
+        AddInfo(TEXT("LLAMA_TEST_MODEL not set, skipping the autotune speed comparison."));
+        return true;
+    }
+
+    FLLMModelParams Params;
+    Params.PathToModel = ModelPath;
+    Params.MaxContextLength = 2048;
+    Params.Advanced.bLogGenerationStats = false;
+
+    //Probe from scratch so the first tuned load shows what probing costs
+    FLLMModelParams TunedParams = Params;
+    TunedParams.Advanced.bAutotuneOnLoad = true;
+    IFileManager::Get().Delete(*FLlamaAutotunerTestAccess::CacheFilePath(FLlamaString::ToStd(ModelPath), TunedParams));
+
+    FLlamaRunTimings Configured;
+    FLlamaRunTimings Probed;
+    FLlamaRunTimings Cached;
+    double ConfiguredLoadSeconds = 0.0;
+    double ProbedLoadSeconds = 0.0;
+    double CachedLoadSeconds = 0.0;
+    if (!TimeReply(Params, Configured, ConfiguredLoadSeconds) ||
+        !TimeReply(TunedParams, Probed, ProbedLoadSeconds) ||
+        !TimeReply(TunedParams, Cached, CachedLoadSeconds))
+    {
+        AddError(FString::Printf(TEXT("Failed to load %s"), *ModelPath));
+        return false;
+    }
+
+    AddInfo(FString::Printf(TEXT("Configured %.1f tok/s, autotuned %.1f tok/s (%.1f tok/s on the cached load)"),
+        Configured.TokensPerSecond, Probed.TokensPerSecond, Cached.TokensPerSecond));
+    AddInfo(FString::Printf(TEXT("Load took %.2fs configured, %.2fs probing and %.2fs from the cache"),
+        ConfiguredLoadSeconds, ProbedLoadSeconds, CachedLoadSeconds));
+
+    TestTrue(TEXT("All runs generated"), Configured.TokensGenerated > 0 && Probed.TokensGenerated > 0 && Cached.TokensGenerated > 0);
+
+    return true;
+}
+
+#endif //WITH_DEV_AUTOMATION_TESTS
@@ -0,0 +1,179 @@
+#include "Misc/AutomationTest.h"
+#include "Internal/LlamaCancelToken.h"
+#include "LlamaNative.h"
+#include "Tests/LlamaTestModel.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+    //Ticks the native like a game frame would until Done holds, false on timeout
+    bool TickUntil(FLlamaNative& Native, TFunctionRef<bool()> Done, double TimeoutSeconds = 120.0)
+    {
+        const double StartTime = FPlatformTime::Seconds();
+        while (!Done())
+        {
+            if (FPlatformTime::Seconds() - StartTime > TimeoutSeconds)
+            {
+                return false;
+            }
+            Native.OnTick(1.f / 60.f);
+            FPlatformProcess::Sleep(0.005f);
+        }
+        return true;
+    }
+
+    //Long enough that the reply is still running when the test cancels it
+    FLlamaChatPrompt LongPrompt(const FString& Marker)
+    {
+        FLlamaChatPrompt Prompt(FString::Printf(TEXT("%s Tell me a very long story about a lighthouse keeper."), *Marker), EChatTemplateRole::User, true);
+        Prompt.MaxTokens = 512;
+        return Prompt;
+    }
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaCancelTokenTest, "LlamaCore.Cancel.TokenDiscardsOnlyWhenAsked",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaCancelTokenTest::RunTest(const FString& Parameters)
+{
+    //CancelTask and ClearPendingTasks discard
+    FLlamaCancelToken Discarded;
+    Discarded.Cancel();
+    TestTrue(TEXT("Cancel stops the task"), Discarded.IsCancelled());
+    TestTrue(TEXT("Cancel discards the reply"), Discarded.IsDiscarded());
+
+    //StopGeneration keeps the partial reply
+    FLlamaCancelToken Stopped;
+    Stopped.Cancel(false);
+    TestTrue(TEXT("Stop stops the task"), Stopped.IsCancelled());
+    TestFalse(TEXT("Stop keeps the reply"), Stopped.IsDiscarded());
+
+    //A cancel by handle after a stop still drops the reply, a stop after a cancel doesn't bring it back
+    Stopped.Cancel();
+    TestTrue(TEXT("Cancel after stop discards"), Stopped.IsDiscarded());
+    Discarded.Cancel(false);
+    TestTrue(TEXT("Stop after cancel stays discarded"), Discarded.IsDiscarded());
+
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaCancelTaskTest, "LlamaCore.Cancel.QueuedSkipsRunningAborts",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaCancelTaskTest::RunTest(const FString& Parameters)
+{
+    const FString ModelPath = LlamaTestModelPath();
+    if (ModelPath.IsEmpty())
+    {
+        AddInfo(TEXT("LLAMA_TEST_MODEL not set, skipping the task cancel test."));
+        return true;
+    }
+
+    FLLMModelParams Params;
+    Params.PathToModel = ModelPath;
+    Params.MaxContextLength = 2048;
+    Params.Advanced.bLogGenerationStats = false;
+
+    FLlamaNative Native;
+    Native.SetModelParams(Params);
+
+    int32 LoadStatus = 1;
+    Native.LoadModel([&LoadStatus](const FString& Path, int32 StatusCode)
+    {
+        LoadStatus = StatusCode;
+    });
+    if (!TickUntil(Native, [&] { return LoadStatus != 1; }) || LoadStatus != 0)
+    {
+        AddError(FString::Printf(TEXT("Failed to load %s"), *ModelPath));
+        return false;
+    }
+
+    int32 ResponsesGenerated = 0;
+    Native.OnResponseGenerated = [&ResponsesGenerated](const FString& Response)
+    {
+        ResponsesGenerated++;
+    };
+
+    bool bRunningFinished = false;
+    bool bQueuedFinished = false;
+    bool bLastFinished = false;
+    const int64 RunningTask = Native.InsertTemplatedPrompt(LongPrompt(TEXT("[running]")), [&bRunningFinished](const FString& Response)
+    {
+        bRunningFinished = true;
+    });
+    const int64 QueuedTask = Native.InsertTemplatedPrompt(LongPrompt(TEXT("[queued]")), [&bQueuedFinished](const FString& Response)
+    {
+        bQueuedFinished = true;
+    });
+    FLlamaChatPrompt LastPrompt(TEXT("[last] Say hi."), EChatTemplateRole::User, true);
+    LastPrompt.MaxTokens = 8;
+    const int64 LastTask = Native.InsertTemplatedPrompt(LastPrompt, [&bLastFinished](const FString& Response)
+    {
+        bLastFinished = true;
+    });
+
+    if (!TickUntil(Native, [&] { return Native.IsGenerating(); }))
+    {
+        AddError(TEXT("First prompt never started generating"));
+        return false;
+    }
+
+    //Skip the queued one first so the running one can't hand over to it
+    TestTrue(TEXT("Queued task cancelled"), Native.CancelTask(QueuedTask));
+
+    const double CancelTime = FPlatformTime::Seconds();
+    TestTrue(TEXT("Running task cancelled"), Native.CancelTask(RunningTask));
+    while (Native.IsGenerating() && FPlatformTime::Seconds() - CancelTime < 10.0)
+    {
+        FPlatformProcess::Sleep(0.f);
+    }
+    const double CancelLatency = FPlatformTime::Seconds() - CancelTime;
+
+    if (!TickUntil(Native, [&] { return bLastFinished; }))
+    {
+        AddError(TEXT("Task queued after the cancelled ones never finished"));
+        return false;
+    }
+    TickUntil(Native, [&] { return ResponsesGenerated > 0; }, 1.0);
+
+    TestFalse(TEXT("Aborted task's OnResponseFinished didn't fire"), bRunningFinished);
+    TestFalse(TEXT("Skipped task's OnResponseFinished didn't fire"), bQueuedFinished);
+    TestEqual(TEXT("Only the last reply reached OnResponseGenerated"), ResponsesGenerated, 1);
+    TestFalse(TEXT("Finished task can't be cancelled"), Native.CancelTask(LastTask));
+
+    //Aborted mid reply means its prompt was decoded, skipped means it never touched the context
+    const FString History = Native.RawContextHistory();
+    TestTrue(TEXT("Aborted prompt is in the history"), History.Contains(TEXT("[running]")));
+    TestFalse(TEXT("Skipped prompt is not in the history"), History.Contains(TEXT("[queued]")));
+
+    //A plain stop ends the reply just as fast but still reports it
+    bool bStoppedFinished = false;
+    Native.InsertTemplatedPrompt(LongPrompt(TEXT("[stopped]")), [&bStoppedFinished](const FString& Response)
+    {
+        bStoppedFinished = true;
+    });
+    if (!TickUntil(Native, [&] { return Native.IsGenerating(); }))
+    {
+        AddError(TEXT("Stop prompt never started generating"));
+        return false;
+    }
+
+    const double StopTime = FPlatformTime::Seconds();
+    Native.StopGeneration();
+    while (Native.IsGenerating() && FPlatformTime::Seconds() - StopTime < 10.0)
+    {
+        FPlatformProcess::Sleep(0.f);
+    }
+    const double StopLatency = FPlatformTime::Seconds() - StopTime;
+
+    TickUntil(Native, [&] { return bStoppedFinished; }, 10.0);
+    TestTrue(TEXT("Stopped task still reports its reply"), bStoppedFinished);
+    TestEqual(TEXT("Stopped reply reached OnResponseGenerated"), ResponsesGenerated, 2);
+
+    AddInfo(FString::Printf(TEXT("Generation ended %.2fms after CancelTask and %.2fms after StopGeneration"), CancelLatency * 1000.0, StopLatency * 1000.0));
+
+    return true;
+}
+
+#endif //WITH_DEV_AUTOMATION_TESTS
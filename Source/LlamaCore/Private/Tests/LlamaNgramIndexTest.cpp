@@ -0,0 +1,229 @@
+#include "Misc/AutomationTest.h"
+#include "Internal/LlamaNgramIndex.h"
+#include "Internal/LlamaInternal.h"
+#include "Tests/LlamaTestModel.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+    constexpr int32 TestMinNgram = 2;
+    constexpr int32 TestMaxNgram = 4;
+
+    //Lets a test plant a start under an ngram's hash, as if another ngram hashed the same
+    class FCollidingNgramIndex : public FLlamaNgramIndex
+    {
+    public:
+        void AddCollision(const llama_token* Ngram, int32 NgramSize, int32 Start)
+        {
+            NgramStarts[HashNgram(Ngram, NgramSize)].push_back(Start);
+        }
+    };
+
+    int32 BruteForceFindLast(const std::vector<llama_token>& Tokens, const llama_token* Ngram, int32 NgramSize)
+    {
+        for (int32 Start = (int32)Tokens.size() - NgramSize; Start >= 0; Start--)
+        {
+            if (std::equal(Ngram, Ngram + NgramSize, Tokens.data() + Start))
+            {
+                return Start;
+            }
+        }
+        return -1;
+    }
+
+    //Every ngram of the ledger plus a few that were rolled back or never existed has to resolve like a full scan
+    bool MatchesBruteForce(FAutomationTestBase& Test, const TCHAR* Step, const FLlamaNgramIndex& Index, const std::vector<llama_token>& Tokens)
+    {
+        std::vector<std::vector<llama_token>> Queries = { { 900, 901 }, { 1, 2, 3, 900 } };
+        for (int32 NgramSize = TestMinNgram; NgramSize <= TestMaxNgram; NgramSize++)
+        {
+            for (int32 Start = 0; Start + NgramSize <= (int32)Tokens.size(); Start++)
+            {
+                Queries.emplace_back(Tokens.begin() + Start, Tokens.begin() + Start + NgramSize);
+            }
+        }
+        for (int32 Removed = 500; Removed < 504; Removed++)
+        {
+            Queries.push_back({ Removed, Removed + 1 });
+        }
+
+        for (const std::vector<llama_token>& Query : Queries)
+        {
+            const int32 Expected = BruteForceFindLast(Tokens, Query.data(), Query.size());
+            const int32 Found = Index.FindLast(Query.data(), Query.size());
+            if (Found != Expected)
+            {
+                Test.AddError(FString::Printf(TEXT("%s: %d token ngram starting with %d found at %d, last occurrence is %d"), Step, (int32)Query.size(), Query[0], Found, Expected));
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //Short repeating phrases so every ngram size has several occurrences
+    void AppendPhrases(std::vector<llama_token>& Tokens, int32 NPhrases, llama_token FirstToken)
+    {
+        for (int32 i = 0; i < NPhrases; i++)
+        {
+            const int32 Phrase = i % 5;
+            for (int32 j = 0; j < 3 + Phrase; j++)
+            {
+                Tokens.push_back(FirstToken + (Phrase * 7 + j) % 11);
+            }
+        }
+    }
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaNgramIndexRewriteTest, "LlamaCore.PromptLookup.IndexSurvivesRewrites",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaNgramIndexRewriteTest::RunTest(const FString& Parameters)
+{
+    FLlamaNgramIndex Index;
+    std::vector<llama_token> Tokens;
+
+    //Fresh ledger
+    AppendPhrases(Tokens, 40, 1);
+    Index.Sync(Tokens, 0, TestMinNgram, TestMaxNgram);
+    if (!MatchesBruteForce(*this, TEXT("initial"), Index, Tokens))
+    {
+        return false;
+    }
+
+    //Appends only index the new tail, MAX_int32 means nothing was rewritten (DraftFromContext's steady state)
+    AppendPhrases(Tokens, 10, 1);
+    Index.Sync(Tokens, MAX_int32, TestMinNgram, TestMaxNgram);
+    if (!MatchesBruteForce(*this, TEXT("append"), Index, Tokens))
+    {
+        return false;
+    }
+
+    //Rollback, like TruncateTokens: the ledger is cut and rewritten from there
+    const int32 TruncateAt = Tokens.size() - 23;
+    Tokens.resize(TruncateAt);
+    AppendPhrases(Tokens, 3, 500);
+    Index.Sync(Tokens, TruncateAt, TestMinNgram, TestMaxNgram);
+    if (!MatchesBruteForce(*this, TEXT("truncate and regenerate"), Index, Tokens))
+    {
+        return false;
+    }
+
+    //Context shift: tokens after the pinned prefix are evicted and everything behind moves up, like ShiftContext
+    const int32 KeepTokens = 9;
+    Tokens.erase(Tokens.begin() + KeepTokens, Tokens.begin() + KeepTokens + 31);
+    Index.Sync(Tokens, KeepTokens, TestMinNgram, TestMaxNgram);
+    if (!MatchesBruteForce(*this, TEXT("shift"), Index, Tokens))
+    {
+        return false;
+    }
+
+    //Prefix cache fork into an emptied ledger: a different conversation from position 0
+    Tokens.clear();
+    AppendPhrases(Tokens, 25, 200);
+    Index.Sync(Tokens, 0, TestMinNgram, TestMaxNgram);
+    if (!MatchesBruteForce(*this, TEXT("fork"), Index, Tokens))
+    {
+        return false;
+    }
+
+    //A stale keep length past the ledger end is clamped, not trusted
+    Tokens.resize(Tokens.size() / 2);
+    Index.Sync(Tokens, MAX_int32, TestMinNgram, TestMaxNgram);
+    if (!MatchesBruteForce(*this, TEXT("shrunk without a rewrite mark"), Index, Tokens))
+    {
+        return false;
+    }
+
+    //Changing the ngram range rebuilds
+    Index.Sync(Tokens, MAX_int32, TestMinNgram, TestMaxNgram + 1);
+    const int32 LongNgramStart = 3;
+    const int32 LongNgramSize = TestMaxNgram + 1;
+    TestEqual(TEXT("Longer ngrams are indexed after a range change"), Index.FindLast(Tokens.data() + LongNgramStart, LongNgramSize),
+        BruteForceFindLast(Tokens, Tokens.data() + LongNgramStart, LongNgramSize));
+
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaNgramIndexCollisionTest, "LlamaCore.PromptLookup.FindLastVerifiesCollisions",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaNgramIndexCollisionTest::RunTest(const FString& Parameters)
+{
+    FCollidingNgramIndex Index;
+    const std::vector<llama_token> Tokens = { 10, 11, 12, 13, 10, 11, 14, 15, 16, 17 };
+    Index.Sync(Tokens, 0, TestMinNgram, TestMaxNgram);
+
+    //A newer start under the same hash whose tokens differ must be skipped in favor of the real match
+    const llama_token Present[] = { 10, 11 };
+    Index.AddCollision(Present, 2, 7);
+    TestEqual(TEXT("Collision skipped, latest real occurrence found"), Index.FindLast(Present, 2), 4);
+
+    //An ngram that only collides must not match at all
+    const llama_token Absent[] = { 30, 31 };
+    Index.AddCollision(Absent, 2, 2);
+    Index.AddCollision(Absent, 2, 6);
+    TestEqual(TEXT("Colliding starts alone don't match"), Index.FindLast(Absent, 2), -1);
+
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaPromptLookupSpeedTest, "LlamaCore.PromptLookup.SpeedOverPlainDecoding",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaPromptLookupSpeedTest::RunTest(const FString& Parameters)
+{
+    const FString ModelPath = LlamaTestModelPath();
+    if (ModelPath.IsEmpty())
+    {
+        AddInfo(TEXT("LLAMA_TEST_MODEL not set, skipping the prompt lookup speed comparison."));
+        return true;
+    }
+
+    //Quoting context back is where prompt lookup pays off
+    const std::string Prompt =
+        "Here is the guard's patrol route: north gate, old well, blacksmith, chapel, east tower, market square, "
+        "north gate again. Repeat the patrol route back to me exactly, word for word, three times.";
+
+    auto Run = [&](bool bPromptLookup, FLlamaRunTimings& OutTimings)
+    {
+        FLLMModelParams Params;
+        Params.PathToModel = ModelPath;
+        Params.MaxContextLength = 2048;
+        Params.Advanced.bUsePromptLookupDecoding = bPromptLookup;
+        Params.Advanced.bWarmupOnLoad = true;
+        Params.Advanced.bLogGenerationStats = false;
+
+        FLlamaInternal Internal;
+        if (!Internal.LoadModelFromParams(Params))
+        {
+            return false;
+        }
+        Internal.OnGenerationComplete = [&OutTimings](const std::string& Response, float Time, int32 Tokens, float Speed, const FLlamaRunTimings& Timings)
+        {
+            OutTimings = Timings;
+        };
+
+        FLlamaGenerationOptions Options;
+        Options.MaxTokens = 160;
+        Internal.InsertTemplatedPrompt(Prompt, EChatTemplateRole::User, true, true, Options);
+        return true;
+    };
+
+    FLlamaRunTimings Plain;
+    FLlamaRunTimings Lookup;
+    if (!Run(false, Plain) || !Run(true, Lookup))
+    {
+        AddError(FString::Printf(TEXT("Failed to load %s"), *ModelPath));
+        return false;
+    }
+
+    AddInfo(FString::Printf(TEXT("Plain decoding %.1f tok/s, prompt lookup %.1f tok/s (%.0f%% of drafts accepted, %.2f tokens per main model decode)"),
+        Plain.TokensPerSecond, Lookup.TokensPerSecond, Lookup.DraftAcceptanceRate * 100.f, Lookup.TokensPerMainDecode));
+
+    TestTrue(TEXT("Both runs generated"), Plain.TokensGenerated > 0 && Lookup.TokensGenerated > 0);
+
+    return true;
+}
+
+#endif //WITH_DEV_AUTOMATION_TESTS
@@ -0,0 +1,177 @@
+#include "Misc/AutomationTest.h"
+#include "Internal/LlamaInternal.h"
+#include "LlamaUtility.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+    //Opens up the templating internals
+    class FLlamaTemplateTestInternal : public FLlamaInternal
+    {
+    public:
+        using FLlamaInternal::ApplyTemplateIncrementally;
+        using FLlamaInternal::ApplyTemplateFromMessagesToBuffer;
+        using FLlamaInternal::ProbeTemplatePrefixStability;
+        using FLlamaInternal::RoleForEnum;
+        using FLlamaInternal::bTemplateIsPrefixStable;
+        using FLlamaInternal::DanglingAssistantPrefix;
+        using FLlamaInternal::DanglingAssistantPrefixLength;
+    };
+
+    //Pushes a message and templates it the way InsertTemplatedPrompt does, returns the size of the newly templated span
+    int32 TemplateTurn(FLlamaTemplateTestInternal& Internal, EChatTemplateRole Role, const std::string& Content, bool bAddAssistantBoS, double& OutSeconds)
+    {
+        Internal.Messages.push_back({ Internal.RoleForEnum(Role), _strdup(Content.c_str()) });
+
+        const double StartTime = FPlatformTime::Seconds();
+        int32 DeltaStart = 0;
+        const int32 NewLen = Internal.ApplyTemplateIncrementally(bAddAssistantBoS, DeltaStart);
+        OutSeconds = FPlatformTime::Seconds() - StartTime;
+
+        Internal.FilledContextCharLength = NewLen;
+        return NewLen - DeltaStart;
+    }
+
+    //What a full re-render of every message gives, the incremental history has to match it
+    FString RenderAll(FLlamaTemplateTestInternal& Internal, bool bAddAssistantBoS)
+    {
+        std::vector<char> Buffer;
+        const int32 Len = Internal.ApplyTemplateFromMessagesToBuffer(Internal.Template, Internal.Messages, Buffer, bAddAssistantBoS);
+        return Len < 0 ? FString() : FLlamaString::ToUE(std::string(Buffer.data(), Buffer.data() + Len));
+    }
+
+    FString History(const FLlamaTemplateTestInternal& Internal)
+    {
+        return FLlamaString::ToUE(std::string(Internal.ContextHistory.data(), Internal.ContextHistory.data() + Internal.FilledContextCharLength));
+    }
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaTemplateIncrementalTest, "LlamaCore.Template.IncrementalTurnsStayFlat",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaTemplateIncrementalTest::RunTest(const FString& Parameters)
+{
+    FLlamaTemplateTestInternal Internal;
+    Internal.Template = "chatml";
+    Internal.ProbeTemplatePrefixStability();
+
+    TestTrue(TEXT("chatml is prefix stable"), Internal.bTemplateIsPrefixStable);
+    TestTrue(TEXT("chatml has a generation prompt"), !Internal.DanglingAssistantPrefix.empty());
+
+    double Seconds = 0.0;
+    TemplateTurn(Internal, EChatTemplateRole::System, "You are a test.", false, Seconds);
+
+    //Same sized messages every turn, only their own span may be templated (and tokenized) no matter how long the history is
+    const int32 NTurns = 200;
+    const int32 NSampleTurns = 20;
+    int32 FirstUserSpan = -1;
+    int32 FirstReplySpan = -1;
+    double EarlySeconds = 0.0;
+    double LateSeconds = 0.0;
+
+    for (int32 Turn = 0; Turn < NTurns; Turn++)
+    {
+        const std::string Content = FLlamaString::ToStd(FString::Printf(TEXT("Message number %06d"), Turn));
+
+        double UserSeconds = 0.0;
+        double ReplySeconds = 0.0;
+        const int32 UserSpan = TemplateTurn(Internal, EChatTemplateRole::User, Content, true, UserSeconds);
+        if (!TestEqual(TEXT("History with generation prompt matches a full render"), History(Internal), RenderAll(Internal, true)))
+        {
+            return false;
+        }
+
+        const int32 ReplySpan = TemplateTurn(Internal, EChatTemplateRole::Assistant, Content, false, ReplySeconds);
+        if (!TestEqual(TEXT("Reply continues the generation prompt"), History(Internal), RenderAll(Internal, false)))
+        {
+            return false;
+        }
+
+        if (Turn == 0)
+        {
+            FirstUserSpan = UserSpan;
+            FirstReplySpan = ReplySpan;
+        }
+        else if (UserSpan != FirstUserSpan || ReplySpan != FirstReplySpan)
+        {
+            AddError(FString::Printf(TEXT("Turn %d templated %d + %d chars, turn 0 did %d + %d"), Turn, UserSpan, ReplySpan, FirstUserSpan, FirstReplySpan));
+            return false;
+        }
+
+        if (Turn < NSampleTurns)
+        {
+            EarlySeconds += UserSeconds + ReplySeconds;
+        }
+        else if (Turn >= NTurns - NSampleTurns)
+        {
+            LateSeconds += UserSeconds + ReplySeconds;
+        }
+    }
+
+    //Timings are informational, the span check above is what keeps them flat
+    const double FullRenderStart = FPlatformTime::Seconds();
+    RenderAll(Internal, true);
+    const double FullRenderSeconds = FPlatformTime::Seconds() - FullRenderStart;
+
+    AddInfo(FString::Printf(TEXT("Per turn templating: %.1fus over the first %d turns, %.1fus over the last %d, a full render of %d messages takes %.1fus"),
+        EarlySeconds / NSampleTurns * 1e6, NSampleTurns, LateSeconds / NSampleTurns * 1e6, NSampleTurns, (int32)Internal.Messages.size(), FullRenderSeconds * 1e6));
+
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaTemplateDanglingPrefixTest, "LlamaCore.Template.DanglingAssistantPrefix",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaTemplateDanglingPrefixTest::RunTest(const FString& Parameters)
+{
+    FLlamaTemplateTestInternal Internal;
+    Internal.Template = "chatml";
+    Internal.ProbeTemplatePrefixStability();
+
+    double Seconds = 0.0;
+    TemplateTurn(Internal, EChatTemplateRole::User, "First", true, Seconds);
+    TestEqual(TEXT("Generation prompt is dangling"), Internal.DanglingAssistantPrefixLength, (int32)Internal.DanglingAssistantPrefix.length());
+
+    //Another user message replaces the unused generation prompt instead of stacking after it
+    const int32 FilledBefore = Internal.FilledContextCharLength;
+    Internal.Messages.push_back({ Internal.RoleForEnum(EChatTemplateRole::User), _strdup("Second") });
+    int32 DeltaStart = 0;
+    Internal.FilledContextCharLength = Internal.ApplyTemplateIncrementally(true, DeltaStart);
+
+    TestEqual(TEXT("Delta starts where the generation prompt began"), DeltaStart, FilledBefore - (int32)Internal.DanglingAssistantPrefix.length());
+    TestEqual(TEXT("Replaced prompt matches a full render"), History(Internal), RenderAll(Internal, true));
+
+    //A system message without a generation prompt leaves nothing dangling
+    TemplateTurn(Internal, EChatTemplateRole::System, "Note", false, Seconds);
+    TestEqual(TEXT("Nothing dangling after a plain message"), Internal.DanglingAssistantPrefixLength, 0);
+    TestEqual(TEXT("Plain message matches a full render"), History(Internal), RenderAll(Internal, false));
+
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaTemplateUnstableFallbackTest, "LlamaCore.Template.UnstableTemplateFallsBack",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaTemplateUnstableFallbackTest::RunTest(const FString& Parameters)
+{
+    //Llama 2 folds the system prompt into the first [INST], rendering per message can't reproduce that
+    FLlamaTemplateTestInternal Internal;
+    Internal.Template = "llama2";
+    Internal.ProbeTemplatePrefixStability();
+
+    TestFalse(TEXT("llama2 is not prefix stable"), Internal.bTemplateIsPrefixStable);
+
+    double Seconds = 0.0;
+    TemplateTurn(Internal, EChatTemplateRole::System, "You are a test.", false, Seconds);
+    TemplateTurn(Internal, EChatTemplateRole::User, "Hello", true, Seconds);
+    TestEqual(TEXT("Fallback rewrites the whole history"), Internal.ContextHistoryRewrittenFrom, 0);
+    TestEqual(TEXT("Fallback matches a full render"), History(Internal), RenderAll(Internal, true));
+
+    TemplateTurn(Internal, EChatTemplateRole::Assistant, "Hi", false, Seconds);
+    TestEqual(TEXT("Fallback reply matches a full render"), History(Internal), RenderAll(Internal, false));
+
+    return true;
+}
+
+#endif //WITH_DEV_AUTOMATION_TESTS
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/Paths.h"
+#include "LlamaUtility.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+/**
+* GGUF used by tests that need real inference, taken from the LLAMA_TEST_MODEL environment variable (absolute, or
+* relative to the models folder when it starts with '.'). Empty if unset or missing, such tests then pass with a note.
+*/
+inline FString LlamaTestModelPath()
+{
+    const FString Path = FPlatformMisc::GetEnvironmentVariable(TEXT("LLAMA_TEST_MODEL"));
+    if (Path.IsEmpty())
+    {
+        return FString();
+    }
+
+    const FString FullPath = FLlamaPaths::ParsePathIntoFullPath(Path);
+    return FPaths::FileExists(FullPath) ? FullPath : FString();
+}
+
+#endif //WITH_DEV_AUTOMATION_TESTS
@@ -0,0 +1,259 @@
+#include "Misc/AutomationTest.h"
+#include "Async/Async.h"
+#include "HAL/MemoryBase.h"
+#include "Internal/LlamaTokenRing.h"
+#include "LlamaUtility.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+    /**
+    * Forwards to the real allocator and counts allocations made by the thread that installed it. std containers
+    * go through FMemory in UE modules, so this sees them too. Other threads keep allocating normally meanwhile.
+    */
+    class FLlamaCountingMalloc final : public FMalloc
+    {
+    public:
+        explicit FLlamaCountingMalloc(FMalloc* InInner)
+            : Inner(InInner)
+            , ThreadId(FPlatformTLS::GetCurrentThreadId())
+        {
+        }
+
+        virtual void* Malloc(SIZE_T Count, uint32 Alignment) override
+        {
+            CountAllocation();
+            return Inner->Malloc(Count, Alignment);
+        }
+
+        virtual void* Realloc(void* Original, SIZE_T Count, uint32 Alignment) override
+        {
+            if (Count > 0)
+            {
+                CountAllocation();
+            }
+            return Inner->Realloc(Original, Count, Alignment);
+        }
+
+        virtual void Free(void* Original) override
+        {
+            Inner->Free(Original);
+        }
+
+        virtual bool GetAllocationSize(void* Original, SIZE_T& SizeOut) override
+        {
+            return Inner->GetAllocationSize(Original, SizeOut);
+        }
+
+        virtual SIZE_T QuantizeSize(SIZE_T Count, uint32 Alignment) override
+        {
+            return Inner->QuantizeSize(Count, Alignment);
+        }
+
+        virtual void Trim(bool bTrimThreadCaches) override
+        {
+            Inner->Trim(bTrimThreadCaches);
+        }
+
+        virtual bool IsInternallyThreadSafe() const override
+        {
+            return Inner->IsInternallyThreadSafe();
+        }
+
+        virtual const TCHAR* GetDescriptiveName() override
+        {
+            return TEXT("LlamaCountingMalloc");
+        }
+
+        int32 Allocations() const
+        {
+            return AllocationCount.GetValue();
+        }
+
+    private:
+        void CountAllocation()
+        {
+            if (FPlatformTLS::GetCurrentThreadId() == ThreadId)
+            {
+                AllocationCount.Increment();
+            }
+        }
+
+        FMalloc* Inner = nullptr;
+        uint32 ThreadId = 0;
+        FThreadSafeCounter AllocationCount;
+    };
+
+    //Installs the counting allocator for its lifetime
+    class FLlamaCountAllocationsScope
+    {
+    public:
+        FLlamaCountAllocationsScope()
+            : Counting(GMalloc)
+        {
+            Previous = GMalloc;
+            GMalloc = &Counting;
+        }
+
+        ~FLlamaCountAllocationsScope()
+        {
+            GMalloc = Previous;
+        }
+
+        int32 Allocations() const
+        {
+            return Counting.Allocations();
+        }
+
+    private:
+        FLlamaCountingMalloc Counting;
+        FMalloc* Previous = nullptr;
+    };
+
+    //Token pieces of a reply, "é" is split over two tokens like byte fallback tokenizers do
+    const char* const TestPieces[] = { "The", " caf", "\xC3", "\xA9", " is", " open", ".", " Want", " a", " seat", "?" };
+
+    //Everything FlushTokenStream does per tick, minus the FString conversions handed to the callbacks
+    int32 DrainAndSegment(FLlamaTokenStreamState& Stream)
+    {
+        int32 NSegments = 0;
+        if (Stream.Ring.Drain(MAX_int64, Stream.Batch) == 0)
+        {
+            return 0;
+        }
+
+        const int32 NComplete = FLlamaString::CompleteUtf8Length(Stream.Batch.data(), Stream.Batch.size());
+        Stream.Segmenter.Feed(Stream.Batch.data(), NComplete, [&NSegments](const char* Segment, int32 SegmentLength)
+        {
+            NSegments++;
+        });
+        Stream.Batch.erase(0, NComplete);
+        return NSegments;
+    }
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaTokenStreamAllocationTest, "LlamaCore.TokenStream.NoPerTokenAllocations",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaTokenStreamAllocationTest::RunTest(const FString& Parameters)
+{
+    FLlamaTokenStreamState Stream;
+    Stream.Segmenter.SetSeparators({ ".", "?", "!" });
+
+    //Warm up once so the segmenter's pending text has grown to a full sentence
+    for (const char* Piece : TestPieces)
+    {
+        Stream.Ring.Push(Piece, FCStringAnsi::Strlen(Piece));
+    }
+    DrainAndSegment(Stream);
+
+    const int32 NReplies = 1000;
+    const int32 TokensPerTick = 3;
+    int32 NTokens = 0;
+    int32 NSegments = 0;
+    int32 Allocations = 0;
+    {
+        FLlamaCountAllocationsScope CountAllocations;
+
+        for (int32 Reply = 0; Reply < NReplies; Reply++)
+        {
+            for (const char* Piece : TestPieces)
+            {
+                Stream.Ring.Push(Piece, FCStringAnsi::Strlen(Piece));
+                if (++NTokens % TokensPerTick == 0)
+                {
+                    NSegments += DrainAndSegment(Stream);
+                }
+            }
+        }
+        NSegments += DrainAndSegment(Stream);
+
+        Allocations = CountAllocations.Allocations();
+    }
+
+    TestEqual(TEXT("Every sentence was cut"), NSegments, NReplies * 2);
+    TestEqual(TEXT("Nothing dropped"), Stream.Ring.DroppedEvents(), (int64)0);
+    TestEqual(TEXT("Allocations while streaming tokens"), Allocations, 0);
+
+    //The callbacks' FStrings are the one remaining allocation, made once per tick however many tokens it carries
+    int32 ConversionAllocations = 0;
+    {
+        FLlamaCountAllocationsScope CountAllocations;
+        const char Tick[] = " caf\xC3\xA9 is open. Want a seat?";
+        FUTF8ToTCHAR TickConverted(Tick, sizeof(Tick) - 1);
+        const FString TickString(TickConverted.Length(), TickConverted.Get());
+        ConversionAllocations = CountAllocations.Allocations();
+    }
+    AddInfo(FString::Printf(TEXT("%d tokens streamed over %d ticks without allocating, converting one tick's text for the callbacks takes %d allocations"),
+        NTokens, NTokens / TokensPerTick, ConversionAllocations));
+
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaTokenRingThreadedTest, "LlamaCore.TokenStream.ThreadedRingKeepsOrder",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaTokenRingThreadedTest::RunTest(const FString& Parameters)
+{
+    //Faster than generation usually gets, through the smallest ring so positions wrap many times
+    const int32 NTokens = 2000;
+    const double TargetTokensPerSecond = 400.0;
+    const float TickSeconds = 1.f / 60.f;
+
+    //Numbered pieces make any reorder or tear visible, every tenth character is split over two events
+    std::vector<std::string> Pieces;
+    std::string Expected;
+    for (int32 i = 0; i < NTokens; i++)
+    {
+        const int32 Step = i % 10;
+        Pieces.push_back(Step == 0 ? "\xC3" : Step == 1 ? "\xA9" : std::to_string(i) + " ");
+        Expected += Pieces.back();
+    }
+
+    FLlamaTokenRing Ring(1024);
+    double ProducerSeconds = 0.0;
+
+    //LLM thread stand in, paced like token generation
+    TFuture<void> Producer = Async(EAsyncExecution::Thread, [&Ring, &Pieces, &ProducerSeconds, TargetTokensPerSecond]
+    {
+        const double StartTime = FPlatformTime::Seconds();
+        for (int32 i = 0; i < (int32)Pieces.size(); i++)
+        {
+            const double Remaining = StartTime + i / TargetTokensPerSecond - FPlatformTime::Seconds();
+            if (Remaining > 0.0)
+            {
+                FPlatformProcess::Sleep((float)Remaining);
+            }
+            Ring.Push(Pieces[i].data(), Pieces[i].size());
+        }
+        ProducerSeconds = FPlatformTime::Seconds() - StartTime;
+    });
+
+    //Game thread: drain once per simulated frame
+    std::string Received;
+    Received.reserve(Expected.size());
+    int32 NTicks = 0;
+    int32 MostEventsPerTick = 0;
+    while (!Producer.IsReady())
+    {
+        FPlatformProcess::Sleep(TickSeconds);
+        MostEventsPerTick = FMath::Max(MostEventsPerTick, Ring.Drain(MAX_int64, Received));
+        NTicks++;
+    }
+    Producer.Wait();
+    Ring.Drain(MAX_int64, Received);
+
+    const double MeasuredTokensPerSecond = NTokens / FMath::Max(ProducerSeconds, 1e-6);
+    TestTrue(TEXT("Produced at 200+ tok/s"), MeasuredTokensPerSecond >= 200.0);
+    TestEqual(TEXT("Nothing dropped"), Ring.DroppedEvents(), (int64)0);
+    TestTrue(TEXT("Ring drained"), Ring.IsEmpty());
+    TestTrue(TEXT("Drained bytes match the pushed ones in order"), Received == Expected);
+
+    AddInfo(FString::Printf(TEXT("%d tokens pushed from another thread at %.0f tok/s through a %d byte ring, drained over %d ticks (at most %d tokens per tick)"),
+        NTokens, MeasuredTokensPerSecond, 1024, NTicks, MostEventsPerTick));
+
+    return true;
+}
+
+#endif //WITH_DEV_AUTOMATION_TESTS
@@ -0,0 +1,159 @@
+#include "Misc/AutomationTest.h"
+#include "Async/Async.h"
+#include "Containers/Queue.h"
+#include "Internal/LlamaWorkerThread.h"
+#include "LlamaNative.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+    //ThreadIdleSleepDuration of the LLM thread loop FLlamaWorkerThread replaced
+    constexpr float RemovedPollSeconds = 0.005f;
+    constexpr int32 NEnqueues = 200;
+    constexpr double IdleSeconds = 1.0;
+
+    class FLlamaNativeTestAccess : public FLlamaNative
+    {
+    public:
+        using FLlamaNative::EnqueueBGTask;
+    };
+
+    //The removed loop: drain everything, then sleep one poll interval whether or not anything was queued
+    class FLlamaPollingThread
+    {
+    public:
+        FLlamaPollingThread()
+        {
+            Done = Async(EAsyncExecution::Thread, [this]
+            {
+                while (bShouldRun)
+                {
+                    Wakeups.Increment();
+                    TFunction<void()> Task;
+                    while (Tasks.Dequeue(Task))
+                    {
+                        Task();
+                    }
+                    FPlatformProcess::Sleep(RemovedPollSeconds);
+                }
+            });
+        }
+
+        ~FLlamaPollingThread()
+        {
+            bShouldRun = false;
+            Done.Wait();
+        }
+
+        void Enqueue(TFunction<void()> Task)
+        {
+            Tasks.Enqueue(MoveTemp(Task));
+        }
+
+        FThreadSafeCounter Wakeups;
+
+    private:
+        TQueue<TFunction<void()>> Tasks;
+        FThreadSafeBool bShouldRun = true;
+        TFuture<void> Done;
+    };
+
+    struct FLlamaStartLatency
+    {
+        double AverageMs = 0.0;
+        double MaxMs = 0.0;
+    };
+
+    //Enqueues one task at a time onto an idle thread and times how long until its body runs
+    FLlamaStartLatency MeasureStartLatency(TFunctionRef<void(TFunction<void()>)> Enqueue)
+    {
+        FEvent* Started = FPlatformProcess::GetSynchEventFromPool(false);
+        FLlamaStartLatency Latency;
+        double StartTime = 0.0;
+
+        for (int32 i = 0; i < NEnqueues; i++)
+        {
+            //Let the thread go back to sleep first, tasks arrive at an idle component
+            FPlatformProcess::Sleep(0.002f);
+
+            const double EnqueueTime = FPlatformTime::Seconds();
+            Enqueue([&StartTime, Started]
+            {
+                StartTime = FPlatformTime::Seconds();
+                Started->Trigger();
+            });
+            Started->Wait();
+
+            const double Ms = (StartTime - EnqueueTime) * 1000.0;
+            Latency.AverageMs += Ms / NEnqueues;
+            Latency.MaxMs = FMath::Max(Latency.MaxMs, Ms);
+        }
+
+        FPlatformProcess::ReturnSynchEventToPool(Started);
+        return Latency;
+    }
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaWorkerStartLatencyTest, "LlamaCore.WorkerThread.EnqueueToStartLatency",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaWorkerStartLatencyTest::RunTest(const FString& Parameters)
+{
+    FLlamaStartLatency Worker;
+    {
+        FLlamaNativeTestAccess Native;
+        Worker = MeasureStartLatency([&Native](TFunction<void()> Task)
+        {
+            Native.EnqueueBGTask([Task](int64 TaskId)
+            {
+                Task();
+            });
+        });
+    }
+
+    FLlamaStartLatency Polling;
+    {
+        FLlamaPollingThread PollingThread;
+        Polling = MeasureStartLatency([&PollingThread](TFunction<void()> Task)
+        {
+            PollingThread.Enqueue(MoveTemp(Task));
+        });
+    }
+
+    AddInfo(FString::Printf(TEXT("EnqueueBGTask to task start over %d enqueues: %.3fms average, %.3fms worst. The %.0fms poll took %.3fms average, %.3fms worst."),
+        NEnqueues, Worker.AverageMs, Worker.MaxMs, RemovedPollSeconds * 1000.f, Polling.AverageMs, Polling.MaxMs));
+
+    TestTrue(TEXT("Woken thread starts tasks sooner than the poll on average"), Worker.AverageMs < Polling.AverageMs);
+
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLlamaWorkerIdleWakeupsTest, "LlamaCore.WorkerThread.NoIdleWakeups",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FLlamaWorkerIdleWakeupsTest::RunTest(const FString& Parameters)
+{
+    FThreadSafeCounter WorkerWakeups;
+    int32 PollingWakeups = 0;
+    {
+        FLlamaWorkerThread Worker([&WorkerWakeups]
+        {
+            WorkerWakeups.Increment();
+        }, TEXT("LlamaWorkerIdleTest"));
+
+        FLlamaPollingThread PollingThread;
+        FPlatformProcess::Sleep(IdleSeconds);
+        PollingWakeups = PollingThread.Wakeups.GetValue();
+
+        //The worker drains once when it starts, then sleeps until woken
+        TestTrue(TEXT("Idle worker doesn't wake up"), WorkerWakeups.GetValue() <= 1);
+    }
+
+    AddInfo(FString::Printf(TEXT("Drain loop wakeups over %.1fs idle: %d for the worker thread, %d for the %.0fms poll"),
+        IdleSeconds, WorkerWakeups.GetValue(), PollingWakeups, RemovedPollSeconds * 1000.f));
+
+    return true;
+}
+
+#endif //WITH_DEV_AUTOMATION_TESTS
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "CoreMinimal.h"
+
+/**
+* Byte level Aho-Corasick automaton over a small set of UTF-8 patterns (separators, stop sequences).
+* Fully expanded transition table so feeding one byte is a single lookup, state survives across
+* token pieces so matches spanning token boundaries are found.
+*/
+class FLlamaAhoCorasick
+{
+public:
+    //Empty patterns are ignored
+    void Build(const std::vector<std::string>& Patterns);
+
+    bool IsEmpty() const;
+
+    int32 Step(int32 State, uint8 Byte) const
+    {
+        return Transitions[State * 256 + Byte];
+    }
+
+    //Length of the longest pattern ending at State, 0 if none does
+    int32 MatchLength(int32 State) const
+    {
+        return Outputs[State];
+    }
+
+    //Bytes of input at State that are still the start of some pattern
+    int32 PrefixLength(int32 State) const
+    {
+        return Depths[State];
+    }
+
+protected:
+    std::vector<int32> Transitions = std::vector<int32>(256, 0);
+    std::vector<int32> Depths = { 0 };
+    std::vector<int32> Outputs = { 0 };
+    int32 NumPatterns = 0;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include "CoreMinimal.h"
+#include "LlamaDataTypes.h"
+#include "llama.h"
+
+struct FLlamaAutotuneResult
+{
+    int32 DecodeThreads = 0;
+    int32 PrefillThreads = 0;
+    int32 MicroBatchLength = 0;
+    float DecodeTokensPerSecond = 0.f;
+    float PrefillTokensPerSecond = 0.f;
+};
+
+/**
+* Picks decode/prefill thread counts and the micro batch size for a loaded model by timing short synthetic probes.
+* Results are keyed by a model file hash, a CPU/GPU signature and the context setup, and cached in
+* FLlamaPaths::AutotuneRootPath(), so the probes only run on the first load of a model in a given setup on a given machine.
+*/
+class FLlamaAutotuner
+{
+public:
+    //Blocking, call on the LLM thread. Returns false if neither the cache nor the probes produced a result.
+    //bCacheOnly skips the probes, for models other users are decoding with which would skew the timings.
+    static bool Tune(llama_model* Model, const std::string& ModelPath, const FLLMModelParams& InModelParams, FLlamaAutotuneResult& OutResult, bool bCacheOnly = false);
+
+protected:
+    static FString CacheFilePath(const std::string& ModelPath, const FLLMModelParams& InModelParams);
+    static bool LoadCached(const FString& FilePath, FLlamaAutotuneResult& OutResult);
+    static void SaveCached(const FString& FilePath, const FLlamaAutotuneResult& Result);
+
+    static bool RunProbes(llama_model* Model, const FLLMModelParams& InModelParams, FLlamaAutotuneResult& OutResult);
+};
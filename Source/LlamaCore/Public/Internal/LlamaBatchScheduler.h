@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vector>
+#include "CoreMinimal.h"
+#include "HAL/Runnable.h"
+#include "llama.h"
+#include "Internal/LlamaPrefixCache.h"
+
+/**
+* Continuous batching over one shared llama_context. Every conversation gets its own seq_id and all pending
+* work (the next token of every generating speaker plus prefill chunks) is merged into a single llama_decode per step.
+* Callers block in Decode on their own LLM thread, the scheduler thread owns llama_decode on the shared context.
+*/
+class FLlamaBatchScheduler : public FRunnable
+{
+public:
+    //One scheduler per model + context setup, created on first acquire and destroyed with its last user.
+    //PrefixCacheSlots extra sequences are reserved as prefix cache donors.
+    static TSharedPtr<FLlamaBatchScheduler> AcquireShared(llama_model* Model, const llama_context_params& SequenceContextParams, int32 MaxSequences,
+        int32 PrefixCacheSlots = 0, int32 PrefixCacheMinTokens = 64);
+
+    //Returns a free sequence id, -1 if all are in use
+    int32 AcquireSequence();
+
+    //Clears the sequence from the KV cache and frees the id
+    void ReleaseSequence(int32 SeqId);
+
+    /**
+    * Decodes NTokens for SeqId starting at StartPos, blocks until done. Long requests may be split over several steps
+    * to stay fair to other sequences. Returns the batch index for the last token's logits (0 if none were wanted),
+    * -1 on failure. When logits were wanted, FinishSampling must be called once sampled so the next step can run.
+    */
+    int32 Decode(int32 SeqId, const llama_token* Tokens, int32 NTokens, llama_pos StartPos, bool bWantLogits);
+
+    //Claims SeqId's logits before reading them. False if the sampling timeout already moved on, they're overwritten then.
+    bool BeginSampling(int32 SeqId);
+    void FinishSampling(int32 SeqId);
+
+    llama_context* GetContext();
+    int32 MaxContextPerSequence();
+    int32 MaxSequences();
+
+    //nullptr if no donor slots were reserved
+    FLlamaPrefixCache* GetPrefixCache();
+
+    //Hold while touching the shared context outside of Decode (KV ops, state get/set)
+    FCriticalSection ContextMutex;
+
+    FLlamaBatchScheduler(llama_context* InContext, int32 InMaxSequences, int32 InPrefixCacheSlots = 0, int32 InPrefixCacheMinTokens = 64);
+    virtual ~FLlamaBatchScheduler();
+
+    //FRunnable
+    virtual uint32 Run() override;
+    virtual void Stop() override;
+
+    //How long a step waits for the speakers of the previous step to submit their next token
+    float GatherWindowSeconds = 0.002f;
+
+    //Upper bound on waiting for speakers to start sampling, their logits expire after that
+    float SamplingTimeoutSeconds = 1.f;
+
+protected:
+    enum class ESamplingState : uint8
+    {
+        None,
+        Pending,    //logits decoded, not claimed yet
+        Sampling,   //claimed, the next step waits for it
+        Expired     //timed out before claiming, must decode again
+    };
+
+    struct FDecodeRequest
+    {
+        int32 SeqId = 0;
+        const llama_token* Tokens = nullptr;
+        int32 NTokens = 0;
+        int32 NDecoded = 0;
+        llama_pos StartPos = 0;
+        bool bWantLogits = false;
+        int32 LogitsIndex = 0;
+        bool bFailed = false;
+        FEvent* DoneEvent = nullptr;
+    };
+
+    void RunStep();
+
+    //Returns how many unclaimed speakers lost their logits
+    int32 ExpireUnclaimedLogits();
+
+    llama_context* Context = nullptr;
+    llama_batch Batch;
+    int32 NBatch = 0;
+    int32 NumSequences = 0;
+    int32 NumPrefixSlots = 0;
+    TUniquePtr<FLlamaPrefixCache> PrefixCache;
+
+    FCriticalSection QueueMutex;
+    std::vector<FDecodeRequest*> PendingRequests;
+    std::vector<bool> SequenceInUse;
+    std::vector<ESamplingState> SamplingStates;
+
+    FEvent* WorkEvent = nullptr;
+    FEvent* SamplingDoneEvent = nullptr;
+    FThreadSafeCounter PendingSamplers;
+    FThreadSafeBool bRunning = true;
+    int32 LastStepSpeakers = 0;
+    int32 RoundRobinOffset = 0;
+
+    FRunnableThread* Thread = nullptr;
+};
+
+//Locks the shared context if there is one, no-op for an exclusively owned context
+class FLlamaContextLock
+{
+public:
+    explicit FLlamaContextLock(FLlamaBatchScheduler* Scheduler);
+    ~FLlamaContextLock();
+
+private:
+    FCriticalSection* Mutex = nullptr;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+* Cancellation flag for one LLM thread task. Whoever may cancel holds a reference, the task checks it between
+* steps and llama_decode checks it per graph node through the context's abort callback.
+*/
+class FLlamaCancelToken
+{
+public:
+    //Threadsafe, sticky. A discarded task also drops its reply callbacks, a plain stop still reports what it has.
+    void Cancel(bool bDiscardResult = true)
+    {
+        if (bDiscardResult)
+        {
+            bDiscarded = true;
+        }
+        bCancelled = true;
+    }
+
+    bool IsCancelled() const
+    {
+        return bCancelled;
+    }
+
+    bool IsDiscarded() const
+    {
+        return bDiscarded;
+    }
+
+protected:
+    FThreadSafeBool bCancelled = false;
+    FThreadSafeBool bDiscarded = false;
+};
+
+typedef TSharedPtr<FLlamaCancelToken, ESPMode::ThreadSafe> FLlamaCancelTokenPtr;
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include "CoreMinimal.h"
+#include "LlamaDataTypes.h"
+
+/**
+* Trades generation speed for frame time. The game thread feeds it frame times and it steps a throttle level up while
+* frames run over budget and back down once there is headroom again. The LLM thread reads the resulting pace between
+* tokens: fewer decode threads, a sleep per token and an optional tokens/s cap.
+*/
+class FLlamaGenerationGovernor
+{
+public:
+    //Game thread, once per tick
+    void Update(float DeltaTime, const FLLMModelAdvancedParams& Params, int32 BaseDecodeThreads);
+    const FLlamaGovernorStats& Stats() const;
+
+    //LLM thread, before each generated token. Sleeps as needed and returns the decode thread count to use, 0 until the first Update.
+    int32 PaceToken();
+
+protected:
+    //Game thread
+    FLlamaGovernorStats CurrentStats;
+    float FrameTimeEma = 0.f;
+    float ThrottleLevel = 0.f;
+    double LastStepTime = 0.0;
+
+    //Published to the LLM thread
+    std::atomic<int32> DecodeThreads{ 0 };
+    std::atomic<float> YieldSeconds{ 0.f };
+    std::atomic<float> MinTokenInterval{ 0.f };
+
+    //LLM thread
+    double LastTokenTime = 0.0;
+};
@@ -3,6 +3,31 @@
 #include <string>
 #include "LlamaDataTypes.h"
 #include "llama.h"
+#include "Internal/LlamaPrefixCache.h"
+#include "Internal/LlamaAhoCorasick.h"
+#include "Internal/LlamaCancelToken.h"
+#include "Internal/LlamaNgramIndex.h"
+
+class FLlamaBatchScheduler;
+
+//Per request options for Generate, limits of 0 = unbounded
+struct FLlamaGenerationOptions
+{
+    int32 MaxTokens = 0;
+    double DeadlineSeconds = 0.0;   //FPlatformTime::Seconds() clock
+
+    bool bOverrideSampling = false;
+    FLlamaSamplingParams Sampling;
+};
+
+//Where a single message lives in the KV cache and in ContextHistory
+struct FLlamaMessageSpan
+{
+    int32 TokenStart = 0;               //KV position of the first token of this message
+    int32 TokenCount = 0;
+    int32 CharStart = 0;                //offset into ContextHistory
+    int32 AssistantPrefixTokens = 0;    //trailing generation prompt tokens included in TokenCount
+};
 
 /** 
 * Uses mostly Llama.cpp native API, meant to be embedded in LlamaNative that wraps 
@@ -17,34 +42,84 @@ public:
     llama_sampler* Sampler = nullptr;
     struct common_sampler* CommonSampler = nullptr;
 
+    //Optional speculative decoding draft model, same vocab as LlamaModel
+    llama_model* DraftModel = nullptr;
+    llama_context* DraftContext = nullptr;
+    struct common_sampler* DraftSampler = nullptr;
+
+    //Set if Context is shared with other components, our KV lives in SeqId and decodes go through the scheduler
+    TSharedPtr<FLlamaBatchScheduler> BatchScheduler;
+    llama_seq_id SeqId = 0;
+
     //main streaming callback
     TFunction<void(const std::string& TokenPiece)>OnTokenGenerated = nullptr;
     TFunction<void(int32 TokensProcessed, EChatTemplateRole ForRole, float Speed)>OnPromptProcessed = nullptr;   //useful for waiting for system prompt ready
-    TFunction<void(const std::string& Response, float Time, int32 Tokens, float Speed)>OnGenerationComplete = nullptr;
+    TFunction<void(int32 TokensProcessed, int32 TokensTotal, EChatTemplateRole ForRole)>OnPromptProgress = nullptr;   //per decoded prompt chunk
+    TFunction<void(const std::string& Response, float Time, int32 Tokens, float Speed, const FLlamaRunTimings& Timings)>OnGenerationComplete = nullptr;
+    TFunction<void(float Progress)>OnModelLoadProgress = nullptr;   //0-1 while weights are read, called from inside the load
+
+    //Polled between prompt chunks and generated tokens of a templated prompt, returning true preempts it: the message and
+    //any partial reply are rolled back and nothing is emitted. WasPreempted() then tells the caller to run it again later.
+    TFunction<bool()>OnShouldYield = nullptr;
+
+    //Called for each generated token once its logits are sampled, may sleep to pace generation
+    TFunction<void()>OnPaceToken = nullptr;
+
+    //Generation threads of an own context, applied from the next decode. LLM thread only.
+    void SetDecodeThreads(int32 NThreads);
 
     //Messaging state
     std::vector<llama_chat_message> Messages;
+    uint32 MessagesEpoch = 0;   //bumped whenever messages are removed, appends keep it
     std::vector<char> ContextHistory;
+    int32 ContextHistoryRewrittenFrom = 0;  //lowest char changed in place since LlamaNative last published, MAX_int32 if only appended
+    int32 FilledContextCharLength = 0;      //ContextHistory past this is scratch left over from templating
+
+    //Token ledger: every token in our KV sequence (index == position) and one span per entry in Messages
+    std::vector<llama_token> ContextTokens;
+    std::vector<FLlamaMessageSpan> MessageSpans;
+    int32 ContextTokensRewrittenFrom = 0;   //lowest ledger index removed or replaced since the ngram index last synced
 
     //Loaded state
     std::string Template;
     std::string TemplateSource;
+    FLLMModelParams LoadedParams;
+    FLlamaAhoCorasick StopSequenceMatcher;     //built from LoadedParams.StopSequences
 
     //Model loading
     bool LoadModelFromParams(const FLLMModelParams& InModelParams);
     void UnloadModel();
     bool IsModelLoaded();
 
+    //LoadModelFromParams stops at its next progress report once the task's cancel token (SetCancelToken) is cancelled and
+    //returns false, this tells that apart from a failed load.
+    bool WasModelLoadCancelled();
+
+    //Recreates only the context (size, batch, threads, sharing) against the loaded weights and re-prefills the conversation
+    //from the token ledger if it still fits. Returns false if the new context couldn't be created, the previous one is restored then.
+    bool ReconfigureContext(const FLLMModelParams& InModelParams);
+
+    //Session state: KV sequence, token ledger, messages and sampler seed. Data may point into a memory mapped file.
+    //Saving fails for sessions larger than MaxSessionPayloadSize.
+    bool SaveSessionToBuffer(TArray<uint8>& OutBuffer);
+    bool LoadSessionFromBuffer(const uint8* Data, int64 DataSize);
+
+    //Session payloads and files are int32 indexed TArrays, this leaves room for the file header and zlib's worst case growth
+    static constexpr int64 MaxSessionPayloadSize = MAX_int32 - 64 * 1024 * 1024;
+
     //Generation
     void ResetContextHistory(bool bKeepSystemsPrompt = false);
     void RollbackContextHistoryByTokens(int32 NTokensToErase);
+
+    //Pure KV removal via the token ledger, no templating or tokenizing
     void RollbackContextHistoryByMessages(int32 NMessagesToErase);
 
     //raw prompt insert doesn't not update messages, just context history
     std::string InsertRawPrompt(const std::string& Prompt, bool bGenerateReply = true);
 
     //main function for structure insert and generation
-    std::string InsertTemplatedPrompt(const std::string& Prompt, EChatTemplateRole Role = EChatTemplateRole::User, bool bAddAssistantBoS = true, bool bGenerateReply = true);
+    std::string InsertTemplatedPrompt(const std::string& Prompt, EChatTemplateRole Role = EChatTemplateRole::User, bool bAddAssistantBoS = true, bool bGenerateReply = true,
+        const FLlamaGenerationOptions& Options = FLlamaGenerationOptions());
 
     //continue generating from last stop
     std::string ResumeGeneration();
@@ -54,27 +129,170 @@ public:
 
     std::string WrapPromptForRole(const std::string& Text, EChatTemplateRole Role, const std::string& OverrideTemplate, bool bAddAssistantBoS = false);
 
-    //flips bGenerationActive which will stop generation on next token. Threadsafe call.
+    //flips bGenerationActive which will stop generation on next token or prompt processing on next chunk. Threadsafe call.
+    //A prompt stop sticks until the next task begins, so a stop issued right before a prompt starts still aborts it.
     void StopGeneration();
+
+    //Token of the task about to run on the LLM thread, cancelling it also aborts a prompt chunk or token decode in flight.
+    //Set by the owner around each task, LLM thread only. Also clears WasPreempted and, for a new task, a pending prompt stop.
+    void SetCancelToken(const FLlamaCancelTokenPtr& InCancelToken);
+    bool WasPreempted();
     bool IsGenerating();
+    bool IsProcessingPrompt();
 
     int32 MaxContext();
     int32 UsedContext();
 
+    //Zeroed if we're not in a shared context with a prefix cache
+    FLlamaPrefixCacheStats PrefixCacheStats();
+
     FLlamaInternal();
     ~FLlamaInternal();
 
 protected:
-    //Wrapper for user<->assistant templated conversation
-    int32 ProcessPrompt(const std::string& Prompt, EChatTemplateRole Role = EChatTemplateRole::Unknown);
-    std::string Generate(const std::string& Prompt = "", bool bAppendToMessageHistory = true);
+    //Wrapper for user<->assistant templated conversation. Decodes in ubatch sized chunks, returns -1 if stopped or failed.
+    //bWantLogits keeps the last token's logits for a reply that follows right away, a shared context otherwise decodes it again.
+    int32 ProcessPrompt(const std::string& Prompt, EChatTemplateRole Role = EChatTemplateRole::Unknown, bool bWantLogits = false);
+    int32 ProcessPrompt(const std::vector<llama_token>& PromptTokens, EChatTemplateRole Role = EChatTemplateRole::Unknown, bool bWantLogits = false);
+
+    //Appends tokens of Text, BOS is added only if this is the first text in the context
+    bool TokenizePrompt(const std::string& Text, std::vector<llama_token>& OutTokens);
+
+    //Decodes tokens at the end of our sequence and appends them to ContextTokens. Returns the logits index to sample from, -1 on failure.
+    int32 DecodeTokens(const llama_token* Tokens, int32 NTokens, bool bWantLogits);
+
+    //Logits of the last token in the ledger, re-decoding it if they were invalidated (rollback, session load, shared context)
+    int32 PrepareLogitsForSampling();
+
+    //Must follow every sample in shared mode, the scheduler holds the next batch until all speakers are done
+    void FinishSampling();
+
+    //Speculative decoding: draft K tokens (draft model or prompt lookup), verify them with the main model in one decode
+    bool LoadDraftModel(const FLLMModelParams& InModelParams, const llama_context_params& ContextParams);
+    void UnloadDraftModel();
+    bool CanSpeculate();
+
+    //Catches the draft context up with ContextTokens + LastToken, reusing the common prefix
+    bool SyncDraftContext(llama_token LastToken);
+    std::vector<llama_token> DraftContinuation(llama_token LastToken, int32 MaxTokens);
+    std::vector<llama_token> DraftWithModel(llama_token LastToken, int32 MaxTokens);
+
+    //Prompt lookup: finds the latest earlier occurrence of the trailing ngram in the ledger and proposes what followed it
+    std::vector<llama_token> DraftFromContext(llama_token LastToken, int32 MaxTokens);
+
+    //Decodes LastToken + Draft with logits at every position and appends them to the ledger
+    bool DecodeForVerification(llama_token LastToken, const std::vector<llama_token>& Draft);
+
+    //Accepted draft prefix followed by the main model's next token, same semantics as common_sampler_sample_and_accept_n
+    std::vector<llama_token> SampleAndAcceptDraft(const std::vector<llama_token>& Draft);
+
+    //Chunked decode that keeps ContextTokens in sync, no OnPromptProcessed emit
+    int32 DecodePromptTokens(const std::vector<llama_token>& PromptTokens, EChatTemplateRole Role, bool bEmitProgress = true, bool bWantLogits = false);
+
+    //Evicts oldest messages after the pinned system prompt/sink tokens to make room for TokensNeeded.
+    //Returns the number of tokens discarded, 0 if shifting is off or not possible.
+    int32 ShiftContext(int32 TokensNeeded);
+
+    //Remove everything from TokenPosition/CharPosition onward in KV, ledger and ContextHistory
+    void TruncateContext(int32 TokenPosition, int32 CharPosition);
+
+    //KV and ledger only, ContextHistory is left alone
+    void TruncateTokens(int32 TokenPosition);
+    void ClearMessages();
+    std::string Generate(const std::string& Prompt = "", bool bAppendToMessageHistory = true, const FLlamaGenerationOptions& Options = FLlamaGenerationOptions());
 
     int32 ApplyTemplateToContextHistory(bool bAddAssistantBOS = false);
+
+    //Templates only Messages.back() and appends it to ContextHistory, full render fallback if template isn't prefix stable.
+    //OutDeltaStart is the char offset where the newly templated text begins.
+    int32 ApplyTemplateIncrementally(bool bAddAssistantBoS, int32& OutDeltaStart);
+
+    //Offset in a freshly templated assistant turn where the reply text ends and the template's closing tail begins, -1 if not found
+    static int32 FindResponseEnd(const std::string& Response, const std::string& RenderedTurn);
+    void ProbeTemplatePrefixStability();
     int32 ApplyTemplateFromMessagesToBuffer(const std::string& Template, std::vector<llama_chat_message>& FromMessages, std::vector<char>& ToBuffer, bool bAddAssistantBoS = false);
 
     const char* RoleForEnum(EChatTemplateRole Role);
+    EChatTemplateRole RoleForString(const char* Role);
+
+    //Context setup, used by model load and ReconfigureContext
+    static llama_context_params MakeContextParams(const FLLMModelParams& InModelParams);
+    bool CreateContext(const FLLMModelParams& InModelParams);
+    void FreeContext();
+    void CreateSpeculativeBatch(const FLLMModelParams& InModelParams);
+
+    //Samplers are rebuilt from params, e.g. when a session restores its seed
+    void CreateSamplers(const FLLMModelParams& InModelParams);
+    void FreeSamplers();
+    uint32 SamplerSeed();
+
+    //A sampler chain in both flavors, only one is used depending on bUseCommonSampler
+    struct FLlamaSamplerChain
+    {
+        llama_sampler* Sampler = nullptr;
+        struct common_sampler* CommonSampler = nullptr;
+    };
+    FLlamaSamplerChain BuildSamplerChain(const FLlamaSamplingParams& Params, bool bUseCommonSampler);
+    static FLlamaSamplingParams SamplingParamsFromModelParams(const FLLMModelParams& InModelParams);
+
+    //Chains for per request sampling overrides, kept prebuilt so switching is just a pointer swap
+    FLlamaSamplerChain AcquireOverrideSamplers(const FLlamaSamplingParams& Params);
+    struct FCachedSamplerChain
+    {
+        FLlamaSamplingParams Params;
+        FLlamaSamplerChain Chain;
+        uint64 LastUsed = 0;
+    };
+    std::vector<FCachedSamplerChain> SamplerCache;
+    uint64 SamplerCacheCounter = 0;
+    static constexpr int32 SamplerCacheSize = 8;
 
     bool bIsModelLoaded = false;
-    int32 FilledContextCharLength = 0;
+
+    //One throwaway decode (bos/eos like llama.cpp's common init) then clears it again
+    void WarmupContext();
+
+    //Dedicated ggml threadpools attached to our own context, nullptr if ggml's default threads are used.
+    //ThreadpoolBatch is only set when prefill needs different threads than generation.
+    struct ggml_threadpool* Threadpool = nullptr;
+    struct ggml_threadpool* ThreadpoolBatch = nullptr;
+    bool CreateThreadpools(const FLLMModelParams& InModelParams);
+    void FreeThreadpools();
+
+    //Incremental templating state
+    bool bTemplateIsPrefixStable = false;
+    std::string DanglingAssistantPrefix;        //generation prompt the template appends with bAddAssistantBoS
+    int32 DanglingAssistantPrefixLength = 0;    //non-zero if ContextHistory currently ends with the generation prompt
+    int32 DanglingAssistantPrefixTokens = 0;
+    std::vector<char> TemplateScratchBuffer;
+    //Speculative state
+    std::vector<llama_token> DraftContextTokens;
+    FLlamaNgramIndex NgramIndex;
+    llama_batch SpeculativeBatch = {};
+    int32 SpeculativeDraftMax = 0;
+
+    //Logits state of the last decode
+    bool bLogitsValid = false;
+    int32 LastLogitsIndex = -1;
+    bool bSamplingPending = false;
+
     FThreadSafeBool bGenerationActive = false;
+    FThreadSafeBool bPromptProcessingActive = false;
+    FThreadSafeBool bPromptStopRequested = false;   //set by StopGeneration, cleared when the next task begins
+
+    //Deadline of the reply a prompt is processed for, checked between prompt chunks like a stop
+    double PromptDeadlineSeconds = 0.0;
+    bool bPromptDeadlinePassed = false;
+
+    //Abort callback of an own context (ggml checks it per graph node, CPU backend only). Only prompt chunks and generated
+    //tokens are cancellable, cleanup decodes after a cancel (template tail, stop sequence leftovers) still run.
+    FLlamaCancelTokenPtr CancelToken;
+    bool bDecodeCancellable = false;
+    bool IsTaskCancelled();
+
+    //Only a templated prompt that added a message can be undone cleanly, see OnShouldYield
+    bool bYieldAllowed = false;
+    bool bPreempted = false;
+    bool ShouldPreempt();
+    static bool AbortDecodeCallback(void* UserData);
 };
\ No newline at end of file
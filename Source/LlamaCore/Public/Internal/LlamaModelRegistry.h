@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "CoreMinimal.h"
+#include "llama.h"
+
+/**
+* Process wide, reference counted llama_model cache. Components loading the same GGUF with the same
+* load params share one copy of the weights and only create their own llama_context.
+* Threadsafe, expected to be called from the LLM threads. Loading and freeing weights happens outside the registry lock.
+*/
+class FLlamaModelRegistry
+{
+public:
+    static FLlamaModelRegistry& Get();
+
+    //Returns the shared model for path + params, loading it if this is the first user. nullptr on failure or once
+    //CancelToken is cancelled. Users waiting on someone else's load get its progress through Params.progress_callback and
+    //take over the load if that user cancels it. bOutShared is set when someone else loaded the weights.
+    llama_model* AcquireModel(const std::string& Path, const llama_model_params& Params, const class FLlamaCancelToken* CancelToken = nullptr, bool* bOutShared = nullptr);
+
+    //Drops a reference, the model is freed when the last user releases it
+    void ReleaseModel(llama_model* Model);
+
+    int32 NumLoadedModels();
+
+protected:
+    //Entries are added before their model loads so the registry isn't locked during the load, users of the same
+    //key wait on LoadedEvent instead
+    struct FModelEntry
+    {
+        std::string Key;
+        llama_model* Model = nullptr;
+        int32 RefCount = 0;
+        bool bLoading = false;
+        FEvent* LoadedEvent = nullptr;
+
+        //Written by the loader's progress callback, polled by waiters
+        std::atomic<float> Progress{ 0.f };
+        FThreadSafeBool bLoadCancelled = false;
+        llama_progress_callback LoaderCallback = nullptr;
+        void* LoaderUserData = nullptr;
+
+        ~FModelEntry();
+    };
+
+    std::string KeyForModel(const std::string& Path, const llama_model_params& Params);
+
+    //Records progress and cancels for waiters, then forwards to the loader's own callback
+    static bool OnLoadProgress(float Progress, void* UserData);
+
+    FCriticalSection RegistryMutex;
+    std::vector<TSharedPtr<FModelEntry>> Entries;
+    bool bBackendsLoaded = false;
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include "CoreMinimal.h"
+#include "llama.h"
+
+/**
+* Token n-gram -> start positions index over the context ledger, for prompt lookup drafting. Kept in step with
+* the ledger incrementally: appends index only the new tokens, rollbacks pop only what they removed.
+*/
+class FLlamaNgramIndex
+{
+public:
+    //Tokens [0, KeepLength) are unchanged since the last sync, the rest is reindexed. Changing the ngram range rebuilds.
+    void Sync(const std::vector<llama_token>& Tokens, int32 KeepLength, int32 InMinNgram, int32 InMaxNgram);
+
+    //Start of the most recent occurrence of Ngram in the indexed tokens, -1 if there is none
+    int32 FindLast(const llama_token* Ngram, int32 NgramSize) const;
+
+protected:
+    static uint64 HashNgram(const llama_token* Tokens, int32 NgramSize);
+
+    int32 MinNgram = 0;
+    int32 MaxNgram = -1;
+    std::vector<llama_token> IndexedTokens;
+
+    //Starts are pushed in increasing order so the most recent is at the back and rollbacks pop from there
+    std::unordered_map<uint64, std::vector<int32>> NgramStarts;
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include "CoreMinimal.h"
+#include "llama.h"
+
+struct FLlamaPrefixCacheStats
+{
+    int32 Hits = 0;
+    int32 Misses = 0;
+    int64 TokensReused = 0;
+    int32 Entries = 0;
+};
+
+/**
+* Keeps decoded prompt prefixes alive in donor sequences of a shared context. New conversations fork the longest
+* matching prefix into their own sequence with llama_kv_cache_seq_cp (cells are shared, not copied) and only
+* prefill the remaining suffix. Donor slots are recycled least recently used first.
+*/
+class FLlamaPrefixCache
+{
+public:
+    FLlamaPrefixCache(llama_context* InContext, FCriticalSection* InContextMutex, llama_seq_id InFirstDonorSeqId, int32 InNumSlots, int32 InMinPrefixTokens);
+
+    //Forks the longest cached prefix of Tokens into the empty ToSeqId. Returns the number of tokens now in ToSeqId, 0 on a miss.
+    int32 Fork(const std::vector<llama_token>& Tokens, llama_seq_id ToSeqId);
+
+    //Keeps Tokens (positions 0..n already decoded in FromSeqId) as a donor unless an entry already covers them
+    void Donate(const std::vector<llama_token>& Tokens, llama_seq_id FromSeqId);
+
+    FLlamaPrefixCacheStats Stats();
+
+protected:
+    struct FPrefixEntry
+    {
+        llama_seq_id DonorSeqId = 0;
+        std::vector<llama_token> Tokens;
+        std::vector<uint32> BlockHashes;   //rolling hash at each block boundary
+        uint64 LastUsed = 0;
+    };
+
+    //Hash of every full block prefix, BlockHashes[i] covers Tokens[0, (i+1)*BlockSize)
+    static std::vector<uint32> HashBlocks(const std::vector<llama_token>& Tokens);
+
+    static constexpr int32 BlockSize = 32;
+
+    llama_context* Context = nullptr;
+    FCriticalSection* ContextMutex = nullptr;
+    int32 MinPrefixTokens = 0;
+
+    FCriticalSection CacheMutex;
+    std::vector<FPrefixEntry> Entries;
+    std::vector<llama_seq_id> FreeDonors;
+    uint64 UseCounter = 0;
+    FLlamaPrefixCacheStats CacheStats;
+};
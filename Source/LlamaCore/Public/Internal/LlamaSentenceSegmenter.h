@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "CoreMinimal.h"
+#include "Internal/LlamaAhoCorasick.h"
+
+/**
+* Streaming partials splitter. Text is fed as it arrives, each byte advances one automaton step and a segment
+* is emitted whenever a separator ends, so work per token doesn't depend on how long the response already is.
+* Only the text since the last emitted segment is kept.
+*/
+class FLlamaSentenceSegmenter
+{
+public:
+    void SetSeparators(const std::vector<std::string>& Separators);
+
+    //Utf8 must end on a character boundary. OnSegment gets the text from the previous segment up to and incl. the separator.
+    void Feed(const char* Utf8, int32 Length, TFunctionRef<void(const char* Segment, int32 SegmentLength)> OnSegment);
+
+    //Drops unfinished text, call between responses
+    void Reset();
+
+protected:
+    FLlamaAhoCorasick Automaton;
+    int32 State = 0;
+    std::string Pending;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include "CoreMinimal.h"
+#include "LlamaDataTypes.h"
+
+//Bytes appended to the context history between two publishes, chained to everything before. Immutable once published.
+struct FLlamaHistoryChunk
+{
+    TSharedPtr<const FLlamaHistoryChunk> Previous;
+    std::string Text;
+    int32 TotalLength = 0;      //this chunk and all previous ones
+    int32 Depth = 1;
+};
+
+//Model state published by the LLM thread after each prompt/generation
+struct FLlamaStateSnapshot
+{
+    uint64 Version = 0;
+
+    //Changes whenever messages got removed or replaced, the reader rebuilds its history from FirstMessageIndex 0
+    uint32 MessagesEpoch = 0;
+
+    //Only messages the reader hasn't acknowledged, Messages[0] is message FirstMessageIndex of the full history
+    int32 FirstMessageIndex = 0;
+    int32 TotalMessages = 0;
+    TArray<FStructuredChatMessage> Messages;
+
+    //Raw bytes, joined and converted only when someone reads the context history
+    TSharedPtr<const FLlamaHistoryChunk> ContextHistoryTail;
+};
+
+/**
+* Lock-free triple buffer of FLlamaStateSnapshot between one writer (LLM thread) and one reader (game thread).
+* The writer fills the back slot and publishes it, the reader takes the latest published slot. Neither side ever
+* waits and the reader's slot is never written while it holds it.
+*/
+class FLlamaStateSnapshotBuffer
+{
+public:
+    //Writer: slot to fill, may contain a stale older snapshot
+    FLlamaStateSnapshot& BeginWrite();
+    void Publish();
+
+    //Reader: latest published snapshot, nullptr if nothing was published since the last call
+    const FLlamaStateSnapshot* AcquireLatest();
+
+    //Reader tells the writer which messages it holds so the next snapshot only carries the rest
+    void Acknowledge(uint32 MessagesEpoch, int32 NumMessages);
+    void GetAcknowledged(uint32& OutMessagesEpoch, int32& OutNumMessages) const;
+
+protected:
+    static constexpr uint8 FreshBit = 1 << 2;
+    static constexpr uint8 IndexMask = 3;
+
+    FLlamaStateSnapshot Slots[3];
+    uint8 BackIndex = 0;
+    uint8 FrontIndex = 1;
+    std::atomic<uint8> MiddleIndex{ 2 };
+
+    //Epoch in the high half, message count in the low half so both are read together
+    std::atomic<uint64> Acknowledged{ 0 };
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "CoreMinimal.h"
+#include "Internal/LlamaSentenceSegmenter.h"
+
+/**
+* Preallocated single producer (LLM thread) single consumer (game thread) ring of UTF-8 token events.
+* Pushing never allocates, the consumer drains many events into one contiguous UTF-8 buffer.
+* Event layout: [uint16 Length][Length bytes], wrapping at the end of the buffer.
+*/
+class FLlamaTokenRing
+{
+public:
+    //Capacity is rounded up to a power of two
+    explicit FLlamaTokenRing(int32 CapacityBytes = 64 * 1024);
+
+    //Producer. Waits up to MaxWaitSeconds for the consumer to make room, then drops the event and returns false.
+    bool Push(const char* Utf8, int32 Length, float MaxWaitSeconds = 0.05f);
+
+    //Producer side count of pushed events, used to order other game thread work against the stream
+    int64 PushedEvents() const;
+
+    //Consumer. Appends events up to (excluding) event number UpToEvent to OutUtf8, returns the number of events drained.
+    int32 Drain(int64 UpToEvent, std::string& OutUtf8);
+
+    bool IsEmpty() const;
+    int64 DroppedEvents() const;
+
+protected:
+    void CopyIn(uint64 Position, const void* Source, int32 Length);
+    void CopyOut(uint64 Position, void* Dest, int32 Length) const;
+
+    static constexpr int32 HeaderSize = sizeof(uint16);
+
+    std::vector<uint8> Buffer;
+    uint64 Mask = 0;
+
+    //Byte positions grow forever, masked on access
+    std::atomic<uint64> WritePosition{ 0 };
+    std::atomic<uint64> ReadPosition{ 0 };
+    std::atomic<int64> EventsPushed{ 0 };
+    int64 EventsDrained = 0;
+    std::atomic<int64> EventsDropped{ 0 };
+};
+
+//Token stream between FLlamaNative's LLM thread and game thread. Scratch buffers are reused so pushing, draining and
+//segmenting don't allocate once warmed up, only the FStrings handed to the callbacks do, once per tick.
+struct FLlamaTokenStreamState
+{
+    FLlamaTokenRing Ring;
+
+    //Game thread: drained bytes not yet emitted, incl. a trailing incomplete UTF-8 sequence
+    std::string Batch;
+
+    //Game thread: cuts the streamed text into partials
+    FLlamaSentenceSegmenter Segmenter;
+
+    FLlamaTokenStreamState()
+    {
+        Batch.reserve(4096);
+    }
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/Runnable.h"
+
+/**
+* Dedicated thread that sleeps on an event until woken, then runs the drain function until it returns.
+* Wake() after every enqueue, the event stays signalled if the thread is busy so no wake up is ever lost.
+*/
+class FLlamaWorkerThread : public FRunnable
+{
+public:
+    FLlamaWorkerThread(TFunction<void()> InDrainTasks, const TCHAR* ThreadName, EThreadPriority Priority = TPri_Normal);
+
+    //Joins the thread once the drain function returns, it keeps going while tasks are queued so cancel those first
+    virtual ~FLlamaWorkerThread();
+
+    void Wake();
+
+    void SetPriority(EThreadPriority Priority);
+
+    //FRunnable
+    virtual uint32 Run() override;
+    virtual void Stop() override;
+
+protected:
+    TFunction<void()> DrainTasks;
+    FEvent* WakeEvent = nullptr;
+    FThreadSafeBool bShouldRun = true;
+    FRunnableThread* Thread = nullptr;
+};
@@ -21,7 +21,7 @@ public:
                                 ELevelTick TickType,
                                 FActorComponentTickFunction* ThisTickFunction) override;
 
-    //Main callback, updates for each token generated
+    //Main callback, updates for each token generated. Not called for background priority prompts.
     UPROPERTY(BlueprintAssignable)
     FOnTokenGeneratedSignature OnTokenGenerated;
 
@@ -29,13 +29,17 @@ public:
     UPROPERTY(BlueprintAssignable)
     FOnResponseGeneratedSignature OnResponseGenerated;
 
-    //Utility split emit e.g. sentence level emits, useful for speech generation
+    //Utility split emit e.g. sentence level emits, useful for speech generation. Not called for background priority prompts.
     UPROPERTY(BlueprintAssignable)
     FOnPartialSignature OnPartialGenerated;
 
     UPROPERTY(BlueprintAssignable)
     FOnPromptProcessedSignature OnPromptProcessed;
 
+    //Emitted per decoded chunk of a long prompt, useful for progress bars on large context inserts
+    UPROPERTY(BlueprintAssignable)
+    FOnPromptProgressSignature OnPromptProgress;
+
     UPROPERTY(BlueprintAssignable)
     FVoidEventSignature OnStartEval;
 
@@ -49,15 +53,25 @@ public:
     UPROPERTY(BlueprintAssignable)
     FModelNameSignature OnModelLoaded;
 
+    //0-1 while the model file is being read, 1 arrives before OnModelLoaded
+    UPROPERTY(BlueprintAssignable)
+    FOnModelLoadProgressSignature OnModelLoadProgress;
+
     //Catch internal errors
     UPROPERTY(BlueprintAssignable)
     FOnErrorSignature OnError;
 
+    UPROPERTY(BlueprintAssignable)
+    FOnSessionSignature OnSessionSaved;
+
+    UPROPERTY(BlueprintAssignable)
+    FOnSessionSignature OnSessionLoaded;
+
     //Modify these before loading model to apply settings
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Component")
     FLLMModelParams ModelParams;
 
-    //This state gets updated typically after every response
+    //This state gets updated typically after every response. ContextHistory is not kept up to date here, use RawContextHistory().
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Component")
     FLLMModelState ModelState;
 
@@ -81,6 +95,22 @@ public:
     UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
     void ResetContextHistory(bool bKeepSystemPrompt = false);
 
+    //Saves conversation and KV cache to disk. Relative paths (starting with .) are saved in Saved/Sessions.
+    UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
+    void SaveSession(const FString& SessionPath = TEXT("./session.llama"), bool bCompress = true);
+
+    //Restores a saved conversation without re-processing it. Model must be loaded with the same model file.
+    UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
+    void LoadSession(const FString& SessionPath = TEXT("./session.llama"));
+
+    //Aborts a model load in progress, OnModelLoaded won't fire for it
+    UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
+    void CancelModelLoad();
+
+    //Applies context size, batch size and thread changes in ModelParams without reloading the model
+    UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
+    void ReconfigureContext();
+
     //removes what the LLM replied
     UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
     void RemoveLastAssistantReply();
@@ -89,16 +119,16 @@ public:
     UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
     void RemoveLastUserInput();
 
-    //Main input function
+    //Main input function, returns a task handle for CancelTask (-1 if the model isn't loaded)
     UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
-    void InsertTemplatedPrompt(UPARAM(meta=(MultiLine=true)) const FString& Text, EChatTemplateRole Role = EChatTemplateRole::User, bool bAddAssistantBOS = false, bool bGenerateReply = true);
+    int64 InsertTemplatedPrompt(UPARAM(meta=(MultiLine=true)) const FString& Text, EChatTemplateRole Role = EChatTemplateRole::User, bool bAddAssistantBOS = false, bool bGenerateReply = true);
 
     UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
-    void InsertTemplatedPromptStruct(const FLlamaChatPrompt& ChatPrompt);
+    int64 InsertTemplatedPromptStruct(const FLlamaChatPrompt& ChatPrompt);
 
     //does not apply formatting before running inference
     UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
-    void InsertRawPrompt(UPARAM(meta = (MultiLine = true)) const FString& Text, bool bGenerateReply = true);
+    int64 InsertRawPrompt(UPARAM(meta = (MultiLine = true)) const FString& Text, bool bGenerateReply = true);
 
     //if you want to manually wrap prompt, if template is empty string, default model template is applied. NB: this function may be unsafe to use atm
     UFUNCTION(BlueprintPure, Category = "LLM Model Component")
@@ -108,6 +138,10 @@ public:
     UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
     void StopGeneration();
 
+    //Drops a queued prompt or aborts it if it's running, no reply events fire for it. False if it already finished.
+    UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
+    bool CancelTask(int64 TaskId);
+
     UFUNCTION(BlueprintCallable, Category = "LLM Model Component")
     void ResumeGeneration();
 
@@ -118,6 +152,10 @@ public:
     UFUNCTION(BlueprintPure, Category = "LLM Model Component")
     FStructuredChatHistory GetStructuredChatHistory();
 
+    //Live frame time governor decisions, see ModelParams.Advanced.bUseFrameTimeGovernor
+    UFUNCTION(BlueprintPure, Category = "LLM Model Component")
+    FLlamaGovernorStats GetGovernorStats();
+
     //EChatTemplateRole LastRoleFromStructuredHistory();
 
 private:
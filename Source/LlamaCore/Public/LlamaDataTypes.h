@@ -13,14 +13,48 @@ enum class EChatTemplateRole : uint8
     Unknown = 255
 };
 
+//Why a generation ended
+UENUM(BlueprintType)
+enum class ELlamaStopReason : uint8
+{
+    EndOfGeneration,    //model emitted end of generation
+    StopSequence,       //one of StopSequences appeared
+    MaxTokens,          //hit the prompt's MaxTokens
+    Deadline,           //hit the prompt's DeadlineMs
+    Stopped,            //StopGeneration was called
+    Error
+};
+
+//Which lane of the LLM thread queue a prompt runs in
+UENUM(BlueprintType)
+enum class ELlamaTaskPriority : uint8
+{
+    Interactive,        //player facing, always runs before queued background work
+    Background          //yields to queued interactive prompts between prompt chunks and tokens a few times at most, its reply is only emitted once complete
+};
+
+//OS thread priority. ggml compute threads can't go below Normal, lower values map to Normal for them.
+UENUM(BlueprintType)
+enum class ELlamaThreadPriority : uint8
+{
+    Lowest,
+    BelowNormal,
+    Normal,
+    AboveNormal,
+    Highest
+};
+
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnErrorSignature, const FString&, ErrorMessage);
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnTokenGeneratedSignature, const FString&, Token);
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnResponseGeneratedSignature, const FString&, Response);
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FModelNameSignature, const FString&, ModelName);
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnPartialSignature, const FString&, Partial);
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnPromptHistorySignature, FString, History);
-DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FOnEndOfStreamSignature, bool, bStopSequenceTriggered, float, TokensPerSecond);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_ThreeParams(FOnEndOfStreamSignature, bool, bStopSequenceTriggered, float, TokensPerSecond, ELlamaStopReason, StopReason);
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_ThreeParams(FOnPromptProcessedSignature, int32, TokensProcessed, EChatTemplateRole, Role, float, TokensPerSecond);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_ThreeParams(FOnPromptProgressSignature, int32, TokensProcessed, int32, TokensTotal, EChatTemplateRole, Role);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnModelLoadProgressSignature, float, Progress);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FOnSessionSignature, const FString&, SessionPath, bool, bSuccess);
 DECLARE_DYNAMIC_MULTICAST_DELEGATE(FVoidEventSignature);
 
 USTRUCT(BlueprintType)
@@ -42,6 +76,21 @@ struct FLlamaRunTimings
 
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Advanced Params")
     float TokensPerSecond = 0.f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Advanced Params")
+    int32 TokensGenerated = 0;
+
+    //Speculative decoding only: share of drafted tokens the main model accepted
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Advanced Params")
+    float DraftAcceptanceRate = 0.f;
+
+    //Speculative decoding only: generated tokens per main model decode, 1 is the plain one token per decode loop.
+    //Not a wall clock speedup, draft decodes and the larger verification batches aren't counted, compare TokensPerSecond for that.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Advanced Params")
+    float TokensPerMainDecode = 0.f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Advanced Params")
+    ELlamaStopReason StopReason = ELlamaStopReason::EndOfGeneration;
 };
 
 
@@ -122,6 +171,124 @@ struct FLLMModelAdvancedParams
     //usually . ? !
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params")
     TArray<FString> PartialsSeparators;
+
+    //When the context fills up, evict the oldest messages (system prompt stays pinned) and keep going instead of stopping
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Context")
+    bool bShiftContextWhenFull = false;
+
+    //Attention sink tokens at the start of context that are never evicted. Only used if there is no system prompt to pin.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Context")
+    int32 ContextShiftKeepTokens = 4;
+
+    //Components loading the same model share one context, each gets its own sequence and their decodes are batched together
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Batching")
+    bool bUseSharedBatchedContext = false;
+
+    //Sequences in the shared context, each one gets MaxContextLength. Falls back to an own context when all are taken.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Batching")
+    int32 SharedContextMaxSequences = 8;
+
+    //Extra sequences in the shared context that keep decoded first messages (lore, rules, tools) alive for new conversations to fork from. 0 disables.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Batching")
+    int32 PrefixCacheSlots = 2;
+
+    //Shorter prefixes are cheaper to prefill than to track
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Batching")
+    int32 PrefixCacheMinTokens = 64;
+
+    //Most tokens proposed per speculative step
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Speculative")
+    int32 SpeculativeDraftMax = 8;
+
+    //Draft model stops proposing once its top candidate is less likely than this
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Speculative")
+    float SpeculativeDraftMinP = 0.75f;
+
+    //Draft-free speculation: propose tokens that followed the latest ngram match in context. Good for replies quoting names, lists or lore.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Speculative")
+    bool bUsePromptLookupDecoding = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Speculative")
+    int32 PromptLookupMinNgram = 2;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Speculative")
+    int32 PromptLookupMaxNgram = 4;
+
+    //Time OnTick may spend running game thread callbacks, leftovers run next tick. At least one callback runs per tick. 0 = no limit.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading")
+    float GameThreadBudgetMs = 2.f;
+
+    //Most game thread callbacks per tick, 0 = no limit
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading")
+    int32 MaxGameThreadTasksPerTick = 0;
+
+    //Threads for prompt processing (n_threads_batch), 0 = Threads. Prefill is compute bound and scales with cores.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading")
+    int32 PrefillThreads = 0;
+
+    //Threads for generating tokens (n_threads), 0 = Threads. Generation is memory bound, fewer threads often cost nothing.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading")
+    int32 DecodeThreads = 0;
+
+    //n_ubatch, prompts are decoded in chunks of this size so smaller chunks also stop sooner. 0 = llama.cpp default (512).
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading")
+    int32 MicroBatchLength = 0;
+
+    //Run compute on our own ggml threadpools with the affinity and priority below. Own context only, the shared context keeps ggml's defaults.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading")
+    bool bUseDedicatedThreadpool = false;
+
+    //Cores for generation threads, hex mask (0xF0) or range (4-7). Empty = no pinning.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading", meta = (EditCondition = "bUseDedicatedThreadpool"))
+    FString DecodeCpuMask;
+
+    //Cores for prompt processing threads, same format as DecodeCpuMask
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading", meta = (EditCondition = "bUseDedicatedThreadpool"))
+    FString PrefillCpuMask;
+
+    //Pin each thread to its own core of the mask instead of letting them float within it
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading", meta = (EditCondition = "bUseDedicatedThreadpool"))
+    bool bStrictCpuPlacement = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading", meta = (EditCondition = "bUseDedicatedThreadpool"))
+    ELlamaThreadPriority ComputeThreadPriority = ELlamaThreadPriority::Normal;
+
+    //0 sleeps between decodes, up to 100 spins for lower latency at the cost of keeping the cores busy
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading", meta = (EditCondition = "bUseDedicatedThreadpool"))
+    int32 ThreadpoolPollLevel = 0;
+
+    //Thread that runs our queued tasks and drives llama_decode
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Threading")
+    ELlamaThreadPriority LLMThreadPriority = ELlamaThreadPriority::Normal;
+
+    //Slow generation down while game thread frames run over GovernorTargetFrameMs: fewer decode threads first, then a sleep per token
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Governor")
+    bool bUseFrameTimeGovernor = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Governor", meta = (EditCondition = "bUseFrameTimeGovernor"))
+    float GovernorTargetFrameMs = 16.6f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Governor", meta = (EditCondition = "bUseFrameTimeGovernor"))
+    int32 GovernorMinDecodeThreads = 1;
+
+    //Sleep per token when fully throttled
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Governor", meta = (EditCondition = "bUseFrameTimeGovernor"))
+    float GovernorMaxYieldMs = 20.f;
+
+    //Generation never runs faster than this, e.g. to match TTS playback. Applies without the governor too. 0 = uncapped.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Governor")
+    float MaxTokensPerSecond = 0.f;
+
+    //Probes thread counts and micro batch sizes on first load and uses the fastest, overriding DecodeThreads, PrefillThreads
+    //and MicroBatchLength. Results are cached in Saved/Autotune per model, machine and context setup, delete them to probe again.
+    //A model another component already loaded is never probed, it only picks up cached results.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Loading")
+    bool bAutotuneOnLoad = false;
+
+    //Runs one throwaway decode after loading so weights are paged in and compute buffers allocated before OnModelLoaded.
+    //Makes the load slower and the first prompt faster.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params - Loading")
+    bool bWarmupOnLoad = true;
 };
 
 USTRUCT(BlueprintType)
@@ -213,6 +380,10 @@ struct FLLMModelParams
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params")
     FString PathToModel = "./model.gguf";
 
+    //Optional small model sharing the main model's vocab, proposes tokens for speculative decoding. Empty disables. Same path rules as PathToModel.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params")
+    FString PathToDraftModel = "";
+
     //Gets embedded on first input after a model load
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params", meta=(MultiLine=true))
     FString SystemPrompt = "You are a helpful assistant.";
@@ -228,7 +399,7 @@ struct FLLMModelParams
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params")
     EChatTemplateRole ModelRole = EChatTemplateRole::Assistant;
 
-    //Additional stop sequences - not currently active
+    //Additional stop sequences, generation ends as soon as one appears. The match is removed from the reply and the context.
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model Params")
     TArray<FString> StopSequences;
 
@@ -251,13 +422,41 @@ struct FLLMModelParams
     FLLMModelAdvancedParams Advanced;
 };
 
+//What the frame time governor is currently doing
+USTRUCT(BlueprintType)
+struct FLlamaGovernorStats
+{
+    GENERATED_USTRUCT_BODY();
+
+    //Smoothed game thread frame time it reacts to
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Governor Stats")
+    float FrameTimeMs = 0.f;
+
+    //0 = full speed, 1 = fully throttled
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Governor Stats")
+    float ThrottleLevel = 0.f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Governor Stats")
+    int32 DecodeThreads = 0;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Governor Stats")
+    float YieldMsPerToken = 0.f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Governor Stats")
+    float TokensPerSecondCap = 0.f;
+
+    //Times it had to back off since the component started
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Governor Stats")
+    int32 ThrottleSteps = 0;
+};
+
 //Current State
 USTRUCT(BlueprintType)
 struct FLLMModelState
 {
     GENERATED_USTRUCT_BODY();
 
-    //The raw context history with formatting applied
+    //The raw context history with formatting applied. Converted lazily, read it via RawContextHistory() for the latest.
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model State")
     FString ContextHistory;
 
@@ -284,8 +483,89 @@ struct FLLMModelState
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model State")
     EChatTemplateRole LastRole = EChatTemplateRole::Unknown;
 
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model State")
+    ELlamaStopReason LastStopReason = ELlamaStopReason::EndOfGeneration;
+
+    //Prefix cache of the shared context, counts are for all components sharing it
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model State")
+    int32 PrefixCacheHits = 0;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model State")
+    int32 PrefixCacheMisses = 0;
+
+    //Prompt tokens that didn't need prefilling thanks to the prefix cache
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model State")
+    int64 PrefixCacheTokensReused = 0;
+
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model State")
     FJinjaChatTemplate ChatTemplateInUse;
+
+    //Game thread callbacks still queued after the last tick, grows when the LLM thread outpaces the tick budget
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model State")
+    int32 GameThreadTasksPending = 0;
+
+    //Ticks that ran out of budget with callbacks left over
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model State")
+    int32 GameThreadBudgetOverruns = 0;
+
+    //Tokens dropped because the game thread didn't drain the token stream in time
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Model State")
+    int64 TokenEventsDropped = 0;
+};
+
+//Sampler settings for a single request, same meaning as the matching FLLMModelAdvancedParams fields
+USTRUCT(BlueprintType)
+struct FLlamaSamplingParams
+{
+    GENERATED_USTRUCT_BODY();
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    float Temp = 0.80f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    float MinP = 0.05f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    int32 TopK = -1;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    float TopP = -1.f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    float TypicalP = -1.f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    int32 PenaltyLastN = 0;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    float PenaltyRepeat = 1.f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    float PenaltyFrequency = 0.f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    float PenaltyPresence = 0.f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    int32 Mirostat = -1;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    float MirostatTau = 5.f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    float MirostatEta = 0.1f;
+
+    //-1 = random
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM Sampling Params")
+    int32 Seed = -1;
+
+    bool operator==(const FLlamaSamplingParams& Other) const
+    {
+        return Temp == Other.Temp && MinP == Other.MinP && TopK == Other.TopK && TopP == Other.TopP && TypicalP == Other.TypicalP &&
+            PenaltyLastN == Other.PenaltyLastN && PenaltyRepeat == Other.PenaltyRepeat &&
+            PenaltyFrequency == Other.PenaltyFrequency && PenaltyPresence == Other.PenaltyPresence &&
+            Mirostat == Other.Mirostat && MirostatTau == Other.MirostatTau && MirostatEta == Other.MirostatEta && Seed == Other.Seed;
+    }
 };
 
 USTRUCT()
@@ -297,6 +577,24 @@ struct FLLMThreadTask
 
     UPROPERTY()
     int64 TaskId = 0;
+
+    //Token stream events pushed before this task, they get emitted before the task runs
+    UPROPERTY()
+    int64 TokenSequence = 0;
+
+    UPROPERTY()
+    ELlamaTaskPriority Priority = ELlamaTaskPriority::Interactive;
+
+    //BG tasks only, cancelling aborts the task's decodes or skips it if it hasn't started
+    TSharedPtr<class FLlamaCancelToken, ESPMode::ThreadSafe> CancelToken;
+
+    //Set once the task reported its prompt, a preempted rerun decodes it again but doesn't emit it twice
+    UPROPERTY()
+    bool bPromptReported = false;
+
+    //Times the task was rolled back for interactive work
+    UPROPERTY()
+    int32 Preemptions = 0;
 };
 
 
@@ -322,6 +620,27 @@ public:
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Chat")
     bool bGenerateReply = true;
 
+    /** Most tokens to generate for the reply, 0 = until end of generation */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Chat")
+    int32 MaxTokens = 0;
+
+    /** Wall clock budget in milliseconds from when the prompt starts processing, the reply ends at the next token after.
+    * A prompt still being processed at the deadline is rolled back between chunks and the reply ends empty. 0 = none */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Chat")
+    int32 DeadlineMs = 0;
+
+    /** Sample this reply with Sampling instead of the model's params, no reload needed */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Chat")
+    bool bOverrideSampling = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Chat", meta = (EditCondition = "bOverrideSampling"))
+    FLlamaSamplingParams Sampling;
+
+    /** Background prompts wait for interactive ones and get rolled back and rerun if an interactive prompt arrives mid way.
+    * Their replies don't stream through OnTokenGenerated or OnPartialGenerated, only the finished response is emitted. */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Chat")
+    ELlamaTaskPriority Priority = ELlamaTaskPriority::Interactive;
+
     FLlamaChatPrompt() {}
 
     FLlamaChatPrompt(const FString& InPrompt, EChatTemplateRole InRole = EChatTemplateRole::User, bool bInAddAssistantBOS = false, bool bInGenerateReply = true)
@@ -16,36 +16,52 @@ class LLAMACORE_API FLlamaNative
 public:
 
 	//Callbacks
-	TFunction<void(const FString& Token)> OnTokenGenerated;
+	//Token and partial streams only carry interactive replies, background prompts may be rolled back and only emit OnResponseGenerated
+	TFunction<void(const FString& Token)> OnTokenGenerated;		//tokens are coalesced per tick, may contain several tokens
 	TFunction<void(const FString& Partial)> OnPartialGenerated;		//usually considered sentences, good for TTS.
 	TFunction<void(const FString& Response)> OnResponseGenerated;	//per round
 	TFunction<void(int32 TokensProcessed, EChatTemplateRole ForRole, float Speed)> OnPromptProcessed;	//when an inserted prompt has finished processing (non-generation prompt)
+	TFunction<void(int32 TokensProcessed, int32 TokensTotal, EChatTemplateRole ForRole)> OnPromptProgress;	//per chunk progress while a long prompt is being processed
 	TFunction<void()> OnGenerationStarted;
 	TFunction<void(const FLlamaRunTimings& Timings)> OnGenerationFinished;
 	TFunction<void(const FString& ErrorMessage)> OnError;
 	TFunction<void(const FLLMModelState& UpdatedModelState)> OnModelStateChanged;
+	TFunction<void(float Progress)> OnModelLoadProgress;	//0-1 while the model file is read, ends on 1 before the load callback
 
 	//Expected to be set before load model
 	void SetModelParams(const FLLMModelParams& Params);
 
-	//Loads the model found at ModelParams.PathToModel, use SetModelParams to specify params before loading
+	//Loads the model found at ModelParams.PathToModel, use SetModelParams to specify params before loading.
+	//StatusCode is 0 on success, -1 on failure and -2 if cancelled.
 	void LoadModel(TFunction<void(const FString&, int32 StatusCode)> ModelLoadedCallback = nullptr);
+
+	//Aborts the pending or in-flight LoadModel calls, they report StatusCode -2. Loads enqueued afterwards are unaffected. Threadsafe.
+	void CancelModelLoad();
 	void UnloadModel(TFunction<void(int32 StatusCode)> ModelUnloadedCallback = nullptr);
 	bool IsModelLoaded();
 
-	//Prompt input
-	void InsertTemplatedPrompt(const FLlamaChatPrompt& Prompt, 
+	//Applies MaxContextLength, MaxBatchLength, thread and shared context settings of Params without reloading the weights.
+	//The conversation is kept if it fits the new context.
+	void ReconfigureContext(const FLLMModelParams& Params, TFunction<void(int32 StatusCode)> OnReconfigured = nullptr);
+
+	//Prompt input, returns a task handle for CancelTask or -1 if nothing was queued. Prompt.Priority picks the queue lane.
+	int64 InsertTemplatedPrompt(const FLlamaChatPrompt& Prompt, 
 		TFunction<void(const FString& Response)>OnResponseFinished = nullptr);
-	void InsertRawPrompt(const FString& Prompt, bool bGenerateReply = true, 
+	int64 InsertRawPrompt(const FString& Prompt, bool bGenerateReply = true, 
 		TFunction<void(const FString& Response)>OnResponseFinished = nullptr);
+
+	//Skips the task if it's still queued or aborts it mid decode if it's running. Its OnResponseFinished and
+	//OnResponseGenerated won't fire, tokens and partials streamed before the cancel were already delivered.
+	//Returns false if the task already finished. Threadsafe.
+	bool CancelTask(int64 TaskId);
 	bool IsGenerating();
 	void StopGeneration();
 	void ResumeGeneration();
 
-	//if you've queued up a lot of BG tasks, you can clear the queue with this call
+	//if you've queued up a lot of BG tasks, you can clear the queue with this call. The running task is left alone.
 	void ClearPendingTasks(bool bClearGameThreadCallbacks = false);
 
-	//tick forward for safely consuming game thread messages without hanging
+	//tick forward for safely consuming game thread messages without hanging, bounded by ModelParams.Advanced.GameThreadBudgetMs
 	void OnTick(float DeltaTime);
 
 	//Context change - not yet implemented
@@ -57,43 +73,82 @@ public:
 	//Todo: Use this api + state checks to use RemoveLastInput and RemoveLastReply wrappers.
 	void RemoveLastNMessages(int32 MessageCount);	//rollback
 
+	//Persist/restore the whole conversation incl. KV cache so it resumes without re-decoding. Relative paths go to Saved/Sessions.
+	void SaveSession(const FString& SessionPath, bool bCompress = true, TFunction<void(const FString& SessionPath, int32 StatusCode)> OnSaved = nullptr);
+	void LoadSession(const FString& SessionPath, TFunction<void(const FString& SessionPath, int32 StatusCode)> OnLoaded = nullptr);
+
 	//Pure query of current context - not threadsafe, be careful when these get called - TBD: make it safe
 	void SyncPassedModelStateToNative(FLLMModelState& StateToSync);
 
+	//Game thread. ModelState.ContextHistory is only converted from the latest snapshot when read through here.
+	const FString& RawContextHistory();
+
+	//Game thread, what the frame time governor decided on the last tick
+	const FLlamaGovernorStats& GovernorStats();
+
 	FString WrapPromptForRole(const FString& Text, EChatTemplateRole Role, const FString& OverrideTemplate, bool bAddAssistantBoS = false);
 
 	FLlamaNative();
 	~FLlamaNative();
 
-	float ThreadIdleSleepDuration = 0.005f; //5ms sleep timer for BG thread
-
 protected:
 
 	//can be safely called on game thread or the bg thread, handles either logic
 	void SyncModelStateToInternal(TFunction<void()>AdditionalGTStateUpdates = nullptr);
 
 	//utility functions, only safe to call on bg thread
-	int32 RawContextHistory(FString& OutContextString);
-	void GetStructuredChatHistory(FStructuredChatHistory& OutChatHistory);
+	void PublishStateSnapshot();
 	int32 UsedContextLength();
 
+	//Applies what changed since the last applied snapshot to ModelState, game thread only
+	void ApplyStateSnapshot();
+
+	//Versioned state handoff, the LLM thread publishes and the game thread reads without locking
+	TUniquePtr<class FLlamaStateSnapshotBuffer> StateSnapshots;
+	uint64 PublishedStateVersion = 0;						//BG
+	TSharedPtr<const struct FLlamaHistoryChunk> PublishedHistoryTail;	//BG
+	const struct FLlamaStateSnapshot* AppliedSnapshot = nullptr;	//GT, stays valid until the next acquire
+	bool bContextHistoryStale = false;						//GT
+
 	//GT State - safely accesible on game thread
 	FLLMModelParams ModelParams;
 	FLLMModelState ModelState;
 
-	//BG State
-	FString CombinedPieceText;	//accumulates tokens into full string during per-token inference.
+	//Frame time governor, updated in OnTick and consulted by the LLM thread before each generated token
+	TUniquePtr<class FLlamaGenerationGovernor> Governor;
+
+	//Tokens stream through a preallocated ring instead of a GT task per token, drained and converted once per tick
+	TUniquePtr<struct FLlamaTokenStreamState> TokenStream;
+	void FlushTokenStream(int64 UpToEvent);
 
 	//Threading
 	void StartLLMThread();
-	TQueue<FLLMThreadTask> BackgroundTasks;
+	TQueue<FLLMThreadTask> BackgroundTasks[2];		//one lane per ELlamaTaskPriority, interactive drains first
+	TOptional<FLLMThreadTask> PreemptedTask;		//BG, background task that yielded, reruns before the rest of its lane
+	ELlamaTaskPriority RunningPriority = ELlamaTaskPriority::Interactive;	//BG
+	bool bRunningPromptReported = false;	//BG, running task's bPromptReported
+	int32 RunningPreemptions = 0;			//BG, running task's Preemptions
+	bool DequeueNextTask(FLLMThreadTask& OutTask);
 	TQueue<FLLMThreadTask> GameThreadTasks;
-	FThreadSafeBool bThreadIsActive = false;
-	FThreadSafeBool bThreadShouldRun = false;
+	FThreadSafeCounter PendingGameThreadTasks = 0;
+	float LastModelLoadProgress = 0.f;	//BG, throttles load progress tasks
+	TUniquePtr<class FLlamaWorkerThread> LLMThread;	//sleeps until EnqueueBGTask wakes it
 	FThreadSafeCounter TaskIdCounter = 0;
 	int64 GetNextTaskId();
 
-	void EnqueueBGTask(TFunction<void(int64)> Task);
+	//Cancel tokens of queued and running BG tasks by TaskId, the running one is swapped by the LLM thread around every task
+	FCriticalSection TaskMutex;
+	TMap<int64, TSharedPtr<class FLlamaCancelToken, ESPMode::ThreadSafe>> CancelTokens;
+	TSharedPtr<class FLlamaCancelToken, ESPMode::ThreadSafe> RunningCancelToken;
+	TSet<int64> ModelLoadTasks;				//queued and running LoadModel tasks, CancelModelLoad cancels their tokens
+	TSet<int64> PendingInteractivePrompts;	//queued and not cancelled, running background tasks yield while there are any
+	void SetRunningTask(const TSharedPtr<class FLlamaCancelToken, ESPMode::ThreadSafe>& CancelToken);
+	TSharedPtr<class FLlamaCancelToken, ESPMode::ThreadSafe> GetRunningTask();
+	void ForgetTask(int64 TaskId);
+	bool IsModelLoadTask(const TSharedPtr<class FLlamaCancelToken, ESPMode::ThreadSafe>& CancelToken);
+
+	//bIsPrompt marks interactive work a running background task yields to
+	int64 EnqueueBGTask(TFunction<void(int64)> Task, ELlamaTaskPriority Priority = ELlamaTaskPriority::Interactive, bool bIsPrompt = false);
 	void EnqueueGTTask(TFunction<void()> Task, int64 LinkedTaskId = -1);
 
 	class FLlamaInternal* Internal = nullptr;
@@ -9,6 +9,13 @@ public:
 	static FString ModelsRelativeRootPath();
 	static FString ParsePathIntoFullPath(const FString& InRelativeOrAbsolutePath);
 
+	//Same rules as model paths but relative to Saved/Sessions
+	static FString SessionsRelativeRootPath();
+	static FString ParseSessionPathIntoFullPath(const FString& InRelativeOrAbsolutePath);
+
+	//Saved/Autotune, cached thread and batch probe results
+	static FString AutotuneRootPath();
+
 	//Utility function for debugging model location and file enumeration
 	static TArray<FString> DebugListDirectoryContent(const FString& InPath);
 };
@@ -23,5 +30,8 @@ public:
 	static bool IsSentenceEndingPunctuation(const TCHAR Char);
 	static FString GetLastSentence(const FString& InputString);
 
+	//Length of Text without a trailing incomplete multi-byte sequence, tokens may split characters
+	static int32 CompleteUtf8Length(const char* Text, int32 Length);
+
 	static void AppendToCharVector(std::vector<char>& VectorHistory, const std::string& Text);
 };
\ No newline at end of file